@@ -0,0 +1,493 @@
+// Benchmarks the block engines, key expansion and file modes, and prints the
+// results as JSON.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "io.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#define MAX_THREAD_COUNTS 16
+#define MAX_SAMPLES 1000
+#define MIN_SAMPLES 3
+
+// key expansions timed together per sample, as one is too short to measure
+#define KEY_BATCH 1000
+
+// keys per call to KeyExpansionBulk()
+#define KEY_BULK 64
+
+// The cache benchmark evicts the tables before every run by walking a buffer
+// larger than the last-level cache, on messages up to CACHE_MAX_SIZE bytes.
+#define CACHE_EVICT_SIZE ((size_t)64 << 20)
+#define CACHE_MAX_SIZE 4096
+
+typedef struct BenchOptions {
+    size_t min_size;
+    size_t max_size;
+    double min_time;
+    unsigned threads[MAX_THREAD_COUNTS];
+    unsigned thread_count;
+    int run_engine;
+    int run_key;
+    int run_file;
+    int run_cache;
+    const char *engine;
+    const char *directory;
+} BenchOptions;
+
+typedef struct Samples {
+    double seconds[MAX_SAMPLES];
+    unsigned count;
+    uint64_t cycles;
+} Samples;
+
+typedef void BenchFunction(void *context);
+
+typedef struct EngineJob {
+    unsigned Nr;
+    const KeySchedule *key;
+    const word *in;
+    word *out;
+    size_t blocks;
+    size_t blocks_per_task;
+    int inverse;
+} EngineJob;
+
+typedef struct FileJob {
+    unsigned Nk;
+    const char *key;
+    const char *in_dir;
+    const char *out_dir;
+    CipherOptions options;
+} FileJob;
+
+static const char *const engine_names[] = {"aesni", "bitslice", "table", "compact"};
+static const OperationMode modes[] = {MODE_ECB, MODE_CTR, MODE_GCM};
+static const char *const mode_names[] = {"ecb", "ctr", "gcm"};
+static const unsigned key_sizes[] = {4, 6, 8};
+static const char key_hex[] = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+static const char iv_hex[] = "000102030405060708090a0b0c0d0e0f";
+
+static int first_result = 1;
+
+static void usage(const char *name, int is_failure);
+static size_t parse_size(const char *str);
+static void parse_threads(const char *str, BenchOptions *options);
+static void fill_random(byte data[], size_t length);
+static uint64_t read_cycles(void);
+static void measure(BenchFunction *function, void *context, double min_time, Samples *samples);
+static void measure_cold(BenchFunction *function, void *context, volatile byte evict[], double min_time, Samples *samples);
+static void print_result(const char *benchmark, const char *name, const char *operation, unsigned key_bits, size_t size, unsigned threads, size_t bytes, Samples *samples);
+static void bench_engines(const BenchOptions *options);
+static void bench_key_expansion(const BenchOptions *options);
+static void bench_files(const BenchOptions *options);
+static void bench_cache(const BenchOptions *options);
+
+int main(int argc, char **argv) {
+    BenchOptions options = {16, (size_t)1 << 30, 0.2};
+    int suite_set = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0], 0);
+        } else if (strcmp(argv[i], "-suite") == 0 && i + 1 < argc) {
+            ++i;
+            suite_set = 1;
+            if (strcmp(argv[i], "engine") == 0) {
+                options.run_engine = 1;
+            } else if (strcmp(argv[i], "key") == 0) {
+                options.run_key = 1;
+            } else if (strcmp(argv[i], "file") == 0) {
+                options.run_file = 1;
+            } else if (strcmp(argv[i], "cache") == 0) {
+                options.run_cache = 1;
+            } else {
+                error(": Unknown suite.", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-min-size") == 0 && i + 1 < argc) {
+            if (!(options.min_size = parse_size(argv[++i]))) error(": Invalid size.", argv[i]);
+        } else if (strcmp(argv[i], "-max-size") == 0 && i + 1 < argc) {
+            if (!(options.max_size = parse_size(argv[++i]))) error(": Invalid size.", argv[i]);
+        } else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) {
+            options.min_time = strtod(argv[++i], NULL);
+            if (!(options.min_time > 0)) error(": Invalid time.", argv[i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            parse_threads(argv[++i], &options);
+        } else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+            options.engine = argv[++i];
+            if (!select_engine(options.engine)) error(": Engine not available.", options.engine);
+        } else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc) {
+            options.directory = argv[++i];
+        } else {
+            usage(argv[0], 1);
+        }
+    }
+
+    if (!suite_set) options.run_engine = options.run_key = options.run_file = options.run_cache = 1;
+    if (!options.directory) options.directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    if (!options.thread_count) {
+        // powers of two up to the number of processors, and that number itself
+        const unsigned cores = get_thread_count(0);
+        for (unsigned t = 1; t < cores && options.thread_count < MAX_THREAD_COUNTS - 1; t *= 2) {
+            options.threads[options.thread_count++] = t;
+        }
+        options.threads[options.thread_count++] = cores;
+    }
+
+    printf("{\n");
+    printf("  \"cores\": %u,\n", get_thread_count(0));
+    printf("  \"cycles\": \"%s\",\n", HAVE_CYCLES ? "tsc" : "none");
+    printf("  \"results\": [");
+
+    if (options.run_key) bench_key_expansion(&options);
+    if (options.run_engine) bench_engines(&options);
+    if (options.run_cache) bench_cache(&options);
+    if (options.run_file) bench_files(&options);
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+static void usage(const char *name, int is_failure) {
+    fprintf(
+        is_failure ? stderr : stdout,
+        "Usage:\n"
+        "    %s [-suite {engine|key|file|cache}]... [-min-size <size>] [-max-size <size>]\n"
+        "        [-time <seconds>] [-j <threads>[,<threads>]...] [-engine <name>]\n"
+        "        [-dir <directory>]\n"
+        "\n"
+        "Options:\n"
+        "      -suite    Runs only the given benchmarks: \"engine\" (block engines on \n"
+        "                    memory), \"key\" (key expansion), \"file\" (file modes) \n"
+        "                    or \"cache\" (block engines on small messages, with their \n"
+        "                    tables evicted from the caches before every run). By \n"
+        "                    default, all of them are run.\n"
+        "   -min-size    Smallest message size, 16 by default.\n"
+        "   -max-size    Largest message size, 1G by default. Sizes grow by a factor \n"
+        "                    of 4 and accept K, M and G suffixes.\n"
+        "       -time    Minimum time spent on each measurement, 0.2 by default.\n"
+        "          -j    Thread counts to measure, by default powers of two up to \n"
+        "                    the number of processors.\n"
+        "     -engine    Measures only the given engine.\n"
+        "        -dir    Directory for the files of the file benchmark, $TMPDIR or \n"
+        "                    /tmp by default.\n"
+        "\n"
+        "The results are printed to the standard output as JSON.\n",
+        name);
+    exit(is_failure);
+}
+
+static size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str) return 0;
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        ++end;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        ++end;
+    } else if (*end == 'G' || *end == 'g') {
+        size <<= 30;
+        ++end;
+    }
+    if (*end || size > SIZE_MAX) return 0;
+    return (size_t)size;
+}
+
+static void parse_threads(const char *str, BenchOptions *options) {
+    const char *p = str;
+    while (*p) {
+        char *end;
+        long threads = strtol(p, &end, 10);
+        if (end == p || threads < 1 || threads > 1024 || (*end && *end != ',')) error(": Invalid thread counts.", str);
+        if (options->thread_count == MAX_THREAD_COUNTS) error(": Too many thread counts.", str);
+        options->threads[options->thread_count++] = (unsigned)threads;
+        p = *end ? end + 1 : end;
+    }
+}
+
+static void fill_random(byte data[], size_t length) {
+    uint64_t x = 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < length; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (byte)x;
+    }
+}
+
+static uint64_t read_cycles(void) {
+#if HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Runs function(context) until min_time has passed, keeping the time of every
+// run, with at least MIN_SAMPLES and at most MAX_SAMPLES runs.
+static void measure(BenchFunction *function, void *context, double min_time, Samples *samples) {
+    function(context);  // warm up caches, pages and the branch predictors
+
+    samples->count = 0;
+    samples->cycles = 0;
+    double total = 0;
+    while (samples->count < MAX_SAMPLES && (samples->count < MIN_SAMPLES || total < min_time)) {
+        const uint64_t c = read_cycles();
+        const double t = get_monotonic_time();
+        function(context);
+        const double elapsed = get_monotonic_time() - t;
+        samples->cycles += read_cycles() - c;
+        samples->seconds[samples->count++] = elapsed;
+        total += elapsed;
+    }
+}
+
+// As measure(), but evicts the caches before every run, which is not timed.
+static void measure_cold(BenchFunction *function, void *context, volatile byte evict[], double min_time, Samples *samples) {
+    samples->count = 0;
+    samples->cycles = 0;
+    double total = 0;
+    while (samples->count < MAX_SAMPLES && (samples->count < MIN_SAMPLES || total < min_time)) {
+        // a write to every line, so that the lines are not merely shared
+        for (size_t i = 0; i < CACHE_EVICT_SIZE; i += 64) evict[i] += 1;
+        const uint64_t c = read_cycles();
+        const double t = get_monotonic_time();
+        function(context);
+        const double elapsed = get_monotonic_time() - t;
+        samples->cycles += read_cycles() - c;
+        samples->seconds[samples->count++] = elapsed;
+        total += elapsed;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const Samples *samples, double p) {
+    return samples->seconds[(size_t)(p * (samples->count - 1) + 0.5)];
+}
+
+// bytes is the amount of data processed per run, for the throughput.
+static void print_result(const char *benchmark, const char *name, const char *operation, unsigned key_bits, size_t size, unsigned threads, size_t bytes, Samples *samples) {
+    qsort(samples->seconds, samples->count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (unsigned i = 0; i < samples->count; ++i) total += samples->seconds[i];
+    const double median = percentile(samples, 0.5);
+
+    printf("%s\n    {\"benchmark\": \"%s\", \"name\": \"%s\", \"operation\": \"%s\", \"key_bits\": %u, "
+           "\"size\": %zu, \"threads\": %u, \"samples\": %u, \"mb_per_s\": %.2f, ",
+           first_result ? "" : ",", benchmark, name, operation, key_bits, size, threads, samples->count,
+           median > 0 ? bytes / median / 1e6 : 0.0);
+    if (HAVE_CYCLES && bytes) {
+        printf("\"cycles_per_byte\": %.3f, ", (double)samples->cycles / ((double)bytes * samples->count));
+    } else {
+        printf("\"cycles_per_byte\": null, ");
+    }
+    printf("\"latency_ns\": {\"min\": %.0f, \"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f, \"mean\": %.0f}}",
+           samples->seconds[0] * 1e9, median * 1e9, percentile(samples, 0.9) * 1e9, percentile(samples, 0.99) * 1e9,
+           samples->seconds[samples->count - 1] * 1e9, total / samples->count * 1e9);
+    first_result = 0;
+    fflush(stdout);
+}
+
+static void key_expansion_run(void *context) {
+    const unsigned Nk = *(const unsigned *)context;
+    word key[MAX_NB] = {0};
+    KeySchedule schedule;
+    for (unsigned i = 0; i < KEY_BATCH; ++i) {
+        key[0] = i;
+        KeyExpansion(4, Nk + 6, key, Nk, &schedule);
+    }
+}
+
+// KEY_BATCH keys, rounded up to whole calls, into a few schedules in turn as
+// a key rotation would
+static void key_bulk_run(void *context) {
+    const unsigned Nk = *(const unsigned *)context;
+    static word keys[KEY_BULK * MAX_NB];
+    static KeySchedule schedules[KEY_BULK];
+    KeySchedule *pointers[KEY_BULK];
+    for (unsigned i = 0; i < KEY_BULK; ++i) pointers[i] = &schedules[i];
+    for (unsigned i = 0; i < KEY_BATCH; i += KEY_BULK) {
+        keys[0] = i;
+        KeyExpansionBulk(4, Nk + 6, KEY_BULK, keys, Nk, pointers);
+    }
+}
+
+static void bench_key_expansion(const BenchOptions *options) {
+    const unsigned bulk_keys = (KEY_BATCH + KEY_BULK - 1) / KEY_BULK * KEY_BULK;
+    for (size_t k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); ++k) {
+        unsigned Nk = key_sizes[k];
+        Samples samples;
+        measure(key_expansion_run, &Nk, options->min_time, &samples);
+        // report the time of a single expansion
+        for (unsigned i = 0; i < samples.count; ++i) samples.seconds[i] /= KEY_BATCH;
+        print_result("key", "KeyExpansion", "expand", 32 * Nk, 4 * Nk, 1, 0, &samples);
+
+        measure(key_bulk_run, &Nk, options->min_time, &samples);
+        for (unsigned i = 0; i < samples.count; ++i) samples.seconds[i] /= bulk_keys;
+        print_result("key", "KeyExpansionBulk", "expand", 32 * Nk, 4 * Nk, 1, 0, &samples);
+    }
+}
+
+static void engine_task(void *context, unsigned worker, size_t i) {
+    (void)worker;
+    const EngineJob *job = (const EngineJob *)context;
+    const size_t first = i * job->blocks_per_task;
+    const size_t blocks = job->blocks - first < job->blocks_per_task ? job->blocks - first : job->blocks_per_task;
+    if (job->inverse) {
+        InvCipherBlocks(4, job->Nr, blocks, job->in + 4 * first, job->out + 4 * first, job->key);
+    } else {
+        CipherBlocks(4, job->Nr, blocks, job->in + 4 * first, job->out + 4 * first, job->key);
+    }
+}
+
+static void engine_run(void *context) {
+    const EngineJob *job = (const EngineJob *)context;
+    const size_t tasks = (job->blocks + job->blocks_per_task - 1) / job->blocks_per_task;
+    if (tasks == 1) {
+        engine_task(context, 0, 0);
+    } else {
+        parallel_for((unsigned)tasks, tasks, engine_task, context);
+    }
+}
+
+static void bench_engines(const BenchOptions *options) {
+    byte *in = (byte *)alloc_buffer(options->max_size + 16);
+    byte *out = (byte *)alloc_buffer(options->max_size + 16);
+    fill_random(in, options->max_size + 16);
+
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (options->engine && strcmp(options->engine, engine_names[e]) != 0) continue;
+        if (!select_engine(engine_names[e])) continue;
+
+        for (size_t k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); ++k) {
+            const unsigned Nk = key_sizes[k];
+            word key[MAX_NB];
+            memcpy(key, in, sizeof(key));
+            KeySchedule schedule;
+            KeyExpansion(4, Nk + 6, key, Nk, &schedule);
+
+            for (size_t size = options->min_size; size <= options->max_size; size *= 4) {
+                for (unsigned t = 0; t < options->thread_count; ++t) {
+                    const unsigned threads = options->threads[t];
+                    const size_t blocks = (size + 15) / 16;
+                    // threads beyond the number of blocks would have nothing to do
+                    if (threads > 1 && threads > blocks) continue;
+
+                    EngineJob job = {Nk + 6, &schedule, (const word *)in, (word *)out, blocks, (blocks + threads - 1) / threads};
+                    for (job.inverse = 0; job.inverse <= 1; ++job.inverse) {
+                        Samples samples;
+                        measure(engine_run, &job, options->min_time, &samples);
+                        print_result("engine", engine_names[e], job.inverse ? "decrypt" : "encrypt", 32 * Nk, size, threads, 16 * blocks, &samples);
+                    }
+                }
+            }
+        }
+    }
+
+    select_engine(options->engine);
+    free(in);
+    free(out);
+}
+
+// The engines on a single thread, run cold: their throughput then depends on
+// how many cache lines of tables they have to fetch, which the same sizes in
+// the engine benchmark, run warm, do not show.
+static void bench_cache(const BenchOptions *options) {
+    const size_t max_size = options->max_size < CACHE_MAX_SIZE ? options->max_size : CACHE_MAX_SIZE;
+    byte *in = (byte *)alloc_buffer(max_size + 16);
+    byte *out = (byte *)alloc_buffer(max_size + 16);
+    byte *evict = (byte *)alloc_buffer(CACHE_EVICT_SIZE);
+    fill_random(in, max_size + 16);
+    memset(evict, 0, CACHE_EVICT_SIZE);
+
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (options->engine && strcmp(options->engine, engine_names[e]) != 0) continue;
+        if (!select_engine(engine_names[e])) continue;
+
+        for (size_t k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); ++k) {
+            const unsigned Nk = key_sizes[k];
+            word key[MAX_NB];
+            memcpy(key, in, sizeof(key));
+            KeySchedule schedule;
+            KeyExpansion(4, Nk + 6, key, Nk, &schedule);
+
+            for (size_t size = options->min_size; size <= max_size; size *= 4) {
+                const size_t blocks = (size + 15) / 16;
+                EngineJob job = {Nk + 6, &schedule, (const word *)in, (word *)out, blocks, blocks};
+                for (job.inverse = 0; job.inverse <= 1; ++job.inverse) {
+                    Samples samples;
+                    measure_cold(engine_run, &job, evict, options->min_time, &samples);
+                    print_result("cache", engine_names[e], job.inverse ? "decrypt" : "encrypt", 32 * Nk, size, 1, 16 * blocks, &samples);
+                }
+            }
+        }
+    }
+
+    select_engine(options->engine);
+    free(in);
+    free(out);
+    free(evict);
+}
+
+static void file_run(void *context) {
+    const FileJob *job = (const FileJob *)context;
+    cipher_file(4, job->Nk, job->key, job->in_dir, job->out_dir, 1, &job->options);
+}
+
+static void bench_files(const BenchOptions *options) {
+    char in_dir[4096], out_dir[4096];
+    snprintf(in_dir, sizeof(in_dir), "%s/aes-bench-%ld.in", options->directory, (long)getpid());
+    snprintf(out_dir, sizeof(out_dir), "%s/aes-bench-%ld.out", options->directory, (long)getpid());
+
+    const size_t chunk_size = (size_t)1 << 20;
+    byte *chunk = (byte *)alloc_buffer(chunk_size);
+    fill_random(chunk, chunk_size);
+
+    for (size_t size = options->min_size; size <= options->max_size; size *= 4) {
+        FILE *file = fopen(in_dir, "wb");
+        if (!file) error(": Failed to create file.", in_dir);
+        for (size_t written = 0; written < size; written += chunk_size) {
+            const size_t length = size - written < chunk_size ? size - written : chunk_size;
+            if (fwrite(chunk, 1, length, file) != length) error(": Failed to write file.", in_dir);
+        }
+        fclose(file);
+
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+            for (size_t k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); ++k) {
+                for (unsigned t = 0; t < options->thread_count; ++t) {
+                    FileJob job = {key_sizes[k], key_hex, in_dir, out_dir, {modes[m]}};
+                    job.options.threads = options->threads[t];
+                    // GCM takes the recommended 96-bit IV
+                    if (modes[m] == MODE_CTR) job.options.iv = iv_hex;
+                    if (modes[m] == MODE_GCM) job.options.iv = iv_hex + 8;
+
+                    Samples samples;
+                    measure(file_run, &job, options->min_time, &samples);
+                    print_result("file", mode_names[m], "encrypt", 32 * key_sizes[k], size, options->threads[t], size, &samples);
+                }
+            }
+        }
+    }
+
+    remove(in_dir);
+    remove(out_dir);
+    free(chunk);
+}
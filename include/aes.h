@@ -1,6 +1,8 @@
 #ifndef AES_H_
 #define AES_H_
 
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t byte;
@@ -11,46 +13,232 @@ typedef union uword {
     byte bytes[4];
 } uword;
 
+// largest block and key sizes in words, and the rounds they need
+#define MAX_NB 8
+#define MAX_NR 14
+
+typedef struct KeySchedule KeySchedule;
+
+typedef void RoundsFunction(size_t n, const word in[], word out[], const KeySchedule *key);
+
+// Both directions of an expanded key, each stored flat with the words of round
+// r from r * Nb. The decryption schedule is that of the equivalent inverse
+// cipher, with InvMixColumns() applied to rounds 1 to Nr - 1. The table round
+// loops specialised for Nb and Nr are picked by KeyExpansion(), which also
+// packs both directions for the bitsliced engine when it is the one in use.
+struct KeySchedule {
+    alignas(64) word encryption[(MAX_NR + 1) * MAX_NB];
+    alignas(64) word decryption[(MAX_NR + 1) * MAX_NB];
+    alignas(64) uint64_t bitslice_encryption[MAX_NR + 1][8];
+    alignas(64) uint64_t bitslice_decryption[MAX_NR + 1][8];
+    unsigned Nb;
+    unsigned Nr;
+    int bitsliced;  // whether the bitslice_ round keys are set
+    RoundsFunction *cipher_rounds;
+    RoundsFunction *inv_cipher_rounds;
+};
+
 typedef enum Mode {
     UNDEFINED,
     CIPHER,
     INVCIPHER,
 } Mode;
 
+typedef enum OperationMode {
+    MODE_ECB,
+    MODE_CTR,
+    MODE_GCM,
+    MODE_CBC,
+    MODE_XTS,
+    MODE_CONTAINER,
+} OperationMode;
+
+// busy time of each stage of a streamed file, in seconds
+typedef struct StreamStats {
+    double read_time;
+    double cipher_time;
+    double write_time;
+    double wall_time;
+    int pipelined;
+} StreamStats;
+
+// part of an output, in bytes
+typedef struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+} ByteRange;
+
+typedef struct CipherOptions {
+    OperationMode mode;
+    const char *iv;
+    unsigned threads;
+    size_t buffer_size;
+    int memory_map;
+    StreamStats *stats;
+    size_t unit_size;         // XTS data unit or container chunk size, 0 for the default
+    const ByteRange *range;   // the part of the output wanted, or NULL for all
+    int legacy_key_order;     // key words after the first Nb byte-reversed
+} CipherOptions;
+
+typedef struct GcmState {
+    unsigned Nr;
+    const KeySchedule *key;
+    int clmul;
+    byte h[16];
+    byte j0[16];
+    byte counter[16];
+    byte y[16];
+    uint64_t aad_length;
+    uint64_t length;
+    uint64_t hl[16];
+    uint64_t hh[16];
+} GcmState;
+
+typedef void BlocksFunction(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+
+typedef struct Engine {
+    const char *name;
+    int (*supports)(unsigned Nb);
+    BlocksFunction *cipher_blocks;
+    BlocksFunction *inv_cipher_blocks;
+} Engine;
+
 // main.c begin
 
 extern int time_display;
 
 // end main.c
 
-// bytes.c begin
+// aesni.c begin
+
+extern const Engine aesni_engine;
+
+int aesni_expand_keys(unsigned Nr, size_t n, const word keys[], unsigned Nk, KeySchedule *const schedules[]);
+
+// end aesni.c
+
+// bitslice.c begin
 
-void change_endianness(unsigned Nb, word block[]);
+extern const Engine bitslice_engine;
 
-// end bytes.c
+void bitslice_pack_key_schedule(KeySchedule *schedule);
+word bitslice_sub_word(word w);
+word bitslice_inv_mix_column(word w);
+
+// end bitslice.c
+
+// cbc.c begin
+
+void cbc_encrypt(unsigned Nb, unsigned Nr, const KeySchedule *key, byte iv[], size_t length, const byte in[], byte out[]);
+void cbc_decrypt(unsigned Nb, unsigned Nr, const KeySchedule *key, byte iv[], size_t length, const byte in[], byte out[]);
+
+// end cbc.c
 
 // cipher.c begin
 
-word *Cipher(unsigned Nb, unsigned Nr, const word in[], word **key);
-word *InvCipher(unsigned Nb, unsigned Nr, const word in[], word **key);
+word *Cipher(unsigned Nb, unsigned Nr, const word in[], const KeySchedule *key);
+word *InvCipher(unsigned Nb, unsigned Nr, const word in[], const KeySchedule *key);
+
+void CipherBlocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+void InvCipherBlocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+
+void select_rounds(KeySchedule *schedule);
+
+extern const Engine table_engine;
+extern const Engine compact_engine;
 
 // end cipher.c
 
+// container.c begin
+
+#define CONTAINER_VERSION 1
+#define CONTAINER_MODE_GCM 1
+#define CONTAINER_HEADER_SIZE 24
+#define CONTAINER_TAG_SIZE 16
+#define CONTAINER_TRAILER_SIZE 32
+#define CONTAINER_MAX_CHUNK_SIZE ((uint32_t)1 << 24)
+
+typedef struct ContainerHeader {
+    uint32_t chunk_size;
+    byte nonce[12];
+} ContainerHeader;
+
+uint64_t container_load64(const byte p[]);
+void container_encode_header(const ContainerHeader *header, byte out[]);
+int container_decode_header(const byte in[], ContainerHeader *header);
+uint64_t container_chunk_count(const ContainerHeader *header, uint64_t length);
+uint64_t container_chunk_offset(const ContainerHeader *header, uint64_t chunk);
+void container_seal_chunk(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t chunk, size_t length, const byte in[], byte out[], byte tag[]);
+int container_open_chunk(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t chunk, size_t length, const byte in[], byte out[], const byte tag[]);
+void container_seal_index(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t length, byte out[]);
+size_t container_index_size(uint64_t chunks);
+int container_open_index(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, const byte index[], size_t index_size, uint64_t container_size, uint64_t *length);
+
+// end container.c
+
+// ctr.c begin
+
+void ctr_blocks(unsigned Nb, unsigned Nr, const KeySchedule *key, const byte iv[], uint64_t offset, size_t length, const byte in[], byte out[]);
+void ctr_counters(unsigned Nb, const byte iv[], uint64_t offset, size_t n, byte out[]);
+
+// end ctr.c
+
 // data.c begin
 
+// The table layout used by key expansion and by the table engine that serves
+// when no faster one does: four 1 KiB tables per direction (0), or a single
+// one with rotations and a byte-wide S-box (1, make TABLES=compact).
+#ifndef AES_COMPACT_TABLES
+#define AES_COMPACT_TABLES 0
+#endif
+
 extern const word Rcon[];
 extern const word s_box[4][256];
 extern const word inverse_s_box[4][256];
 extern const word cipher_table[4][256];
 extern const word inv_cipher_table[4][256];
 extern const word InvMixColumns_table[4][256];
+extern const word compact_cipher_table[256];
+extern const word compact_inv_cipher_table[256];
+extern const byte byte_s_box[256];
+extern const byte byte_inverse_s_box[256];
 
 // end data.c
 
+// engine.c begin
+
+const Engine *get_engine(unsigned Nb);
+int select_engine(const char *name);
+
+// end engine.c
+
+// gcm.c begin
+
+int ghash_select(const char *name);
+void gcm_init(GcmState *gcm, unsigned Nr, const KeySchedule *key, const byte iv[], size_t iv_length);
+void gcm_aad(GcmState *gcm, size_t length, const byte aad[]);
+void gcm_encrypt(GcmState *gcm, size_t length, const byte in[], byte out[]);
+void gcm_decrypt(GcmState *gcm, size_t length, const byte in[], byte out[]);
+void gcm_finish(GcmState *gcm, byte tag[]);
+int gcm_tag_equal(const byte a[], const byte b[]);
+
+// end gcm.c
+
+// hex.c begin
+
+int hex_select(const char *name);
+int hex_decode(const char hex[], size_t length, byte out[]);
+void hex_encode(const byte in[], size_t length, char hex[]);
+size_t hex_strip(const char str[], size_t length, char out[]);
+
+// end hex.c
+
 // interface.c begin
 
-char *cipher_hex(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption);
-void cipher_file(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption);
+char *cipher_hex(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options);
+void cipher_file(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options);
+void cipher_hex_batch(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, int for_encryption, const CipherOptions *options);
+void cipher_tree(unsigned Nb, unsigned Nk, const char *key, const char *in, const char *out_dir, int for_encryption, const CipherOptions *options);
 
 char *process_hex_string(const char *str);
 
@@ -58,8 +246,57 @@ char *process_hex_string(const char *str);
 
 // key.c begin
 
-word **KeyExpansion(unsigned Nb, unsigned Nr, const word key[], unsigned Nk);
+void KeyExpansion(unsigned Nb, unsigned Nr, const word key[], unsigned Nk, KeySchedule *schedule);
+void KeyExpansionBulk(unsigned Nb, unsigned Nr, size_t n, const word keys[], unsigned Nk, KeySchedule *const schedules[]);
+void wipe_key_schedule(KeySchedule *schedule);
 
 // end key.c
 
+// keycache.c begin
+
+typedef struct KeyCacheStats {
+    uint64_t hits, misses, evictions;
+} KeyCacheStats;
+
+void key_cache_expand(unsigned Nb, unsigned Nr, const word key[], unsigned Nk, KeySchedule *schedule);
+void key_cache_clear(void);
+void key_cache_get_stats(KeyCacheStats *stats);
+
+// end keycache.c
+
+// parallel.c begin
+
+typedef void ParallelTask(void *context, unsigned worker, size_t i);
+
+unsigned get_thread_count(unsigned requested);
+void parallel_for(unsigned threads, size_t n, ParallelTask *task, void *context);
+
+typedef struct WorkPool WorkPool;
+typedef void WorkTask(WorkPool *pool, unsigned worker, void *context);
+
+WorkPool *work_pool_new(unsigned threads);
+void work_pool_free(WorkPool *pool);
+unsigned work_pool_threads(const WorkPool *pool);
+void work_pool_push(WorkPool *pool, unsigned worker, WorkTask *task, void *context);
+void work_pool_run(WorkPool *pool);
+
+// end parallel.c
+
+// serve.c begin
+
+void serve(const char *path, const CipherOptions *options);
+
+// end serve.c
+
+// xts.c begin
+
+typedef struct XtsKey {
+    KeySchedule data;
+    KeySchedule tweak;
+} XtsKey;
+
+void xts_units(unsigned Nr, const XtsKey *key, uint64_t unit, size_t unit_size, size_t length, const byte in[], byte out[], int for_encryption);
+
+// end xts.c
+
 #endif  // AES_H_
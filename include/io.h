@@ -1,10 +1,98 @@
 #ifndef IO_H_
 #define IO_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
 #include "aes.h"
 
+void print_error(const char *msg, const char *from);
 void error(const char *msg, const char *from);
 
 void print_block(unsigned Nb, const word block[]);
 
+void *alloc_buffer(size_t size);
+
+int pread_full(int fd, void *buffer, size_t length, off_t offset);
+int pwrite_full(int fd, const void *buffer, size_t length, off_t offset);
+
+int random_bytes(byte out[], size_t length);
+
+typedef enum FileStatus {
+    FILE_SUCCESS,
+    FILE_READ_ERROR,
+    FILE_WRITE_ERROR,
+    FILE_FORMAT_ERROR,
+    FILE_PADDING_ERROR,
+    FILE_AUTHENTICATION_ERROR,
+} FileStatus;
+
+// Transforms length bytes of data in place and updates length. The buffer has
+// room for one extra block after the data. last is set on the final buffer.
+typedef FileStatus StreamTransform(void *context, byte data[], size_t *length, int last);
+
+typedef struct FileEntry {
+    char *in_path;
+    char *out_path;
+    off_t size;
+} FileEntry;
+
+typedef struct FileList {
+    FileEntry *entries;
+    size_t count, capacity;
+} FileList;
+
+void list_files(const char *in, const char *out_dir, FileList *list);
+void free_file_list(FileList *list);
+
+double get_monotonic_time(void);
+FileStatus stream_file(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, int pipelined, StreamStats *stats);
+
+// Counters and timers for --stats, around key setup, reading, ciphering and
+// writing. Building with -DAES_STATS=0 (make STATS=0) removes them.
+#ifndef AES_STATS
+#define AES_STATS 1
+#endif
+
+typedef enum StatsStage {
+    STATS_KEY,
+    STATS_READ,
+    STATS_CIPHER,
+    STATS_WRITE,
+    STATS_STAGES,
+} StatsStage;
+
+typedef struct StatsTimer {
+    double wall_time;
+    double cpu_time;
+} StatsTimer;
+
+#if AES_STATS
+extern int stats_enabled;
+
+void stats_enable(void);
+void stats_start_timer(StatsTimer *timer);
+void stats_stop_timer(const StatsTimer *timer, StatsStage stage, uint64_t bytes);
+void stats_report(FILE *file, int json);
+
+static inline void stats_start(StatsTimer *timer) {
+    if (stats_enabled) stats_start_timer(timer);
+}
+
+static inline void stats_stop(const StatsTimer *timer, StatsStage stage, uint64_t bytes) {
+    if (stats_enabled) stats_stop_timer(timer, stage, bytes);
+}
+#else
+static inline void stats_start(StatsTimer *timer) {
+    (void)timer;
+}
+
+static inline void stats_stop(const StatsTimer *timer, StatsStage stage, uint64_t bytes) {
+    (void)timer;
+    (void)stage;
+    (void)bytes;
+}
+#endif
+
 #endif  // IO_H_
@@ -0,0 +1,76 @@
+#ifndef LIBAES_H_
+#define LIBAES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define AES_API __attribute__((visibility("default")))
+#else
+#define AES_API
+#endif
+
+#define AES_BLOCK_SIZE 16
+#define AES_TAG_SIZE 16
+
+// An expanded AES key. Contexts are not modified by aes_encrypt() and
+// aes_decrypt(), so one may be shared by any number of threads.
+typedef struct AesContext AesContext;
+
+typedef enum AesMode {
+    AES_ECB,  // whole blocks only, without padding
+    AES_CTR,  // a 16-byte initial counter block as the IV
+    AES_GCM,  // an IV of any nonzero length, and a 16-byte tag
+} AesMode;
+
+typedef enum AesStatus {
+    AES_SUCCESS,
+    AES_INVALID_ARGUMENT,
+    AES_INVALID_KEY,
+    AES_INVALID_MODE,
+    AES_INVALID_IV,
+    AES_INVALID_LENGTH,
+    AES_OUT_OF_MEMORY,
+    AES_AUTHENTICATION_FAILED,
+} AesStatus;
+
+// Allocates a context and expands the key, of 16, 24 or 32 bytes, into it.
+// This is the only function that allocates memory.
+AES_API AesStatus aes_context_new(AesContext **context, const uint8_t key[], size_t key_length);
+
+// Replaces the key of an existing context.
+AES_API AesStatus aes_context_set_key(AesContext *context, const uint8_t key[], size_t key_length);
+
+// Replaces the keys of count contexts at once, all of key_length bytes, one
+// after another in keys[]. Many keys are expanded faster this way than one at
+// a time, with AES-NI where the processor has it. If an argument is invalid,
+// no context is changed.
+AES_API AesStatus aes_context_set_keys(AesContext *const contexts[], size_t count, const uint8_t keys[], size_t key_length);
+
+// Wipes the key from the context and releases it. context may be NULL.
+AES_API void aes_context_free(AesContext *context);
+
+// Encrypts length bytes from in[] to out[], which may be the same buffer. In
+// GCM mode, the authentication tag is written to tag[]; it is ignored and may
+// be NULL otherwise.
+AES_API AesStatus aes_encrypt(const AesContext *context, AesMode mode, const uint8_t iv[], size_t iv_length,
+                              const uint8_t in[], uint8_t out[], size_t length, uint8_t tag[]);
+
+// Decrypts length bytes from in[] to out[], which may be the same buffer. In
+// GCM mode, the data is checked against tag[]; if they do not match, out[] is
+// cleared and AES_AUTHENTICATION_FAILED is returned.
+AES_API AesStatus aes_decrypt(const AesContext *context, AesMode mode, const uint8_t iv[], size_t iv_length,
+                              const uint8_t in[], uint8_t out[], size_t length, const uint8_t tag[]);
+
+// Returns a description of the status, for messages.
+AES_API const char *aes_status_string(AesStatus status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LIBAES_H_
@@ -0,0 +1,228 @@
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <pthread.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#define KEY_TARGET __attribute__((target("aes,ssse3")))
+
+// number of independent blocks kept in flight to hide AESENC/AESDEC latency
+#define AESNI_LANES 8
+
+// number of keys expanded together, a multiple of the four in a register
+#define AESNI_KEY_LANES 8
+
+static void detect_features(void);
+static int aesni_supports(unsigned Nb);
+static void aesni_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void aesni_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void expand_key_lanes(unsigned Nr, unsigned lanes, const word keys[], unsigned Nk, KeySchedule *const schedules[]);
+
+const Engine aesni_engine = {
+    "aesni",
+    aesni_supports,
+    aesni_cipher_blocks,
+    aesni_inv_cipher_blocks,
+};
+
+// set once by detect_features(), so that threads may ask concurrently
+static int aes_supported, ssse3_supported;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+static void detect_features(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return;
+    aes_supported = (ecx & bit_AES) && (edx & bit_SSE2);
+    ssse3_supported = aes_supported && (ecx & bit_SSSE3);
+}
+
+static int aesni_supports(unsigned Nb) {
+    pthread_once(&detect_once, detect_features);
+    return Nb == 4 && aes_supported;
+}
+
+AESNI_TARGET
+static void aesni_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    (void)Nb;
+
+    __m128i rk[15];
+    for (unsigned round = 0; round <= Nr; ++round) {
+        rk[round] = _mm_load_si128((const __m128i *)(key->encryption + 4 * round));
+    }
+
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    size_t i = 0;
+
+    for (; i + AESNI_LANES <= n; i += AESNI_LANES) {
+        __m128i b[AESNI_LANES];
+        for (unsigned k = 0; k < AESNI_LANES; ++k) {
+            b[k] = _mm_xor_si128(_mm_loadu_si128(src + i + k), rk[0]);
+        }
+        for (unsigned round = 1; round < Nr; ++round) {
+            for (unsigned k = 0; k < AESNI_LANES; ++k) {
+                b[k] = _mm_aesenc_si128(b[k], rk[round]);
+            }
+        }
+        for (unsigned k = 0; k < AESNI_LANES; ++k) {
+            _mm_storeu_si128(dst + i + k, _mm_aesenclast_si128(b[k], rk[Nr]));
+        }
+    }
+
+    for (; i < n; ++i) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(src + i), rk[0]);
+        for (unsigned round = 1; round < Nr; ++round) {
+            b = _mm_aesenc_si128(b, rk[round]);
+        }
+        _mm_storeu_si128(dst + i, _mm_aesenclast_si128(b, rk[Nr]));
+    }
+}
+
+// The decryption key schedule already has InvMixColumns() applied to rounds
+// 1 to Nr - 1 (the equivalent inverse cipher), which is what AESDEC expects.
+AESNI_TARGET
+static void aesni_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    (void)Nb;
+
+    __m128i rk[15];
+    for (unsigned round = 0; round <= Nr; ++round) {
+        rk[round] = _mm_load_si128((const __m128i *)(key->decryption + 4 * round));
+    }
+
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    size_t i = 0;
+
+    for (; i + AESNI_LANES <= n; i += AESNI_LANES) {
+        __m128i b[AESNI_LANES];
+        for (unsigned k = 0; k < AESNI_LANES; ++k) {
+            b[k] = _mm_xor_si128(_mm_loadu_si128(src + i + k), rk[Nr]);
+        }
+        for (unsigned round = Nr - 1; round > 0; --round) {
+            for (unsigned k = 0; k < AESNI_LANES; ++k) {
+                b[k] = _mm_aesdec_si128(b[k], rk[round]);
+            }
+        }
+        for (unsigned k = 0; k < AESNI_LANES; ++k) {
+            _mm_storeu_si128(dst + i + k, _mm_aesdeclast_si128(b[k], rk[0]));
+        }
+    }
+
+    for (; i < n; ++i) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(src + i), rk[Nr]);
+        for (unsigned round = Nr - 1; round > 0; --round) {
+            b = _mm_aesdec_si128(b, rk[round]);
+        }
+        _mm_storeu_si128(dst + i, _mm_aesdeclast_si128(b, rk[0]));
+    }
+}
+
+// Expands n keys of Nk words each, one after another in keys[], into the
+// schedules of 128-bit blocks, as KeyExpansion() does. Returns 0, doing
+// nothing, if the processor lacks the instructions.
+int aesni_expand_keys(unsigned Nr, size_t n, const word keys[], unsigned Nk, KeySchedule *const schedules[]) {
+    pthread_once(&detect_once, detect_features);
+    if (!ssse3_supported) return 0;
+
+    for (size_t i = 0; i < n; i += AESNI_KEY_LANES) {
+        const unsigned lanes = n - i < AESNI_KEY_LANES ? (unsigned)(n - i) : AESNI_KEY_LANES;
+        expand_key_lanes(Nr, lanes, keys + i * Nk, Nk, schedules + i);
+    }
+    return 1;
+}
+
+// SubWord() of each word, or SubWord(RotWord()): AESENCLAST with a zero round
+// key is SubBytes() after ShiftRows(), which the shuffle undoes beforehand.
+KEY_TARGET
+static inline __m128i sub_words(__m128i x, int rotate) {
+    const __m128i inv_shift_rows = _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3);
+    const __m128i inv_shift_rows_rotate = _mm_setr_epi8(1, 14, 11, 4, 5, 2, 15, 8, 9, 6, 3, 12, 13, 10, 7, 0);
+    return _mm_aesenclast_si128(_mm_shuffle_epi8(x, rotate ? inv_shift_rows_rotate : inv_shift_rows), _mm_setzero_si128());
+}
+
+// The recurrence of KeyExpansion() on groups of four keys, transposed so that
+// word i of every key of a group is in one register and the groups advance
+// side by side. Each round key is transposed back and stored, and given to
+// AESIMC for the decryption schedule, as soon as its last word is known.
+KEY_TARGET
+static void expand_key_lanes(unsigned Nr, unsigned lanes, const word keys[], unsigned Nk, KeySchedule *const schedules[]) {
+    enum { GROUPS = AESNI_KEY_LANES / 4 };
+    __m128i w[GROUPS][4 * 15];
+
+    for (unsigned g = 0; g < GROUPS; ++g) {
+        for (unsigned i = 0; i < Nk; ++i) {
+            word lane[4] = {0};
+            for (unsigned k = 0; k < 4 && 4 * g + k < lanes; ++k) lane[k] = keys[(4 * g + k) * Nk + i];
+            w[g][i] = _mm_setr_epi32((int)lane[0], (int)lane[1], (int)lane[2], (int)lane[3]);
+        }
+    }
+
+    for (unsigned i = 0; i < 4 * (Nr + 1); ++i) {
+        if (i >= Nk) {
+            for (unsigned g = 0; g < GROUPS; ++g) {
+                __m128i temp = w[g][i - 1];
+                if (i % Nk == 0) {
+                    temp = _mm_xor_si128(sub_words(temp, 1), _mm_set1_epi32((int)Rcon[i / Nk]));
+                } else if (Nk > 6 && i % Nk == 4) {
+                    temp = sub_words(temp, 0);
+                }
+                w[g][i] = _mm_xor_si128(w[g][i - Nk], temp);
+            }
+        }
+        if (i % 4 != 3) continue;
+
+        const unsigned round = i / 4;
+        for (unsigned g = 0; g < GROUPS && 4 * g < lanes; ++g) {
+            const __m128i *c = w[g] + 4 * round;
+            const __m128i low = _mm_unpacklo_epi32(c[0], c[1]), high = _mm_unpackhi_epi32(c[0], c[1]);
+            const __m128i low2 = _mm_unpacklo_epi32(c[2], c[3]), high2 = _mm_unpackhi_epi32(c[2], c[3]);
+            const __m128i rk[4] = {
+                _mm_unpacklo_epi64(low, low2),
+                _mm_unpackhi_epi64(low, low2),
+                _mm_unpacklo_epi64(high, high2),
+                _mm_unpackhi_epi64(high, high2),
+            };
+            for (unsigned k = 0; k < 4 && 4 * g + k < lanes; ++k) {
+                KeySchedule *schedule = schedules[4 * g + k];
+                _mm_store_si128((__m128i *)schedule->encryption + round, rk[k]);
+                _mm_store_si128((__m128i *)schedule->decryption + round,
+                                round == 0 || round == Nr ? rk[k] : _mm_aesimc_si128(rk[k]));
+            }
+        }
+    }
+
+    for (unsigned k = 0; k < lanes; ++k) {
+        schedules[k]->Nb = 4;
+        schedules[k]->Nr = Nr;
+        select_rounds(schedules[k]);
+    }
+}
+
+#else
+
+static int aesni_supports(unsigned Nb) {
+    (void)Nb;
+    return 0;
+}
+
+int aesni_expand_keys(unsigned Nr, size_t n, const word keys[], unsigned Nk, KeySchedule *const schedules[]) {
+    (void)Nr;
+    (void)n;
+    (void)keys;
+    (void)Nk;
+    (void)schedules;
+    return 0;
+}
+
+const Engine aesni_engine = {
+    "aesni",
+    aesni_supports,
+    NULL,
+    NULL,
+};
+
+#endif
@@ -0,0 +1,466 @@
+#include <string.h>
+
+#include "aes.h"
+
+// The bitsliced engine keeps 4 blocks in each set of eight 64-bit planes:
+// plane i holds bit i of every state byte, and the byte in row r and column c
+// of block k sits at bit 16 * k + 4 * r + c. Two sets are processed together,
+// so each batch covers 8 blocks. No table is indexed by secret data.
+
+#define BITSLICE_LANES 8
+
+typedef uint64_t planes[8];
+
+static int bitslice_supports(unsigned Nb);
+static void bitslice_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void bitslice_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+
+static void pack(planes q, const byte in[]);
+static void unpack(byte out[], const planes q);
+static void pack_round_keys(unsigned Nr, planes sk[], const word round_keys[]);
+static void transpose(planes x);
+static void wipe(void *p, size_t size);
+
+static void SubBytes(planes q);
+static void InvSubBytes(planes q);
+static void ShiftRows(planes q);
+static void InvShiftRows(planes q);
+static void MixColumns(planes q);
+static void InvMixColumns(planes q);
+static void AddRoundKey(planes q, const planes k);
+
+const Engine bitslice_engine = {
+    "bitslice",
+    bitslice_supports,
+    bitslice_cipher_blocks,
+    bitslice_inv_cipher_blocks,
+};
+
+static int bitslice_supports(unsigned Nb) {
+    return Nb == 4;
+}
+
+// Schedules expanded while another engine was in use are packed on each call.
+static void bitslice_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    const planes *sk = key->bitslice_encryption;
+    planes packed[15];
+    if (!key->bitsliced) {
+        pack_round_keys(Nr, packed, key->encryption);
+        sk = packed;
+    }
+
+    for (size_t i = 0; i < n; i += BITSLICE_LANES) {
+        const size_t count = n - i < BITSLICE_LANES ? n - i : BITSLICE_LANES;
+        byte buffer[BITSLICE_LANES * 16] = {0};
+        memcpy(buffer, in + i * Nb, count * 16);
+
+        planes q[2];
+        pack(q[0], buffer);
+        pack(q[1], buffer + 64);
+
+        for (unsigned h = 0; h < 2; ++h) {
+            AddRoundKey(q[h], sk[0]);
+        }
+        for (unsigned round = 1; round < Nr; ++round) {
+            for (unsigned h = 0; h < 2; ++h) {
+                SubBytes(q[h]);
+                ShiftRows(q[h]);
+                MixColumns(q[h]);
+                AddRoundKey(q[h], sk[round]);
+            }
+        }
+        for (unsigned h = 0; h < 2; ++h) {
+            SubBytes(q[h]);
+            ShiftRows(q[h]);
+            AddRoundKey(q[h], sk[Nr]);
+        }
+
+        unpack(buffer, q[0]);
+        unpack(buffer + 64, q[1]);
+        memcpy(out + i * Nb, buffer, count * 16);
+    }
+    if (!key->bitsliced) wipe(packed, sizeof(planes) * (Nr + 1));
+}
+
+// Runs the equivalent inverse cipher, i.e. the round keys 1 to Nr - 1 are
+// expected to have InvMixColumns() applied already.
+static void bitslice_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    const planes *sk = key->bitslice_decryption;
+    planes packed[15];
+    if (!key->bitsliced) {
+        pack_round_keys(Nr, packed, key->decryption);
+        sk = packed;
+    }
+
+    for (size_t i = 0; i < n; i += BITSLICE_LANES) {
+        const size_t count = n - i < BITSLICE_LANES ? n - i : BITSLICE_LANES;
+        byte buffer[BITSLICE_LANES * 16] = {0};
+        memcpy(buffer, in + i * Nb, count * 16);
+
+        planes q[2];
+        pack(q[0], buffer);
+        pack(q[1], buffer + 64);
+
+        for (unsigned h = 0; h < 2; ++h) {
+            AddRoundKey(q[h], sk[Nr]);
+        }
+        for (unsigned round = Nr - 1; round > 0; --round) {
+            for (unsigned h = 0; h < 2; ++h) {
+                InvSubBytes(q[h]);
+                InvShiftRows(q[h]);
+                InvMixColumns(q[h]);
+                AddRoundKey(q[h], sk[round]);
+            }
+        }
+        for (unsigned h = 0; h < 2; ++h) {
+            InvSubBytes(q[h]);
+            InvShiftRows(q[h]);
+            AddRoundKey(q[h], sk[0]);
+        }
+
+        unpack(buffer, q[0]);
+        unpack(buffer + 64, q[1]);
+        memcpy(out + i * Nb, buffer, count * 16);
+    }
+    if (!key->bitsliced) wipe(packed, sizeof(planes) * (Nr + 1));
+}
+
+// Byte pos of block k lands at bit n = 16 * k + 4 * (pos % 4) + pos / 4 of
+// every plane. transpose() maps bit i of byte n / 8 of x[7 - n % 8] there.
+static void pack(planes q, const byte in[]) {
+    planes x = {0};
+    for (unsigned k = 0; k < 4; ++k) {
+        for (unsigned pos = 0; pos < 16; ++pos) {
+            const unsigned n = 16 * k + 4 * (pos % 4) + pos / 4;
+            x[7 - n % 8] |= (uint64_t)in[16 * k + pos] << (8 * (n / 8));
+        }
+    }
+    transpose(x);
+    for (unsigned i = 0; i < 8; ++i) {
+        q[i] = x[7 - i];
+    }
+    wipe(x, sizeof(planes));
+}
+
+static void unpack(byte out[], const planes q) {
+    planes x;
+    for (unsigned i = 0; i < 8; ++i) {
+        x[i] = q[7 - i];
+    }
+    transpose(x);
+    for (unsigned k = 0; k < 4; ++k) {
+        for (unsigned pos = 0; pos < 16; ++pos) {
+            const unsigned n = 16 * k + 4 * (pos % 4) + pos / 4;
+            out[16 * k + pos] = (byte)(x[7 - n % 8] >> (8 * (n / 8)));
+        }
+    }
+    wipe(x, sizeof(planes));
+}
+
+// Packs the round keys of both directions of a schedule of 128-bit blocks into
+// the schedule, so that they are not packed again on every call.
+void bitslice_pack_key_schedule(KeySchedule *schedule) {
+    pack_round_keys(schedule->Nr, schedule->bitslice_encryption, schedule->encryption);
+    pack_round_keys(schedule->Nr, schedule->bitslice_decryption, schedule->decryption);
+}
+
+static void pack_round_keys(unsigned Nr, planes sk[], const word round_keys[]) {
+    for (unsigned round = 0; round <= Nr; ++round) {
+        byte buffer[64];
+        for (unsigned k = 0; k < 4; ++k) {
+            memcpy(buffer + 16 * k, round_keys + 4 * round, 16);
+        }
+        pack(sk[round], buffer);
+        wipe(buffer, sizeof(buffer));
+    }
+}
+
+// SubWord() and InvMixColumn() for key expansion, through the same circuits as
+// the cipher, so that expanding a key indexes no table with it either. The
+// word is column 0 of the first block, the other columns being left zero.
+word bitslice_sub_word(word w) {
+    byte buffer[64] = {0};
+    memcpy(buffer, &w, sizeof(word));
+    planes q;
+    pack(q, buffer);
+    SubBytes(q);
+    unpack(buffer, q);
+    memcpy(&w, buffer, sizeof(word));
+    wipe(q, sizeof(planes));
+    wipe(buffer, sizeof(buffer));
+    return w;
+}
+
+word bitslice_inv_mix_column(word w) {
+    byte buffer[64] = {0};
+    memcpy(buffer, &w, sizeof(word));
+    planes q;
+    pack(q, buffer);
+    InvMixColumns(q);
+    unpack(buffer, q);
+    memcpy(&w, buffer, sizeof(word));
+    wipe(q, sizeof(planes));
+    wipe(buffer, sizeof(buffer));
+    return w;
+}
+
+#define SWAPMOVE(a, b, mask, n)                           \
+    do {                                                  \
+        const uint64_t t = (((b) >> (n)) ^ (a)) & (mask); \
+        (a) ^= t;                                         \
+        (b) ^= t << (n);                                  \
+    } while (0)
+
+// Transposes the 8x8 bit matrices formed by byte b of each of the 8 words:
+// afterwards, bit 8 * b + m of x[i] is bit 7 - i of byte b of the former
+// x[7 - m]. The transformation is its own inverse.
+static void transpose(planes x) {
+    SWAPMOVE(x[0], x[1], 0x5555555555555555, 1);
+    SWAPMOVE(x[2], x[3], 0x5555555555555555, 1);
+    SWAPMOVE(x[4], x[5], 0x5555555555555555, 1);
+    SWAPMOVE(x[6], x[7], 0x5555555555555555, 1);
+
+    SWAPMOVE(x[0], x[2], 0x3333333333333333, 2);
+    SWAPMOVE(x[1], x[3], 0x3333333333333333, 2);
+    SWAPMOVE(x[4], x[6], 0x3333333333333333, 2);
+    SWAPMOVE(x[5], x[7], 0x3333333333333333, 2);
+
+    SWAPMOVE(x[0], x[4], 0x0f0f0f0f0f0f0f0f, 4);
+    SWAPMOVE(x[1], x[5], 0x0f0f0f0f0f0f0f0f, 4);
+    SWAPMOVE(x[2], x[6], 0x0f0f0f0f0f0f0f0f, 4);
+    SWAPMOVE(x[3], x[7], 0x0f0f0f0f0f0f0f0f, 4);
+}
+
+// Boyar-Peralta circuit for the S-box, computed over all 64 bytes at once.
+static void SubBytes(planes q) {
+    const uint64_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    const uint64_t x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // top linear transformation
+    const uint64_t y14 = x3 ^ x5;
+    const uint64_t y13 = x0 ^ x6;
+    const uint64_t y9 = x0 ^ x3;
+    const uint64_t y8 = x0 ^ x5;
+    const uint64_t t0 = x1 ^ x2;
+    const uint64_t y1 = t0 ^ x7;
+    const uint64_t y4 = y1 ^ x3;
+    const uint64_t y12 = y13 ^ y14;
+    const uint64_t y2 = y1 ^ x0;
+    const uint64_t y5 = y1 ^ x6;
+    const uint64_t y3 = y5 ^ y8;
+    const uint64_t t1 = x4 ^ y12;
+    const uint64_t y15 = t1 ^ x5;
+    const uint64_t y20 = t1 ^ x1;
+    const uint64_t y6 = y15 ^ x7;
+    const uint64_t y10 = y15 ^ t0;
+    const uint64_t y11 = y20 ^ y9;
+    const uint64_t y7 = x7 ^ y11;
+    const uint64_t y17 = y10 ^ y11;
+    const uint64_t y19 = y10 ^ y8;
+    const uint64_t y16 = t0 ^ y11;
+    const uint64_t y21 = y13 ^ y16;
+    const uint64_t y18 = x0 ^ y16;
+
+    // non-linear section
+    const uint64_t t2 = y12 & y15;
+    const uint64_t t3 = y3 & y6;
+    const uint64_t t4 = t3 ^ t2;
+    const uint64_t t5 = y4 & x7;
+    const uint64_t t6 = t5 ^ t2;
+    const uint64_t t7 = y13 & y16;
+    const uint64_t t8 = y5 & y1;
+    const uint64_t t9 = t8 ^ t7;
+    const uint64_t t10 = y2 & y7;
+    const uint64_t t11 = t10 ^ t7;
+    const uint64_t t12 = y9 & y11;
+    const uint64_t t13 = y14 & y17;
+    const uint64_t t14 = t13 ^ t12;
+    const uint64_t t15 = y8 & y10;
+    const uint64_t t16 = t15 ^ t12;
+    const uint64_t t17 = t4 ^ t14;
+    const uint64_t t18 = t6 ^ t16;
+    const uint64_t t19 = t9 ^ t14;
+    const uint64_t t20 = t11 ^ t16;
+    const uint64_t t21 = t17 ^ y20;
+    const uint64_t t22 = t18 ^ y19;
+    const uint64_t t23 = t19 ^ y21;
+    const uint64_t t24 = t20 ^ y18;
+
+    const uint64_t t25 = t21 ^ t22;
+    const uint64_t t26 = t21 & t23;
+    const uint64_t t27 = t24 ^ t26;
+    const uint64_t t28 = t25 & t27;
+    const uint64_t t29 = t28 ^ t22;
+    const uint64_t t30 = t23 ^ t24;
+    const uint64_t t31 = t22 ^ t26;
+    const uint64_t t32 = t31 & t30;
+    const uint64_t t33 = t32 ^ t24;
+    const uint64_t t34 = t23 ^ t33;
+    const uint64_t t35 = t27 ^ t33;
+    const uint64_t t36 = t24 & t35;
+    const uint64_t t37 = t36 ^ t34;
+    const uint64_t t38 = t27 ^ t36;
+    const uint64_t t39 = t29 & t38;
+    const uint64_t t40 = t25 ^ t39;
+
+    const uint64_t t41 = t40 ^ t37;
+    const uint64_t t42 = t29 ^ t33;
+    const uint64_t t43 = t29 ^ t40;
+    const uint64_t t44 = t33 ^ t37;
+    const uint64_t t45 = t42 ^ t41;
+    const uint64_t z0 = t44 & y15;
+    const uint64_t z1 = t37 & y6;
+    const uint64_t z2 = t33 & x7;
+    const uint64_t z3 = t43 & y16;
+    const uint64_t z4 = t40 & y1;
+    const uint64_t z5 = t29 & y7;
+    const uint64_t z6 = t42 & y11;
+    const uint64_t z7 = t45 & y17;
+    const uint64_t z8 = t41 & y10;
+    const uint64_t z9 = t44 & y12;
+    const uint64_t z10 = t37 & y3;
+    const uint64_t z11 = t33 & y4;
+    const uint64_t z12 = t43 & y13;
+    const uint64_t z13 = t40 & y5;
+    const uint64_t z14 = t29 & y2;
+    const uint64_t z15 = t42 & y9;
+    const uint64_t z16 = t45 & y14;
+    const uint64_t z17 = t41 & y8;
+
+    // bottom linear transformation
+    const uint64_t t46 = z15 ^ z16;
+    const uint64_t t47 = z10 ^ z11;
+    const uint64_t t48 = z5 ^ z13;
+    const uint64_t t49 = z9 ^ z10;
+    const uint64_t t50 = z2 ^ z12;
+    const uint64_t t51 = z2 ^ z5;
+    const uint64_t t52 = z7 ^ z8;
+    const uint64_t t53 = z0 ^ z3;
+    const uint64_t t54 = z6 ^ z7;
+    const uint64_t t55 = z16 ^ z17;
+    const uint64_t t56 = z12 ^ t48;
+    const uint64_t t57 = t50 ^ t53;
+    const uint64_t t58 = z4 ^ t46;
+    const uint64_t t59 = z3 ^ t54;
+    const uint64_t t60 = t46 ^ t57;
+    const uint64_t t61 = z14 ^ t57;
+    const uint64_t t62 = t52 ^ t58;
+    const uint64_t t63 = t49 ^ t58;
+    const uint64_t t64 = z4 ^ t59;
+    const uint64_t t65 = t61 ^ t62;
+    const uint64_t t66 = z1 ^ t63;
+    const uint64_t s0 = t59 ^ t63;
+    const uint64_t s6 = t56 ^ ~t62;
+    const uint64_t s7 = t48 ^ ~t60;
+    const uint64_t t67 = t64 ^ t65;
+    const uint64_t s3 = t53 ^ t66;
+    const uint64_t s4 = t51 ^ t66;
+    const uint64_t s5 = t47 ^ t65;
+    const uint64_t s1 = t64 ^ ~s3;
+    const uint64_t s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+// Applies y -> A^-1(y ^ 0x63), the inverse of the S-box affine step.
+static void inverse_affine(planes q) {
+    planes t;
+    for (unsigned i = 0; i < 8; ++i) {
+        t[i] = q[(i + 2) % 8] ^ q[(i + 5) % 8] ^ q[(i + 7) % 8];
+    }
+    memcpy(q, t, sizeof(planes));
+    // A^-1(0x63) == 0x05
+    q[0] = ~q[0];
+    q[2] = ~q[2];
+}
+
+// The inverse S-box is A^-1(S(A^-1(y ^ 0x63)) ^ 0x63).
+static void InvSubBytes(planes q) {
+    inverse_affine(q);
+    SubBytes(q);
+    inverse_affine(q);
+}
+
+// rotate_rows(x, k) moves row r + k of every column into row r
+#define ROTATE_ROWS_1(x) ((((x) >> 4) & 0x0fff0fff0fff0fff) | (((x) << 12) & 0xf000f000f000f000))
+#define ROTATE_ROWS_2(x) ((((x) >> 8) & 0x00ff00ff00ff00ff) | (((x) << 8) & 0xff00ff00ff00ff00))
+#define ROTATE_ROWS_3(x) ((((x) >> 12) & 0x000f000f000f000f) | (((x) << 4) & 0xfff0fff0fff0fff0))
+
+static void ShiftRows(planes q) {
+    for (unsigned i = 0; i < 8; ++i) {
+        const uint64_t x = q[i];
+        q[i] = (x & 0x000f000f000f000f) |
+               ((x >> 1) & 0x0070007000700070) | ((x << 3) & 0x0080008000800080) |
+               ((x >> 2) & 0x0300030003000300) | ((x << 2) & 0x0c000c000c000c00) |
+               ((x >> 3) & 0x1000100010001000) | ((x << 1) & 0xe000e000e000e000);
+    }
+}
+
+static void InvShiftRows(planes q) {
+    for (unsigned i = 0; i < 8; ++i) {
+        const uint64_t x = q[i];
+        q[i] = (x & 0x000f000f000f000f) |
+               ((x << 1) & 0x00e000e000e000e0) | ((x >> 3) & 0x0010001000100010) |
+               ((x << 2) & 0x0c000c000c000c00) | ((x >> 2) & 0x0300030003000300) |
+               ((x << 3) & 0x8000800080008000) | ((x >> 1) & 0x7000700070007000);
+    }
+}
+
+// multiplies every byte by x in GF(2^8), modulo x^8 + x^4 + x^3 + x + 1
+static void xtime(planes out, const planes in) {
+    out[0] = in[7];
+    out[1] = in[0] ^ in[7];
+    out[2] = in[1];
+    out[3] = in[2] ^ in[7];
+    out[4] = in[3] ^ in[7];
+    out[5] = in[4];
+    out[6] = in[5];
+    out[7] = in[6];
+}
+
+static void MixColumns(planes q) {
+    planes r1, t, t2;
+    for (unsigned i = 0; i < 8; ++i) {
+        r1[i] = ROTATE_ROWS_1(q[i]);
+        t[i] = q[i] ^ r1[i];
+    }
+    xtime(t2, t);
+    for (unsigned i = 0; i < 8; ++i) {
+        q[i] = t2[i] ^ r1[i] ^ ROTATE_ROWS_2(q[i]) ^ ROTATE_ROWS_3(q[i]);
+    }
+}
+
+// InvMixColumns() is MixColumns() after adding 4 * (a[r] ^ a[r + 2]) to
+// every row r.
+static void InvMixColumns(planes q) {
+    planes t, t2, t4;
+    for (unsigned i = 0; i < 8; ++i) {
+        t[i] = q[i] ^ ROTATE_ROWS_2(q[i]);
+    }
+    xtime(t2, t);
+    xtime(t4, t2);
+    for (unsigned i = 0; i < 8; ++i) {
+        q[i] ^= t4[i];
+    }
+    MixColumns(q);
+}
+
+static void AddRoundKey(planes q, const planes k) {
+    for (unsigned i = 0; i < 8; ++i) {
+        q[i] ^= k[i];
+    }
+}
+
+// Clears key material left on the stack in a way the compiler cannot optimise
+// away, as wipe_key_schedule() does.
+static void wipe(void *p, size_t size) {
+    volatile byte *v = (volatile byte *)p;
+    for (size_t i = 0; i < size; ++i) v[i] = 0;
+}
@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "aes.h"
+
+// number of blocks deciphered per engine call
+#define CBC_BATCH 64
+
+// Encrypts length bytes, a whole number of blocks, from in[] into out[],
+// which may alias, in CBC mode (NIST SP 800-38A). iv[] is replaced by the last
+// ciphertext block, so that a message may be encrypted in parts. Each block
+// depends on the one before, so this runs a block at a time.
+void cbc_encrypt(unsigned Nb, unsigned Nr, const KeySchedule *key, byte iv[], size_t length, const byte in[], byte out[]) {
+    const size_t block_size = 4 * Nb;
+    word block[8];
+    byte *bytes = (byte *)block;
+
+    for (size_t offset = 0; offset < length; offset += block_size) {
+        for (size_t i = 0; i < block_size; ++i) bytes[i] = in[offset + i] ^ iv[i];
+        CipherBlocks(Nb, Nr, 1, block, block, key);
+        memcpy(out + offset, bytes, block_size);
+        memcpy(iv, bytes, block_size);
+    }
+}
+
+// Decrypts length bytes, a whole number of blocks, from in[] into out[],
+// which may alias, and replaces iv[] with the last ciphertext block. Every
+// plaintext block depends only on two ciphertext blocks, so the blocks are
+// deciphered in wide batches and then chained, and any block-aligned part of
+// a message can be decrypted given the ciphertext block before it as iv[].
+void cbc_decrypt(unsigned Nb, unsigned Nr, const KeySchedule *key, byte iv[], size_t length, const byte in[], byte out[]) {
+    const size_t block_size = 4 * Nb;
+    word buffer[CBC_BATCH * 8];
+    const byte *deciphered = (const byte *)buffer;
+    byte next_iv[32];
+
+    while (length) {
+        size_t blocks = length / block_size;
+        if (blocks > CBC_BATCH) blocks = CBC_BATCH;
+        const size_t bytes = blocks * block_size;
+
+        InvCipherBlocks(Nb, Nr, blocks, (const word *)in, buffer, key);
+        memcpy(next_iv, in + bytes - block_size, block_size);
+
+        // backwards, so that out[] may overwrite in[] once it is no longer
+        // needed
+        for (size_t i = bytes; i-- > block_size;) out[i] = deciphered[i] ^ in[i - block_size];
+        for (size_t i = 0; i < block_size; ++i) out[i] = deciphered[i] ^ iv[i];
+        memcpy(iv, next_iv, block_size);
+
+        in += bytes;
+        out += bytes;
+        length -= bytes;
+    }
+}
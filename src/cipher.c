@@ -2,74 +2,245 @@
 
 #include "aes.h"
 
-word *Cipher(unsigned Nb, unsigned Nr, const word in[], word **key) {
-    word *state = (word *)malloc(Nb * sizeof(word));
-    uword *prev = (uword *)malloc(Nb * sizeof(uword));
+static int table_supports(unsigned Nb);
+static void table_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void table_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void compact_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
+static void compact_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key);
 
-    for (unsigned j = 0; j < Nb; ++j) {
-        prev[j].word = state[j] = in[j] ^ key[0][j];
-    }
+// The table round loops are generated for every supported (Nb, Nr) by
+// DEFINE_ROUNDS(), fully unrolled so that the ShiftRows() offsets become
+// constant indices. The state alternates between a and b, ending in b as
+// Nr - 1 is always odd.
 
-    for (unsigned round = 1; round < Nr; ++round) {
-        for (unsigned j = 0; j < Nb; ++j) {
-            state[j] =
-                cipher_table[0][prev[(j + 0) % Nb].bytes[0]] ^
-                cipher_table[1][prev[(j + 1) % Nb].bytes[1]] ^
-                cipher_table[2][prev[(j + 2) % Nb].bytes[2]] ^
-                cipher_table[3][prev[(j + 3) % Nb].bytes[3]] ^
-                key[round][j];
-        }
-        for (unsigned j = 0; j < Nb; ++j) {
-            prev[j].word = state[j];
-        }
+#define COLUMNS_4(X, ...) X(0, __VA_ARGS__) X(1, __VA_ARGS__) X(2, __VA_ARGS__) X(3, __VA_ARGS__)
+#define COLUMNS_6(X, ...) COLUMNS_4(X, __VA_ARGS__) X(4, __VA_ARGS__) X(5, __VA_ARGS__)
+#define COLUMNS_8(X, ...) COLUMNS_6(X, __VA_ARGS__) X(6, __VA_ARGS__) X(7, __VA_ARGS__)
+
+#define ROUNDS_10(R, ...) R(1, a, b, __VA_ARGS__) R(2, b, a, __VA_ARGS__) R(3, a, b, __VA_ARGS__) \
+                          R(4, b, a, __VA_ARGS__) R(5, a, b, __VA_ARGS__) R(6, b, a, __VA_ARGS__) \
+                          R(7, a, b, __VA_ARGS__) R(8, b, a, __VA_ARGS__) R(9, a, b, __VA_ARGS__)
+#define ROUNDS_12(R, ...) ROUNDS_10(R, __VA_ARGS__) R(10, b, a, __VA_ARGS__) R(11, a, b, __VA_ARGS__)
+#define ROUNDS_14(R, ...) ROUNDS_12(R, __VA_ARGS__) R(12, b, a, __VA_ARGS__) R(13, a, b, __VA_ARGS__)
+
+#define INV_ROUNDS_10(R, ...) R(9, a, b, __VA_ARGS__) R(8, b, a, __VA_ARGS__) R(7, a, b, __VA_ARGS__) \
+                              R(6, b, a, __VA_ARGS__) R(5, a, b, __VA_ARGS__) R(4, b, a, __VA_ARGS__) \
+                              R(3, a, b, __VA_ARGS__) R(2, b, a, __VA_ARGS__) R(1, a, b, __VA_ARGS__)
+#define INV_ROUNDS_12(R, ...) R(11, a, b, __VA_ARGS__) R(10, b, a, __VA_ARGS__) INV_ROUNDS_10(R, __VA_ARGS__)
+#define INV_ROUNDS_14(R, ...) R(13, a, b, __VA_ARGS__) R(12, b, a, __VA_ARGS__) INV_ROUNDS_12(R, __VA_ARGS__)
+
+#define LOAD_COLUMN(j, r) a[j].word = in[j] ^ rk[(r) * Nb + (j)];
+#define STORE_COLUMN(j, _) out[j] = a[j].word;
+
+// Column j of state t is computed from state s through the tables T, taking
+// row k from column j + Dk, and the round key of round r.
+#define COLUMN(j, r, s, t, T, D1, D2, D3)                    \
+    t[j].word = T[0][s[j].bytes[0]] ^                        \
+                T[1][s[((j) + (D1)) % Nb].bytes[1]] ^        \
+                T[2][s[((j) + (D2)) % Nb].bytes[2]] ^        \
+                T[3][s[((j) + (D3)) % Nb].bytes[3]] ^        \
+                rk[(r) * Nb + (j)];
+
+#define ROUND(r, s, t, COLUMNS, T, D1, D2, D3) COLUMNS(COLUMN, r, s, t, T, D1, D2, D3)
+
+// The compact layout has only the table of row 0; those of rows 1 to 3 are its
+// rotations by 8, 16 and 24 bits. The last round takes bytes from the S-box S.
+#define ROTATE(w, bits) ((w) << (bits) | (w) >> (32 - (bits)))
+
+#define COMPACT_COLUMN(j, r, s, t, T, D1, D2, D3)                         \
+    t[j].word = T[s[j].bytes[0]] ^                                        \
+                ROTATE(T[s[((j) + (D1)) % Nb].bytes[1]], 8) ^             \
+                ROTATE(T[s[((j) + (D2)) % Nb].bytes[2]], 16) ^            \
+                ROTATE(T[s[((j) + (D3)) % Nb].bytes[3]], 24) ^            \
+                rk[(r) * Nb + (j)];
+
+#define FINAL_COLUMN(j, r, s, t, S, D1, D2, D3)                           \
+    t[j].word = ((word)S[s[j].bytes[0]] |                                 \
+                 (word)S[s[((j) + (D1)) % Nb].bytes[1]] << 8 |            \
+                 (word)S[s[((j) + (D2)) % Nb].bytes[2]] << 16 |           \
+                 (word)S[s[((j) + (D3)) % Nb].bytes[3]] << 24) ^          \
+                rk[(r) * Nb + (j)];
+
+#define COMPACT_ROUND(r, s, t, COLUMNS, T, D1, D2, D3) COLUMNS(COMPACT_COLUMN, r, s, t, T, D1, D2, D3)
+#define FINAL_ROUND(r, s, t, COLUMNS, S, D1, D2, D3) COLUMNS(FINAL_COLUMN, r, s, t, S, D1, D2, D3)
+
+// C1 to C3 are the ShiftRows() offsets of rows 1 to 3 for Nb.
+#define DEFINE_ROUNDS(Nb_, Nr_, C1_, C2_, C3_)                                                          \
+    static void cipher_rounds_##Nb_##_##Nr_(size_t n, const word in[], word out[], const KeySchedule *key) { \
+        enum { Nb = Nb_ };                                                                               \
+        const word *rk = key->encryption;                                                                \
+        for (size_t i = 0; i < n; ++i, in += Nb, out += Nb) {                                            \
+            uword a[Nb], b[Nb];                                                                          \
+            COLUMNS_##Nb_(LOAD_COLUMN, 0)                                                                \
+            ROUNDS_##Nr_(ROUND, COLUMNS_##Nb_, cipher_table, C1_, C2_, C3_)                              \
+            ROUND(Nr_, b, a, COLUMNS_##Nb_, s_box, C1_, C2_, C3_)                                        \
+            COLUMNS_##Nb_(STORE_COLUMN, 0)                                                               \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    static void inv_cipher_rounds_##Nb_##_##Nr_(size_t n, const word in[], word out[], const KeySchedule *key) { \
+        enum { Nb = Nb_ };                                                                               \
+        const word *rk = key->decryption;                                                                \
+        for (size_t i = 0; i < n; ++i, in += Nb, out += Nb) {                                            \
+            uword a[Nb], b[Nb];                                                                          \
+            COLUMNS_##Nb_(LOAD_COLUMN, Nr_)                                                              \
+            INV_ROUNDS_##Nr_(ROUND, COLUMNS_##Nb_, inv_cipher_table, Nb - C1_, Nb - C2_, Nb - C3_)       \
+            ROUND(0, b, a, COLUMNS_##Nb_, inverse_s_box, Nb - C1_, Nb - C2_, Nb - C3_)                   \
+            COLUMNS_##Nb_(STORE_COLUMN, 0)                                                               \
+        }                                                                                                \
     }
 
-    for (unsigned j = 0; j < Nb; ++j) {
-        state[j] =
-            s_box[0][prev[(j + 0) % Nb].bytes[0]] ^
-            s_box[1][prev[(j + 1) % Nb].bytes[1]] ^
-            s_box[2][prev[(j + 2) % Nb].bytes[2]] ^
-            s_box[3][prev[(j + 3) % Nb].bytes[3]] ^
-            key[Nr][j];
+#define DEFINE_COMPACT_ROUNDS(Nb_, Nr_, C1_, C2_, C3_)                                                  \
+    static void compact_cipher_rounds_##Nb_##_##Nr_(size_t n, const word in[], word out[], const KeySchedule *key) { \
+        enum { Nb = Nb_ };                                                                               \
+        const word *rk = key->encryption;                                                                \
+        for (size_t i = 0; i < n; ++i, in += Nb, out += Nb) {                                            \
+            uword a[Nb], b[Nb];                                                                          \
+            COLUMNS_##Nb_(LOAD_COLUMN, 0)                                                                \
+            ROUNDS_##Nr_(COMPACT_ROUND, COLUMNS_##Nb_, compact_cipher_table, C1_, C2_, C3_)              \
+            FINAL_ROUND(Nr_, b, a, COLUMNS_##Nb_, byte_s_box, C1_, C2_, C3_)                             \
+            COLUMNS_##Nb_(STORE_COLUMN, 0)                                                               \
+        }                                                                                                \
+    }                                                                                                    \
+                                                                                                         \
+    static void compact_inv_cipher_rounds_##Nb_##_##Nr_(size_t n, const word in[], word out[], const KeySchedule *key) { \
+        enum { Nb = Nb_ };                                                                               \
+        const word *rk = key->decryption;                                                                \
+        for (size_t i = 0; i < n; ++i, in += Nb, out += Nb) {                                            \
+            uword a[Nb], b[Nb];                                                                          \
+            COLUMNS_##Nb_(LOAD_COLUMN, Nr_)                                                              \
+            INV_ROUNDS_##Nr_(COMPACT_ROUND, COLUMNS_##Nb_, compact_inv_cipher_table, Nb - C1_, Nb - C2_, Nb - C3_) \
+            FINAL_ROUND(0, b, a, COLUMNS_##Nb_, byte_inverse_s_box, Nb - C1_, Nb - C2_, Nb - C3_)        \
+            COLUMNS_##Nb_(STORE_COLUMN, 0)                                                               \
+        }                                                                                                \
     }
 
-    free(prev);
+DEFINE_ROUNDS(4, 10, 1, 2, 3)
+DEFINE_ROUNDS(4, 12, 1, 2, 3)
+DEFINE_ROUNDS(4, 14, 1, 2, 3)
+DEFINE_ROUNDS(6, 12, 1, 2, 3)
+DEFINE_ROUNDS(6, 14, 1, 2, 3)
+DEFINE_ROUNDS(8, 14, 1, 3, 4)
+
+DEFINE_COMPACT_ROUNDS(4, 10, 1, 2, 3)
+DEFINE_COMPACT_ROUNDS(4, 12, 1, 2, 3)
+DEFINE_COMPACT_ROUNDS(4, 14, 1, 2, 3)
+DEFINE_COMPACT_ROUNDS(6, 12, 1, 2, 3)
+DEFINE_COMPACT_ROUNDS(6, 14, 1, 2, 3)
+DEFINE_COMPACT_ROUNDS(8, 14, 1, 3, 4)
+
+typedef struct TableRounds {
+    unsigned Nb;
+    unsigned Nr;
+    RoundsFunction *cipher_rounds;
+    RoundsFunction *inv_cipher_rounds;
+} TableRounds;
+
+static const TableRounds table_rounds[] = {
+    {4, 10, cipher_rounds_4_10, inv_cipher_rounds_4_10},
+    {4, 12, cipher_rounds_4_12, inv_cipher_rounds_4_12},
+    {4, 14, cipher_rounds_4_14, inv_cipher_rounds_4_14},
+    {6, 12, cipher_rounds_6_12, inv_cipher_rounds_6_12},
+    {6, 14, cipher_rounds_6_14, inv_cipher_rounds_6_14},
+    {8, 14, cipher_rounds_8_14, inv_cipher_rounds_8_14},
+};
+
+static const TableRounds compact_rounds[] = {
+    {4, 10, compact_cipher_rounds_4_10, compact_inv_cipher_rounds_4_10},
+    {4, 12, compact_cipher_rounds_4_12, compact_inv_cipher_rounds_4_12},
+    {4, 14, compact_cipher_rounds_4_14, compact_inv_cipher_rounds_4_14},
+    {6, 12, compact_cipher_rounds_6_12, compact_inv_cipher_rounds_6_12},
+    {6, 14, compact_cipher_rounds_6_14, compact_inv_cipher_rounds_6_14},
+    {8, 14, compact_cipher_rounds_8_14, compact_inv_cipher_rounds_8_14},
+};
+
+const Engine table_engine = {
+    "table",
+    table_supports,
+    table_cipher_blocks,
+    table_inv_cipher_blocks,
+};
+
+// the same round function over the compact layout of data.c
+const Engine compact_engine = {
+    "compact",
+    table_supports,
+    compact_cipher_blocks,
+    compact_inv_cipher_blocks,
+};
+
+word *Cipher(unsigned Nb, unsigned Nr, const word in[], const KeySchedule *key) {
+    word *state = (word *)malloc(Nb * sizeof(word));
+
+    CipherBlocks(Nb, Nr, 1, in, state, key);
 
     return state;
 }
 
-word *InvCipher(unsigned Nb, unsigned Nr, const word in[], word **key) {
+word *InvCipher(unsigned Nb, unsigned Nr, const word in[], const KeySchedule *key) {
     word *state = (word *)malloc(Nb * sizeof(word));
-    uword *prev = (uword *)malloc(Nb * sizeof(uword));
 
-    for (unsigned j = 0; j < Nb; ++j) {
-        prev[j].word = state[j] = in[j] ^ key[Nr][j];
-    }
+    InvCipherBlocks(Nb, Nr, 1, in, state, key);
 
-    for (unsigned round = Nr - 1; round > 0; --round) {
-        for (unsigned j = 0; j < Nb; ++j) {
-            state[j] =
-                inv_cipher_table[0][prev[(j + 4) % Nb].bytes[0]] ^
-                inv_cipher_table[1][prev[(j + 3) % Nb].bytes[1]] ^
-                inv_cipher_table[2][prev[(j + 2) % Nb].bytes[2]] ^
-                inv_cipher_table[3][prev[(j + 1) % Nb].bytes[3]] ^
-                key[round][j];
-        }
-        for (unsigned j = 0; j < Nb; ++j) {
-            prev[j].word = state[j];
+    return state;
+}
+
+// Encrypts n consecutive blocks of Nb words from in[] into out[], which may
+// alias. No memory is allocated.
+void CipherBlocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    get_engine(Nb)->cipher_blocks(Nb, Nr, n, in, out, key);
+}
+
+// Decrypts n consecutive blocks of Nb words from in[] into out[], which may
+// alias. No memory is allocated.
+void InvCipherBlocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    get_engine(Nb)->inv_cipher_blocks(Nb, Nr, n, in, out, key);
+}
+
+static int table_supports(unsigned Nb) {
+    return Nb == 4 || Nb == 6 || Nb == 8;
+}
+
+// Picks the table round loops for the Nb and Nr of the schedule, leaving them
+// NULL for combinations that get_Nr() does not allow, and packs the round keys
+// once if the bitsliced engine will cipher with them.
+void select_rounds(KeySchedule *schedule) {
+    schedule->bitsliced = schedule->Nb == 4 && get_engine(4) == &bitslice_engine;
+    if (schedule->bitsliced) bitslice_pack_key_schedule(schedule);
+
+    for (size_t i = 0; i < sizeof(table_rounds) / sizeof(table_rounds[0]); ++i) {
+        if (table_rounds[i].Nb == schedule->Nb && table_rounds[i].Nr == schedule->Nr) {
+            schedule->cipher_rounds = table_rounds[i].cipher_rounds;
+            schedule->inv_cipher_rounds = table_rounds[i].inv_cipher_rounds;
+            return;
         }
     }
+    schedule->cipher_rounds = schedule->inv_cipher_rounds = NULL;
+}
+
+static void table_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    (void)Nb;
+    (void)Nr;
+    key->cipher_rounds(n, in, out, key);
+}
 
-    for (unsigned j = 0; j < Nb; ++j) {
-        state[j] =
-            inverse_s_box[0][prev[(j + 4) % Nb].bytes[0]] ^
-            inverse_s_box[1][prev[(j + 3) % Nb].bytes[1]] ^
-            inverse_s_box[2][prev[(j + 2) % Nb].bytes[2]] ^
-            inverse_s_box[3][prev[(j + 1) % Nb].bytes[3]] ^
-            key[0][j];
+static void table_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    (void)Nb;
+    (void)Nr;
+    key->inv_cipher_rounds(n, in, out, key);
+}
+
+static const TableRounds *find_compact_rounds(unsigned Nb, unsigned Nr) {
+    for (size_t i = 0; i < sizeof(compact_rounds) / sizeof(compact_rounds[0]); ++i) {
+        if (compact_rounds[i].Nb == Nb && compact_rounds[i].Nr == Nr) return &compact_rounds[i];
     }
+    return NULL;
+}
 
-    free(prev);
+static void compact_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    find_compact_rounds(Nb, Nr)->cipher_rounds(n, in, out, key);
+}
 
-    return state;
+static void compact_inv_cipher_blocks(unsigned Nb, unsigned Nr, size_t n, const word in[], word out[], const KeySchedule *key) {
+    find_compact_rounds(Nb, Nr)->inv_cipher_rounds(n, in, out, key);
 }
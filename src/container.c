@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "aes.h"
+
+// Layout of a container, with every integer little-endian:
+//
+//     header   "AESC", version, mode, 2 reserved bytes, chunk size (4 bytes),
+//              nonce (12 bytes)
+//     chunks   each chunk_size bytes of ciphertext, the last possibly fewer,
+//              followed by its 16-byte tag
+//     index    the offset of each chunk in the container (8 bytes each)
+//     trailer  plaintext length and chunk count (8 bytes each), and the
+//              16-byte tag of the index
+//
+// Chunks are sealed with AES-GCM under the nonce with the chunk number added
+// into its last 8 bytes, and the header as additional data, so a chunk cannot
+// be moved within or between containers. The index is authenticated the same
+// way under the number CONTAINER_INDEX_NUMBER, which detects truncation.
+// Version 1 has chunks of a fixed size, so the index is also a check.
+
+#define CONTAINER_MAGIC "AESC"
+#define CONTAINER_INDEX_NUMBER UINT64_MAX
+
+static void index_tag(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, const byte index[], size_t length, byte tag[]);
+static void chunk_iv(const ContainerHeader *header, uint64_t number, byte iv[]);
+
+static inline void store32(byte p[], uint32_t x) {
+    for (unsigned i = 0; i < 4; ++i, x >>= 8) p[i] = (byte)x;
+}
+
+static inline uint32_t load32(const byte p[]) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store64(byte p[], uint64_t x) {
+    for (unsigned i = 0; i < 8; ++i, x >>= 8) p[i] = (byte)x;
+}
+
+uint64_t container_load64(const byte p[]) {
+    uint64_t x = 0;
+    for (unsigned i = 8; i-- > 0;) x = x << 8 | p[i];
+    return x;
+}
+
+void container_encode_header(const ContainerHeader *header, byte out[]) {
+    memcpy(out, CONTAINER_MAGIC, 4);
+    out[4] = CONTAINER_VERSION;
+    out[5] = CONTAINER_MODE_GCM;
+    out[6] = out[7] = 0;
+    store32(out + 8, header->chunk_size);
+    memcpy(out + 12, header->nonce, 12);
+}
+
+// Returns 0 if in[] is not a header of a supported version and mode.
+int container_decode_header(const byte in[], ContainerHeader *header) {
+    if (memcmp(in, CONTAINER_MAGIC, 4) != 0 || in[4] != CONTAINER_VERSION || in[5] != CONTAINER_MODE_GCM || in[6] || in[7]) {
+        return 0;
+    }
+    header->chunk_size = load32(in + 8);
+    memcpy(header->nonce, in + 12, 12);
+    return header->chunk_size >= 16 && header->chunk_size <= CONTAINER_MAX_CHUNK_SIZE;
+}
+
+uint64_t container_chunk_count(const ContainerHeader *header, uint64_t length) {
+    return (length + header->chunk_size - 1) / header->chunk_size;
+}
+
+// Offset of a chunk in the container, or of the index after the last chunk.
+uint64_t container_chunk_offset(const ContainerHeader *header, uint64_t chunk) {
+    return CONTAINER_HEADER_SIZE + chunk * (header->chunk_size + CONTAINER_TAG_SIZE);
+}
+
+// Encrypts a chunk of length bytes from in[] to out[], which may alias, and
+// writes its tag.
+void container_seal_chunk(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t chunk, size_t length, const byte in[], byte out[], byte tag[]) {
+    byte iv[12], encoded[CONTAINER_HEADER_SIZE];
+    chunk_iv(header, chunk, iv);
+    container_encode_header(header, encoded);
+
+    GcmState gcm;
+    gcm_init(&gcm, Nr, key, iv, 12);
+    gcm_aad(&gcm, CONTAINER_HEADER_SIZE, encoded);
+    gcm_encrypt(&gcm, length, in, out);
+    gcm_finish(&gcm, tag);
+}
+
+// Decrypts a chunk, and returns 0 if its tag does not match, in which case
+// out[] must not be used.
+int container_open_chunk(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t chunk, size_t length, const byte in[], byte out[], const byte tag[]) {
+    byte iv[12], encoded[CONTAINER_HEADER_SIZE], computed[CONTAINER_TAG_SIZE];
+    chunk_iv(header, chunk, iv);
+    container_encode_header(header, encoded);
+
+    GcmState gcm;
+    gcm_init(&gcm, Nr, key, iv, 12);
+    gcm_aad(&gcm, CONTAINER_HEADER_SIZE, encoded);
+    gcm_decrypt(&gcm, length, in, out);
+    gcm_finish(&gcm, computed);
+    return gcm_tag_equal(computed, tag);
+}
+
+// Writes the index and trailer of a container of length bytes of plaintext to
+// out[], which has room for container_index_size() bytes.
+void container_seal_index(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, uint64_t length, byte out[]) {
+    const uint64_t chunks = container_chunk_count(header, length);
+    for (uint64_t i = 0; i < chunks; ++i) store64(out + 8 * i, container_chunk_offset(header, i));
+    store64(out + 8 * chunks, length);
+    store64(out + 8 * chunks + 8, chunks);
+    index_tag(Nr, key, header, out, 8 * chunks + 16, out + 8 * chunks + 16);
+}
+
+size_t container_index_size(uint64_t chunks) {
+    return 8 * chunks + CONTAINER_TRAILER_SIZE;
+}
+
+// Checks the index and trailer in index[], the last index_size bytes of a
+// container of container_size bytes, and gives the plaintext length. Returns
+// 0 if they are not authentic or do not describe the container.
+int container_open_index(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, const byte index[], size_t index_size, uint64_t container_size, uint64_t *length) {
+    const uint64_t chunks = (index_size - CONTAINER_TRAILER_SIZE) / 8;
+    byte tag[CONTAINER_TAG_SIZE];
+    index_tag(Nr, key, header, index, 8 * chunks + 16, tag);
+    if (!gcm_tag_equal(tag, index + 8 * chunks + 16)) return 0;
+
+    *length = container_load64(index + 8 * chunks);
+    if (container_load64(index + 8 * chunks + 8) != chunks || container_chunk_count(header, *length) != chunks) return 0;
+    if (CONTAINER_HEADER_SIZE + *length + chunks * CONTAINER_TAG_SIZE + index_size != container_size) return 0;
+    for (uint64_t i = 0; i < chunks; ++i) {
+        if (container_load64(index + 8 * i) != container_chunk_offset(header, i)) return 0;
+    }
+    return 1;
+}
+
+// The tag of the index is a GMAC of the header and the index up to the tag.
+static void index_tag(unsigned Nr, const KeySchedule *key, const ContainerHeader *header, const byte index[], size_t length, byte tag[]) {
+    byte iv[12], encoded[CONTAINER_HEADER_SIZE + 8];
+    chunk_iv(header, CONTAINER_INDEX_NUMBER, iv);
+    container_encode_header(header, encoded);
+
+    // the header is padded to whole blocks, as only the last call to
+    // gcm_aad() may be partial
+    memset(encoded + CONTAINER_HEADER_SIZE, 0, 8);
+    GcmState gcm;
+    gcm_init(&gcm, Nr, key, iv, 12);
+    gcm_aad(&gcm, sizeof(encoded), encoded);
+    gcm_aad(&gcm, length, index);
+    gcm_finish(&gcm, tag);
+}
+
+static void chunk_iv(const ContainerHeader *header, uint64_t number, byte iv[]) {
+    memcpy(iv, header->nonce, 12);
+    for (unsigned i = 0; i < 8; ++i, number >>= 8) iv[4 + i] ^= (byte)number;
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes.h"
+#include "libaes.h"
+
+// keys copied to aligned words and expanded per call to KeyExpansionBulk()
+#define SET_KEYS_BATCH 64
+
+// ECB blocks copied to aligned words per engine call, as the caller's buffers
+// may be unaligned and are bytes, not words
+#define ECB_BATCH 64
+
+struct AesContext {
+    KeySchedule schedule;
+};
+
+static void ecb_blocks(const KeySchedule *key, size_t n, const uint8_t in[], uint8_t out[], int for_encryption);
+static AesStatus check_arguments(AesMode mode, const uint8_t iv[], size_t iv_length, const uint8_t in[], const uint8_t out[], size_t length, const uint8_t tag[]);
+
+AesStatus aes_context_new(AesContext **context, const uint8_t key[], size_t key_length) {
+    if (!context) return AES_INVALID_ARGUMENT;
+    *context = NULL;
+    if (!key || (key_length != 16 && key_length != 24 && key_length != 32)) return AES_INVALID_KEY;
+
+    // aligned_alloc() needs a multiple of the alignment
+    const size_t size = (sizeof(AesContext) + 63) / 64 * 64;
+    AesContext *new_context = (AesContext *)aligned_alloc(64, size);
+    if (!new_context) return AES_OUT_OF_MEMORY;
+
+    aes_context_set_key(new_context, key, key_length);
+    *context = new_context;
+    return AES_SUCCESS;
+}
+
+// Key bytes in order are the key words as laid out in memory, as everywhere
+// else.
+AesStatus aes_context_set_key(AesContext *context, const uint8_t key[], size_t key_length) {
+    if (!context) return AES_INVALID_ARGUMENT;
+    if (!key || (key_length != 16 && key_length != 24 && key_length != 32)) return AES_INVALID_KEY;
+    const unsigned Nk = (unsigned)key_length / 4;
+    word key_words[MAX_NB];
+    memcpy(key_words, key, key_length);
+    KeyExpansion(4, Nk + 6, key_words, Nk, &context->schedule);
+    return AES_SUCCESS;
+}
+
+// Key i is at keys + i * key_length.
+AesStatus aes_context_set_keys(AesContext *const contexts[], size_t count, const uint8_t keys[], size_t key_length) {
+    if (count && (!contexts || !keys)) return AES_INVALID_ARGUMENT;
+    if (key_length != 16 && key_length != 24 && key_length != 32) return AES_INVALID_KEY;
+    for (size_t i = 0; i < count; ++i) {
+        if (!contexts[i]) return AES_INVALID_ARGUMENT;
+    }
+
+    const unsigned Nk = (unsigned)key_length / 4;
+    word key_words[SET_KEYS_BATCH * MAX_NB];
+    KeySchedule *schedules[SET_KEYS_BATCH];
+    for (size_t first = 0; first < count; first += SET_KEYS_BATCH) {
+        const size_t n = count - first < SET_KEYS_BATCH ? count - first : SET_KEYS_BATCH;
+        memcpy(key_words, keys + first * key_length, n * key_length);
+        for (size_t i = 0; i < n; ++i) schedules[i] = &contexts[first + i]->schedule;
+        KeyExpansionBulk(4, Nk + 6, n, key_words, Nk, schedules);
+    }
+    return AES_SUCCESS;
+}
+
+void aes_context_free(AesContext *context) {
+    if (!context) return;
+    wipe_key_schedule(&context->schedule);
+    free(context);
+}
+
+AesStatus aes_encrypt(const AesContext *context, AesMode mode, const uint8_t iv[], size_t iv_length,
+                      const uint8_t in[], uint8_t out[], size_t length, uint8_t tag[]) {
+    const AesStatus status = check_arguments(mode, iv, iv_length, in, out, length, tag);
+    if (status != AES_SUCCESS) return status;
+
+    const KeySchedule *key = &context->schedule;
+    switch (mode) {
+        case AES_ECB: {
+            ecb_blocks(key, length / AES_BLOCK_SIZE, in, out, 1);
+            break;
+        }
+        case AES_CTR: {
+            ctr_blocks(4, key->Nr, key, iv, 0, length, in, out);
+            break;
+        }
+        case AES_GCM: {
+            GcmState gcm;
+            gcm_init(&gcm, key->Nr, key, iv, iv_length);
+            gcm_encrypt(&gcm, length, in, out);
+            gcm_finish(&gcm, tag);
+            break;
+        }
+    }
+    return AES_SUCCESS;
+}
+
+AesStatus aes_decrypt(const AesContext *context, AesMode mode, const uint8_t iv[], size_t iv_length,
+                      const uint8_t in[], uint8_t out[], size_t length, const uint8_t tag[]) {
+    const AesStatus status = check_arguments(mode, iv, iv_length, in, out, length, tag);
+    if (status != AES_SUCCESS) return status;
+
+    const KeySchedule *key = &context->schedule;
+    switch (mode) {
+        case AES_ECB: {
+            ecb_blocks(key, length / AES_BLOCK_SIZE, in, out, 0);
+            break;
+        }
+        case AES_CTR: {
+            // CTR decryption is the same operation as encryption
+            ctr_blocks(4, key->Nr, key, iv, 0, length, in, out);
+            break;
+        }
+        case AES_GCM: {
+            GcmState gcm;
+            byte computed_tag[AES_TAG_SIZE];
+            gcm_init(&gcm, key->Nr, key, iv, iv_length);
+            gcm_decrypt(&gcm, length, in, out);
+            gcm_finish(&gcm, computed_tag);
+            if (!gcm_tag_equal(computed_tag, tag)) {
+                memset(out, 0, length);
+                return AES_AUTHENTICATION_FAILED;
+            }
+            break;
+        }
+    }
+    return AES_SUCCESS;
+}
+
+static void ecb_blocks(const KeySchedule *key, size_t n, const uint8_t in[], uint8_t out[], int for_encryption) {
+    alignas(64) word buffer[ECB_BATCH * 4];
+    for (size_t first = 0; first < n; first += ECB_BATCH) {
+        const size_t blocks = n - first < ECB_BATCH ? n - first : ECB_BATCH;
+        memcpy(buffer, in + first * AES_BLOCK_SIZE, blocks * AES_BLOCK_SIZE);
+        if (for_encryption) {
+            CipherBlocks(4, key->Nr, blocks, buffer, buffer, key);
+        } else {
+            InvCipherBlocks(4, key->Nr, blocks, buffer, buffer, key);
+        }
+        memcpy(out + first * AES_BLOCK_SIZE, buffer, blocks * AES_BLOCK_SIZE);
+    }
+}
+
+const char *aes_status_string(AesStatus status) {
+    switch (status) {
+        case AES_SUCCESS:
+            return "Success.";
+        case AES_INVALID_ARGUMENT:
+            return "Invalid argument.";
+        case AES_INVALID_KEY:
+            return "Incorrect key length.";
+        case AES_INVALID_MODE:
+            return "Unknown mode of operation.";
+        case AES_INVALID_IV:
+            return "Incorrect IV length.";
+        case AES_INVALID_LENGTH:
+            return "Incorrect input length.";
+        case AES_OUT_OF_MEMORY:
+            return "Out of memory.";
+        case AES_AUTHENTICATION_FAILED:
+            return "Authentication failed.";
+    }
+    return "Unknown error.";
+}
+
+static AesStatus check_arguments(AesMode mode, const uint8_t iv[], size_t iv_length, const uint8_t in[], const uint8_t out[], size_t length, const uint8_t tag[]) {
+    if (length && (!in || !out)) return AES_INVALID_ARGUMENT;
+    switch (mode) {
+        case AES_ECB:
+            return length % AES_BLOCK_SIZE ? AES_INVALID_LENGTH : AES_SUCCESS;
+        case AES_CTR:
+            return iv && iv_length == AES_BLOCK_SIZE ? AES_SUCCESS : AES_INVALID_IV;
+        case AES_GCM:
+            if (!iv || !iv_length) return AES_INVALID_IV;
+            return tag ? AES_SUCCESS : AES_INVALID_ARGUMENT;
+    }
+    return AES_INVALID_MODE;
+}
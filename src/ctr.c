@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include "aes.h"
+
+// number of counter blocks encrypted per engine call
+#define CTR_BATCH 64
+
+static void counter_add(unsigned Nb, byte counter[], uint64_t n);
+
+// Encrypts or decrypts length bytes from in[] into out[], which may alias,
+// in CTR mode (NIST SP 800-38A). The keystream starts at counter block
+// iv + offset, with the whole block taken as a big-endian integer, so any
+// block-aligned part of a message can be processed independently.
+void ctr_blocks(unsigned Nb, unsigned Nr, const KeySchedule *key, const byte iv[], uint64_t offset, size_t length, const byte in[], byte out[]) {
+    const size_t block_size = 4 * Nb;
+
+    word keystream[CTR_BATCH * 8];
+
+    while (length) {
+        size_t blocks = (length + block_size - 1) / block_size;
+        if (blocks > CTR_BATCH) blocks = CTR_BATCH;
+
+        byte *stream = (byte *)keystream;
+        ctr_counters(Nb, iv, offset, blocks, stream);
+        offset += blocks;
+        CipherBlocks(Nb, Nr, blocks, keystream, keystream, key);
+
+        const size_t bytes = length < blocks * block_size ? length : blocks * block_size;
+        for (size_t i = 0; i < bytes; ++i) {
+            out[i] = in[i] ^ stream[i];
+        }
+
+        in += bytes;
+        out += bytes;
+        length -= bytes;
+    }
+}
+
+// Writes the n counter blocks from iv + offset on, to be encrypted into
+// keystream.
+void ctr_counters(unsigned Nb, const byte iv[], uint64_t offset, size_t n, byte out[]) {
+    const size_t block_size = 4 * Nb;
+    byte counter[32];
+    memcpy(counter, iv, block_size);
+    counter_add(Nb, counter, offset);
+    for (size_t b = 0; b < n; ++b) {
+        memcpy(out + b * block_size, counter, block_size);
+        counter_add(Nb, counter, 1);
+    }
+}
+
+static void counter_add(unsigned Nb, byte counter[], uint64_t n) {
+    for (unsigned i = 4 * Nb; i-- > 0 && n;) {
+        n += counter[i];
+        counter[i] = (byte)n;
+        n >>= 8;
+    }
+}
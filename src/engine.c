@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "aes.h"
+
+// the table engine of the layout chosen at build time, which supports every
+// Nb and is used when no faster engine is
+#if AES_COMPACT_TABLES
+#define DEFAULT_TABLE_ENGINE compact_engine
+#else
+#define DEFAULT_TABLE_ENGINE table_engine
+#endif
+
+// in order of preference; the table engines support every Nb and come last
+static const Engine *const engines[] = {
+    &aesni_engine,
+    &bitslice_engine,
+    &DEFAULT_TABLE_ENGINE,
+#if AES_COMPACT_TABLES
+    &table_engine,
+#else
+    &compact_engine,
+#endif
+};
+
+// atomic, as contexts may be created and used by several threads at once
+static _Atomic(const Engine *) preferred_engine = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void select_default_engine(void) {
+    const Engine *none = NULL;
+    const Engine *fastest = &DEFAULT_TABLE_ENGINE;
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        if (engines[i]->supports(4)) {
+            fastest = engines[i];
+            break;
+        }
+    }
+    // an engine chosen by select_engine() in the meantime is kept
+    atomic_compare_exchange_strong(&preferred_engine, &none, fastest);
+}
+
+const Engine *get_engine(unsigned Nb) {
+    const Engine *preferred = atomic_load(&preferred_engine);
+    if (!preferred) {
+        pthread_once(&default_once, select_default_engine);
+        preferred = atomic_load(&preferred_engine);
+    }
+    if (preferred->supports(Nb)) return preferred;
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        if (engines[i]->supports(Nb)) return engines[i];
+    }
+    return &DEFAULT_TABLE_ENGINE;
+}
+
+// Selects the engine with the given name, or the fastest one supported by the
+// CPU if name is NULL. Returns 0 if no engine of that name is available.
+int select_engine(const char *name) {
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        if ((!name || strcmp(engines[i]->name, name) == 0) && engines[i]->supports(4)) {
+            atomic_store(&preferred_engine, engines[i]);
+            return 1;
+        }
+    }
+    if (!name) atomic_store(&preferred_engine, &DEFAULT_TABLE_ENGINE);
+    return 0;
+}
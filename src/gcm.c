@@ -0,0 +1,305 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GCM_CLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <pthread.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#else
+#define GCM_CLMUL 0
+#endif
+
+// number of blocks encrypted and then hashed together while still in cache
+#define GCM_BATCH 32
+
+// cleared by ghash_select() to force the table-driven GHASH
+static atomic_int clmul_allowed = 1;
+
+static void ghash_blocks(GcmState *gcm, const byte in[], size_t blocks);
+static void gcm_crypt(GcmState *gcm, size_t length, const byte in[], byte out[], int for_encryption);
+static void increment32(byte counter[]);
+
+static inline uint64_t load64(const byte p[]) {
+    uint64_t x = 0;
+    for (unsigned i = 0; i < 8; ++i) x = x << 8 | p[i];
+    return x;
+}
+
+static inline void store64(byte p[], uint64_t x) {
+    for (unsigned i = 8; i-- > 0; x >>= 8) p[i] = (byte)x;
+}
+
+#if GCM_CLMUL
+
+static int clmul_detected;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+static void detect_clmul(void) {
+    unsigned eax, ebx, ecx, edx;
+    clmul_detected = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+static int clmul_supported(void) {
+    pthread_once(&detect_once, detect_clmul);
+    return clmul_detected;
+}
+
+// Multiplies a and b in GF(2^128), both in byte-reversed GCM bit order
+// (Intel carry-less multiplication white paper, algorithm 5).
+CLMUL_TARGET
+static __m128i clmul_multiply(__m128i a, __m128i b) {
+    __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // shift the 256-bit product left by one bit for the reflected order
+    __m128i carry_lo = _mm_srli_epi32(lo, 31);
+    __m128i carry_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i carry_mid = _mm_srli_si128(carry_lo, 12);
+    carry_hi = _mm_slli_si128(carry_hi, 4);
+    carry_lo = _mm_slli_si128(carry_lo, 4);
+    lo = _mm_or_si128(lo, carry_lo);
+    hi = _mm_or_si128(hi, carry_hi);
+    hi = _mm_or_si128(hi, carry_mid);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i t_hi = _mm_srli_si128(t, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+    __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    u = _mm_xor_si128(u, t_hi);
+    lo = _mm_xor_si128(lo, u);
+    return _mm_xor_si128(hi, lo);
+}
+
+CLMUL_TARGET
+static void clmul_ghash_blocks(GcmState *gcm, const byte in[], size_t blocks) {
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)gcm->h), reverse);
+    __m128i y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)gcm->y), reverse);
+    for (size_t b = 0; b < blocks; ++b) {
+        const __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 16 * b)), reverse);
+        y = clmul_multiply(_mm_xor_si128(y, x), h);
+    }
+    _mm_storeu_si128((__m128i *)gcm->y, _mm_shuffle_epi8(y, reverse));
+}
+
+#endif
+
+// reduction of the 4 bits shifted out of the low end, for table_multiply()
+static const uint64_t last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0,
+};
+
+// Builds the table of i * H for every 4-bit i (Shoup's method).
+static void table_init(GcmState *gcm) {
+    uint64_t vh = load64(gcm->h);
+    uint64_t vl = load64(gcm->h + 8);
+
+    gcm->hl[0] = gcm->hh[0] = 0;
+    gcm->hl[8] = vl;
+    gcm->hh[8] = vh;
+    for (unsigned i = 4; i > 0; i >>= 1) {
+        const uint64_t t = (vl & 1) * 0xe1000000;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (t << 32);
+        gcm->hl[i] = vl;
+        gcm->hh[i] = vh;
+    }
+    for (unsigned i = 2; i <= 8; i *= 2) {
+        for (unsigned j = 1; j < i; ++j) {
+            gcm->hh[i + j] = gcm->hh[i] ^ gcm->hh[j];
+            gcm->hl[i + j] = gcm->hl[i] ^ gcm->hl[j];
+        }
+    }
+}
+
+// Sets x to x * H, four bits at a time.
+static void table_multiply(const GcmState *gcm, byte x[]) {
+    unsigned lo = x[15] & 0x0f;
+    uint64_t zh = gcm->hh[lo];
+    uint64_t zl = gcm->hl[lo];
+
+    for (int i = 15; i >= 0; --i) {
+        lo = x[i] & 0x0f;
+        const unsigned hi = x[i] >> 4;
+        unsigned rem;
+        if (i != 15) {
+            rem = zl & 0x0f;
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (last4[rem] << 48);
+            zh ^= gcm->hh[lo];
+            zl ^= gcm->hl[lo];
+        }
+        rem = zl & 0x0f;
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (last4[rem] << 48);
+        zh ^= gcm->hh[hi];
+        zl ^= gcm->hl[hi];
+    }
+
+    store64(x, zh);
+    store64(x + 8, zl);
+}
+
+static void ghash_blocks(GcmState *gcm, const byte in[], size_t blocks) {
+#if GCM_CLMUL
+    if (gcm->clmul) {
+        clmul_ghash_blocks(gcm, in, blocks);
+        return;
+    }
+#endif
+    for (size_t b = 0; b < blocks; ++b) {
+        for (unsigned i = 0; i < 16; ++i) gcm->y[i] ^= in[16 * b + i];
+        table_multiply(gcm, gcm->y);
+    }
+}
+
+// hashes a trailing partial block, zero-padded
+static void ghash_partial(GcmState *gcm, const byte in[], size_t length) {
+    byte block[16] = {0};
+    memcpy(block, in, length);
+    ghash_blocks(gcm, block, 1);
+}
+
+// Restricts GHASH to the named implementation ("clmul" or "table") for the
+// operations started afterwards, or lifts the restriction if name is NULL.
+// Returns 0 if the processor does not support it.
+int ghash_select(const char *name) {
+    if (!name || strcmp(name, "clmul") == 0) {
+        atomic_store(&clmul_allowed, 1);
+#if GCM_CLMUL
+        return !name || clmul_supported();
+#else
+        return !name;
+#endif
+    }
+    if (strcmp(name, "table") != 0) return 0;
+    atomic_store(&clmul_allowed, 0);
+    return 1;
+}
+
+// Starts a GCM (NIST SP 800-38D) operation with an AES key schedule for
+// encryption (Nb = 4) and an IV of any nonzero length.
+void gcm_init(GcmState *gcm, unsigned Nr, const KeySchedule *key, const byte iv[], size_t iv_length) {
+    memset(gcm, 0, sizeof(GcmState));
+    gcm->Nr = Nr;
+    gcm->key = key;
+
+    word h[4] = {0};
+    CipherBlocks(4, Nr, 1, h, h, key);
+    memcpy(gcm->h, h, 16);
+#if GCM_CLMUL
+    gcm->clmul = clmul_supported() && atomic_load(&clmul_allowed);
+#endif
+    table_init(gcm);
+
+    if (iv_length == 12) {
+        memcpy(gcm->j0, iv, 12);
+        gcm->j0[15] = 1;
+    } else {
+        ghash_blocks(gcm, iv, iv_length / 16);
+        if (iv_length % 16) ghash_partial(gcm, iv + iv_length / 16 * 16, iv_length % 16);
+        byte lengths[16] = {0};
+        store64(lengths + 8, (uint64_t)iv_length * 8);
+        ghash_blocks(gcm, lengths, 1);
+        memcpy(gcm->j0, gcm->y, 16);
+        memset(gcm->y, 0, 16);
+    }
+
+    memcpy(gcm->counter, gcm->j0, 16);
+    increment32(gcm->counter);
+}
+
+// Authenticates length bytes of additional data, which is not encrypted. It
+// must come before any data, and only the last call may be a partial block.
+void gcm_aad(GcmState *gcm, size_t length, const byte aad[]) {
+    gcm->aad_length += length;
+    ghash_blocks(gcm, aad, length / 16);
+    if (length % 16) ghash_partial(gcm, aad + length / 16 * 16, length % 16);
+}
+
+// Encrypts length bytes, which must be a multiple of 16 except in the last
+// call before gcm_finish(). in[] and out[] may alias.
+void gcm_encrypt(GcmState *gcm, size_t length, const byte in[], byte out[]) {
+    gcm_crypt(gcm, length, in, out, 1);
+}
+
+// Decrypts length bytes, with the same restrictions as gcm_encrypt(). The
+// output must not be released before gcm_finish() has verified the tag.
+void gcm_decrypt(GcmState *gcm, size_t length, const byte in[], byte out[]) {
+    gcm_crypt(gcm, length, in, out, 0);
+}
+
+void gcm_finish(GcmState *gcm, byte tag[]) {
+    byte lengths[16];
+    store64(lengths, gcm->aad_length * 8);
+    store64(lengths + 8, gcm->length * 8);
+    ghash_blocks(gcm, lengths, 1);
+
+    word mask[4];
+    memcpy(mask, gcm->j0, 16);
+    CipherBlocks(4, gcm->Nr, 1, mask, mask, gcm->key);
+    memcpy(tag, mask, 16);
+    for (unsigned i = 0; i < 16; ++i) tag[i] ^= gcm->y[i];
+}
+
+// Compares two tags in constant time. Returns 1 if they are equal.
+int gcm_tag_equal(const byte a[], const byte b[]) {
+    byte diff = 0;
+    for (unsigned i = 0; i < 16; ++i) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// Generates a batch of keystream, applies it, and hashes the ciphertext of
+// the same batch before moving on, so the data is traversed once.
+static void gcm_crypt(GcmState *gcm, size_t length, const byte in[], byte out[], int for_encryption) {
+    word keystream[GCM_BATCH * 4];
+    byte ciphertext[GCM_BATCH * 16];
+
+    gcm->length += length;
+
+    while (length) {
+        size_t blocks = (length + 15) / 16;
+        if (blocks > GCM_BATCH) blocks = GCM_BATCH;
+        const size_t bytes = length < blocks * 16 ? length : blocks * 16;
+
+        byte *stream = (byte *)keystream;
+        for (size_t b = 0; b < blocks; ++b) {
+            memcpy(stream + 16 * b, gcm->counter, 16);
+            increment32(gcm->counter);
+        }
+        CipherBlocks(4, gcm->Nr, blocks, keystream, keystream, gcm->key);
+
+        // keep a copy of the ciphertext in case out[] aliases in[]
+        const byte *hashed = for_encryption ? out : ciphertext;
+        if (!for_encryption) memcpy(ciphertext, in, bytes);
+        for (size_t i = 0; i < bytes; ++i) {
+            out[i] = in[i] ^ stream[i];
+        }
+
+        ghash_blocks(gcm, hashed, bytes / 16);
+        if (bytes % 16) ghash_partial(gcm, hashed + bytes / 16 * 16, bytes % 16);
+
+        in += bytes;
+        out += bytes;
+        length -= bytes;
+    }
+}
+
+static void increment32(byte counter[]) {
+    for (unsigned i = 16; i-- > 12;) {
+        if (++counter[i]) break;
+    }
+}
@@ -0,0 +1,370 @@
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HEX_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#include <pthread.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define HEX_SIMD 0
+#endif
+
+typedef enum HexLevel {
+    HEX_SCALAR,
+    HEX_SSE2,
+    HEX_AVX2,
+} HexLevel;
+
+static const char *const level_names[] = {"scalar", "sse2", "avx2"};
+
+// The value of each hexadecimal digit with bit 4 set, and 0 for any other
+// character, so that validity is checked without branches.
+static const byte hex_values[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+    ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const byte hex_spaces[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+};
+
+// highest level that hex_select() allows
+static HexLevel level_limit = HEX_AVX2;
+
+static HexLevel get_level(void);
+static int scalar_decode(const char hex[], size_t length, byte out[]);
+static void scalar_encode(const byte in[], size_t length, char hex[]);
+static size_t scalar_strip(const char str[], size_t length, char out[]);
+
+#if HEX_SIMD
+
+static HexLevel supported_level;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+// For each mask of the bytes to keep in 8 bytes, the pshufb indices that move
+// them to the front; the rest are cleared.
+static byte pack_shuffles[256][8];
+
+static void detect_level(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+        supported_level = HEX_SSE2;
+        // AVX2 also needs the operating system to save the YMM registers
+        if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+            unsigned xcr0_low, xcr0_high;
+            __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+            if ((xcr0_low & 6) == 6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2)) {
+                supported_level = HEX_AVX2;
+            }
+        }
+    }
+
+    for (unsigned mask = 0; mask < 256; ++mask) {
+        unsigned n = 0;
+        for (unsigned i = 0; i < 8; ++i) {
+            if (mask >> i & 1) pack_shuffles[mask][n++] = (byte)i;
+        }
+        while (n < 8) pack_shuffles[mask][n++] = 0x80;
+    }
+}
+
+static HexLevel get_level(void) {
+    pthread_once(&detect_once, detect_level);
+    return supported_level < level_limit ? supported_level : level_limit;
+}
+
+// Sets the bytes of valid where c is a hexadecimal digit, and returns the
+// value of each such digit.
+SSE2_TARGET
+static inline __m128i sse2_nibbles(__m128i c, __m128i *valid) {
+    const __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    const __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digit, _mm_set1_epi8(-1)), _mm_cmplt_epi8(digit, _mm_set1_epi8(10)));
+    const __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letter, _mm_set1_epi8(-1)), _mm_cmplt_epi8(letter, _mm_set1_epi8(6)));
+    *valid = _mm_or_si128(is_digit, is_letter);
+    return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+// Joins each pair of nibbles into the low byte of its 16-bit lane.
+SSE2_TARGET
+static inline __m128i sse2_join(__m128i nibbles) {
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(nibbles, 8));
+}
+
+// The digit of each nibble.
+SSE2_TARGET
+static inline __m128i sse2_digits(__m128i nibbles) {
+    const __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+// Decodes 16 bytes at a time and returns how many bytes were decoded.
+SSE2_TARGET
+static size_t sse2_decode(const char hex[], size_t length, byte out[], int *valid) {
+    __m128i all_valid = _mm_set1_epi8(-1), v0, v1;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i n0 = sse2_nibbles(_mm_loadu_si128((const __m128i *)(hex + 2 * i)), &v0);
+        const __m128i n1 = sse2_nibbles(_mm_loadu_si128((const __m128i *)(hex + 2 * i + 16)), &v1);
+        all_valid = _mm_and_si128(all_valid, _mm_and_si128(v0, v1));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sse2_join(n0), sse2_join(n1)));
+    }
+    *valid = _mm_movemask_epi8(all_valid) == 0xffff;
+    return i;
+}
+
+SSE2_TARGET
+static size_t sse2_encode(const byte in[], size_t length, char hex[]) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+        const __m128i high = sse2_digits(_mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0f)));
+        const __m128i low = sse2_digits(_mm_and_si128(bytes, _mm_set1_epi8(0x0f)));
+        _mm_storeu_si128((__m128i *)(hex + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(hex + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+    return i;
+}
+
+// Copies runs of 16 digits at once; blocks holding whitespace are compacted a
+// character at a time. Sets *consumed to the characters read, and returns the
+// digits written or (size_t)-1.
+SSE2_TARGET
+static size_t sse2_strip(const char str[], size_t length, char out[], size_t *consumed) {
+    size_t i = 0, n = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i c = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i valid;
+        sse2_nibbles(c, &valid);
+        const __m128i control = _mm_sub_epi8(c, _mm_set1_epi8('\t'));
+        const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                           _mm_and_si128(_mm_cmpgt_epi8(control, _mm_set1_epi8(-1)), _mm_cmplt_epi8(control, _mm_set1_epi8(5))));
+        const unsigned digits = (unsigned)_mm_movemask_epi8(valid);
+        if ((digits | (unsigned)_mm_movemask_epi8(space)) != 0xffff) return (size_t)-1;
+        if (digits == 0xffff) {
+            _mm_storeu_si128((__m128i *)(out + n), c);
+            n += 16;
+            continue;
+        }
+        for (unsigned k = 0; k < 16; ++k) {
+            if (digits >> k & 1) out[n++] = str[i + k];
+        }
+    }
+    *consumed = i;
+    return n;
+}
+
+AVX2_TARGET
+static inline __m256i avx2_nibbles(__m256i c, __m256i *valid) {
+    const __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    const __m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    const __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(digit, _mm256_set1_epi8(-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(10), digit));
+    const __m256i is_letter = _mm256_and_si256(_mm256_cmpgt_epi8(letter, _mm256_set1_epi8(-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(6), letter));
+    *valid = _mm256_or_si256(is_digit, is_letter);
+    return _mm256_or_si256(_mm256_and_si256(is_digit, digit), _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+AVX2_TARGET
+static inline __m256i avx2_join(__m256i nibbles) {
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nibbles, _mm256_set1_epi16(0x00ff)), 4), _mm256_srli_epi16(nibbles, 8));
+}
+
+AVX2_TARGET
+static inline __m256i avx2_digits(__m256i nibbles) {
+    const __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9)), _mm256_set1_epi8('a' - '0' - 10));
+    return _mm256_add_epi8(_mm256_add_epi8(nibbles, _mm256_set1_epi8('0')), letters);
+}
+
+// Packing works within 128-bit lanes, so the 64-bit quarters are put back in
+// order afterwards.
+AVX2_TARGET
+static size_t avx2_decode(const char hex[], size_t length, byte out[], int *valid) {
+    __m256i all_valid = _mm256_set1_epi8(-1), v0, v1;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i n0 = avx2_nibbles(_mm256_loadu_si256((const __m256i *)(hex + 2 * i)), &v0);
+        const __m256i n1 = avx2_nibbles(_mm256_loadu_si256((const __m256i *)(hex + 2 * i + 32)), &v1);
+        all_valid = _mm256_and_si256(all_valid, _mm256_and_si256(v0, v1));
+        const __m256i packed = _mm256_packus_epi16(avx2_join(n0), avx2_join(n1));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    *valid = _mm256_movemask_epi8(all_valid) == -1;
+    return i;
+}
+
+// Unpacking works within 128-bit lanes, so the quarters are arranged for it
+// beforehand.
+AVX2_TARGET
+static size_t avx2_encode(const byte in[], size_t length, char hex[]) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i bytes = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(in + i)), 0xd8);
+        const __m256i high = avx2_digits(_mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0f)));
+        const __m256i low = avx2_digits(_mm256_and_si256(bytes, _mm256_set1_epi8(0x0f)));
+        _mm256_storeu_si256((__m256i *)(hex + 2 * i), _mm256_unpacklo_epi8(high, low));
+        _mm256_storeu_si256((__m256i *)(hex + 2 * i + 32), _mm256_unpackhi_epi8(high, low));
+    }
+    return i;
+}
+
+// Like sse2_strip(), but blocks holding whitespace are compacted with pshufb
+// 8 characters at a time. Each store may write past the digits kept, but
+// never past the characters already read, so out may still be str.
+AVX2_TARGET
+static size_t avx2_strip(const char str[], size_t length, char out[], size_t *consumed) {
+    size_t i = 0, n = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i valid;
+        avx2_nibbles(c, &valid);
+        const __m256i control = _mm256_sub_epi8(c, _mm256_set1_epi8('\t'));
+        const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                              _mm256_and_si256(_mm256_cmpgt_epi8(control, _mm256_set1_epi8(-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(5), control)));
+        const uint32_t digits = (uint32_t)_mm256_movemask_epi8(valid);
+        if ((digits | (uint32_t)_mm256_movemask_epi8(space)) != 0xffffffffu) return (size_t)-1;
+        if (digits == 0xffffffffu) {
+            _mm256_storeu_si256((__m256i *)(out + n), c);
+            n += 32;
+            continue;
+        }
+        for (unsigned half = 0; half < 2; ++half) {
+            const __m128i chars = half ? _mm256_extracti128_si256(c, 1) : _mm256_castsi256_si128(c);
+            const unsigned low = digits >> (16 * half) & 0xff, high = digits >> (16 * half + 8) & 0xff;
+            uint64_t low_shuffle, high_shuffle;
+            memcpy(&low_shuffle, pack_shuffles[low], 8);
+            memcpy(&high_shuffle, pack_shuffles[high], 8);
+            // the indices of the upper 8 characters are offset by 8; cleared
+            // entries stay cleared
+            high_shuffle += 0x0808080808080808u;
+            const __m128i packed = _mm_shuffle_epi8(chars, _mm_set_epi64x((long long)high_shuffle, (long long)low_shuffle));
+            const unsigned low_count = (unsigned)__builtin_popcount(low);
+            _mm_storel_epi64((__m128i *)(out + n), packed);
+            _mm_storel_epi64((__m128i *)(out + n + low_count), _mm_srli_si128(packed, 8));
+            n += low_count + (unsigned)__builtin_popcount(high);
+        }
+    }
+    *consumed = i;
+    return n;
+}
+
+#else
+
+static HexLevel get_level(void) {
+    return HEX_SCALAR;
+}
+
+#endif
+
+// Restricts the routines below to the named implementation ("scalar", "sse2"
+// or "avx2"), or lifts the restriction if name is NULL. Returns 0 if the
+// processor does not support it.
+int hex_select(const char *name) {
+    level_limit = HEX_AVX2;
+    if (!name) return 1;
+    const HexLevel supported = get_level();
+    for (unsigned level = HEX_SCALAR; level <= supported; ++level) {
+        if (strcmp(level_names[level], name) == 0) {
+            level_limit = (HexLevel)level;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decodes 2 * length hexadecimal digits into length bytes. Returns 0 if any
+// character is not a hexadecimal digit.
+int hex_decode(const char hex[], size_t length, byte out[]) {
+    size_t done = 0;
+    int valid = 1;
+#if HEX_SIMD
+    switch (get_level()) {
+        case HEX_AVX2:
+            done = avx2_decode(hex, length, out, &valid);
+            break;
+        case HEX_SSE2:
+            done = sse2_decode(hex, length, out, &valid);
+            break;
+        case HEX_SCALAR:
+            break;
+    }
+#endif
+    return scalar_decode(hex + 2 * done, length - done, out + done) & valid;
+}
+
+// Writes 2 * length lowercase hexadecimal digits, without a terminator.
+void hex_encode(const byte in[], size_t length, char hex[]) {
+    size_t done = 0;
+#if HEX_SIMD
+    switch (get_level()) {
+        case HEX_AVX2:
+            done = avx2_encode(in, length, hex);
+            break;
+        case HEX_SSE2:
+            done = sse2_encode(in, length, hex);
+            break;
+        case HEX_SCALAR:
+            break;
+    }
+#endif
+    scalar_encode(in + done, length - done, hex + 2 * done);
+}
+
+// Copies the hexadecimal digits of str[0, length) to out, skipping
+// whitespace. Returns the number of digits copied, or (size_t)-1 if str
+// contains any other character. out must have room for length characters,
+// and may be str.
+size_t hex_strip(const char str[], size_t length, char out[]) {
+    size_t done = 0, n = 0;
+#if HEX_SIMD
+    switch (get_level()) {
+        case HEX_AVX2:
+            n = avx2_strip(str, length, out, &done);
+            break;
+        case HEX_SSE2:
+            n = sse2_strip(str, length, out, &done);
+            break;
+        case HEX_SCALAR:
+            break;
+    }
+    if (n == (size_t)-1) return n;
+#endif
+    const size_t rest = scalar_strip(str + done, length - done, out + n);
+    return rest == (size_t)-1 ? rest : n + rest;
+}
+
+static int scalar_decode(const char hex[], size_t length, byte out[]) {
+    byte valid = 0x10;
+    for (size_t i = 0; i < length; ++i) {
+        const byte high = hex_values[(byte)hex[2 * i]];
+        const byte low = hex_values[(byte)hex[2 * i + 1]];
+        valid &= high & low;
+        out[i] = (byte)(high << 4 | (low & 0x0f));
+    }
+    return valid != 0;
+}
+
+static void scalar_encode(const byte in[], size_t length, char hex[]) {
+    for (size_t i = 0; i < length; ++i) {
+        hex[2 * i] = hex_digits[in[i] >> 4];
+        hex[2 * i + 1] = hex_digits[in[i] & 0x0f];
+    }
+}
+
+static size_t scalar_strip(const char str[], size_t length, char out[]) {
+    size_t n = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const byte c = (byte)str[i];
+        if (hex_spaces[c]) continue;
+        if (!hex_values[c]) return (size_t)-1;
+        out[n++] = (char)c;
+    }
+    return n;
+}
@@ -1,30 +1,122 @@
 // disables deprecation warning for fopen
 #define _CRT_SECURE_NO_WARNINGS
+#define _POSIX_C_SOURCE 200809L
 
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "aes.h"
 #include "io.h"
 
+// default size of the buffers used for file modes
+#define DEFAULT_BUFFER_SIZE ((size_t)1 << 20)
+
+// smallest regular file, in buffers, that is streamed through the pipeline
+#define PIPELINE_MIN_BUFFERS 4
+
+// default XTS data unit size, that of a disk sector
+#define DEFAULT_UNIT_SIZE 4096
+
+// default chunk size of containers, small enough for ranges to be cheap
+#define DEFAULT_CHUNK_SIZE ((size_t)1 << 16)
+
+// blocks ciphered at once, and sizes of the input and output buffers, in the
+// batch hexadecimal mode; the output holds a whole batch of the largest blocks
+#define BATCH_BLOCKS 1024
+#define BATCH_INPUT_SIZE ((size_t)1 << 16)
+#define BATCH_OUTPUT_SIZE (BATCH_BLOCKS * 8 * MAX_NB)
+
+typedef struct BlockStream {
+    unsigned Nb;
+    unsigned Nr;
+    KeySchedule key;
+    byte iv[32];
+    uint64_t offset;
+} BlockStream;
+
 static inline unsigned get_Nr(unsigned Nb, unsigned Nk);
 
-static char *cipher_hex_interface(unsigned Nb, unsigned Nk, unsigned Nr, word **key, word in[], int for_encryption);
+static char *cipher_hex_interface(unsigned Nb, unsigned Nk, unsigned Nr, const KeySchedule *key, word in[], int for_encryption);
+static char *ctr_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, const CipherOptions *options);
+static char *gcm_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options);
+static char *cbc_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options);
+static char *xts_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options);
+
+static void cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void inv_cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void ctr_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void stream_file_interface(BlockStream *stream, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, StreamTransform *transform, const CipherOptions *options);
+static FileStatus ecb_encrypt_transform(void *context, byte data[], size_t *length, int last);
+static FileStatus ecb_decrypt_transform(void *context, byte data[], size_t *length, int last);
+static FileStatus ctr_transform(void *context, byte data[], size_t *length, int last);
+static void cbc_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void inv_cbc_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static FileStatus cbc_encrypt_transform(void *context, byte data[], size_t *length, int last);
+static FileStatus cbc_decrypt_transform(void *context, byte data[], size_t *length, int last);
+static void gcm_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void inv_gcm_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void mapped_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options);
+static void xts_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options);
+static FileStatus xts_transform(void *context, byte data[], size_t *length, int last);
+static void container_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+static void inv_container_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options);
+
+typedef struct HexBatch HexBatch;
+static void batch_append(HexBatch *batch, const char *str, size_t length);
+static void batch_end_line(HexBatch *batch);
+static void batch_cipher(HexBatch *batch);
+static void batch_flush(HexBatch *batch);
+static void batch_error(HexBatch *batch, const char *msg);
 
-static void cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir);
-static void inv_cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir);
+typedef struct TreeFile TreeFile;
+static void tree_file_task(WorkPool *pool, unsigned worker, void *context);
+static void tree_chunk_task(WorkPool *pool, unsigned worker, void *context);
+static void tree_cipher_chunk(TreeFile *file, size_t index, unsigned worker);
+static void tree_finish_file(TreeFile *file);
 
-static word **hex_string_to_expanded_key(unsigned Nb, unsigned Nr, const char *key, unsigned Nk, int for_encryption);
+static void print_file_status(FileStatus status, const char *in_dir, const char *out_dir);
+static size_t read_stream(byte buffer[], size_t capacity, FILE *file);
+static int write_stream(const byte data[], size_t length, FILE *file);
+static int is_regular_file(const char *dir);
+static int use_pipeline(const char *in_dir, size_t capacity, const CipherOptions *options);
+
+static void hex_string_to_key_schedule(unsigned Nb, unsigned Nr, const char *key, unsigned Nk, KeySchedule *schedule, const CipherOptions *options);
+static void hex_string_to_xts_key(unsigned Nb, unsigned Nr, const char *key, unsigned Nk, XtsKey *xts_key, const CipherOptions *options);
+static int xts_length_valid(uint64_t length, size_t unit_size);
 
 static void block_bit_padding(unsigned Nb, byte block[], unsigned start);
 static int get_block_padding_position(unsigned Nb, const byte block[]);
 
+static void hex_string_to_iv(unsigned Nb, const char *str, byte iv[]);
+static byte *hex_string_to_gcm_iv(unsigned Nb, const char *str, size_t *length);
+
 static word *hex_string_to_block(unsigned Nb, const char *str);
 static char *block_to_hex_string(unsigned Nb, const word block[]);
+static byte *hex_string_to_bytes(const char *str, size_t *length);
+static char *bytes_to_hex_string(const byte bytes[], size_t length);
+
+char *cipher_hex(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options) {
+    if (options->mode == MODE_CTR) {
+        return ctr_hex_interface(Nb, Nk, key, in, options);
+    }
+    if (options->mode == MODE_GCM) {
+        return gcm_hex_interface(Nb, Nk, key, in, for_encryption, options);
+    }
+    if (options->mode == MODE_CBC) {
+        return cbc_hex_interface(Nb, Nk, key, in, for_encryption, options);
+    }
+    if (options->mode == MODE_XTS) {
+        return xts_hex_interface(Nb, Nk, key, in, for_encryption, options);
+    }
+    if (options->mode == MODE_CONTAINER) error("Container mode only supports files.", NULL);
 
-char *cipher_hex(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption) {
     unsigned Nr = get_Nr(Nb, Nk);
 
     char *in_processed = process_hex_string(in);
@@ -35,156 +127,1630 @@ char *cipher_hex(unsigned Nb, unsigned Nk, const char *key, const char *in, int
     word *in_block = hex_string_to_block(Nb, in_processed);
     free(in_processed);
 
-    word **key_processed = hex_string_to_expanded_key(Nb, Nr, key, Nk, for_encryption);
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
 
-    char *out = cipher_hex_interface(Nb, Nk, Nr, key_processed, in_block, for_encryption);
+    char *out = cipher_hex_interface(Nb, Nk, Nr, &key_schedule, in_block, for_encryption);
+    wipe_key_schedule(&key_schedule);
 
     free(in_block);
-    for (unsigned i = 0; i <= Nr; ++i) free(key_processed[i]);
-    free(key_processed);
 
     return out;
 }
 
-void cipher_file(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption) {
-    if (for_encryption) {
-        cipher_file_interface(Nb, Nk, key, in_dir, out_dir);
+void cipher_file(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options) {
+    if (options->memory_map && (options->mode == MODE_ECB || options->mode == MODE_CTR) &&
+        is_regular_file(in_dir) && strcmp(out_dir, "-") != 0) {
+        mapped_file_interface(Nb, Nk, key, in_dir, out_dir, for_encryption, options);
+        return;
+    }
+
+    switch (options->mode) {
+        case MODE_ECB: {
+            if (for_encryption) {
+                cipher_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            } else {
+                inv_cipher_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            }
+            break;
+        }
+        case MODE_CTR: {
+            // CTR decryption is the same operation as encryption
+            ctr_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            break;
+        }
+        case MODE_GCM: {
+            if (for_encryption) {
+                gcm_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            } else {
+                inv_gcm_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            }
+            break;
+        }
+        case MODE_CBC: {
+            if (for_encryption) {
+                cbc_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            } else {
+                inv_cbc_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            }
+            break;
+        }
+        case MODE_XTS: {
+            xts_file_interface(Nb, Nk, key, in_dir, out_dir, for_encryption, options);
+            break;
+        }
+        case MODE_CONTAINER: {
+            if (for_encryption) {
+                container_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            } else {
+                inv_container_file_interface(Nb, Nk, key, in_dir, out_dir, options);
+            }
+            break;
+        }
+    }
+}
+
+static void print_file_status(FileStatus status, const char *in_dir, const char *out_dir) {
+    switch (status) {
+        case FILE_SUCCESS:
+            return;
+        case FILE_READ_ERROR:
+            print_error(": Failed to read input file.", in_dir);
+            return;
+        case FILE_WRITE_ERROR:
+            print_error(": Failed to write output file.", out_dir);
+            return;
+        case FILE_FORMAT_ERROR:
+            print_error(": Incorrect input file. Is it empty or modified?", in_dir);
+            return;
+        case FILE_PADDING_ERROR:
+            print_error(": Could not correctly interpret input.", in_dir);
+            return;
+        case FILE_AUTHENTICATION_ERROR:
+            print_error(": Authentication failed. Is it modified?", in_dir);
+            return;
+    }
+}
+
+static void report_file_status(FileStatus status, const char *in_dir, const char *out_dir) {
+    if (status == FILE_SUCCESS) return;
+    print_file_status(status, in_dir, out_dir);
+    exit(EXIT_FAILURE);
+}
+
+// fread() and fwrite() of whole buffers, counted for --stats.
+static size_t read_stream(byte buffer[], size_t capacity, FILE *file) {
+    StatsTimer timer;
+    stats_start(&timer);
+    const size_t length = fread(buffer, sizeof(byte), capacity, file);
+    stats_stop(&timer, STATS_READ, length);
+    return length;
+}
+
+static int write_stream(const byte data[], size_t length, FILE *file) {
+    StatsTimer timer;
+    stats_start(&timer);
+    const int written = fwrite(data, sizeof(byte), length, file) == length;
+    stats_stop(&timer, STATS_WRITE, length);
+    return written;
+}
+
+// "-" stands for the standard input
+static FILE *open_input(const char *dir) {
+    return strcmp(dir, "-") == 0 ? stdin : fopen(dir, "rb");
+}
+
+// "-" stands for the standard output
+static FILE *open_output(const char *dir) {
+    return strcmp(dir, "-") == 0 ? stdout : fopen(dir, "wb");
+}
+
+static int close_file(FILE *file) {
+    if (file == stdin) return 0;
+    if (file == stdout) return fflush(stdout);
+    return fclose(file);
+}
+
+static int is_regular_file(const char *dir) {
+    struct stat dir_stat;
+    return strcmp(dir, "-") != 0 && stat(dir, &dir_stat) == 0 && S_ISREG(dir_stat.st_mode);
+}
+
+// The pipeline needs a spare thread for each of reading and writing, and only
+// pays off once there are a few buffers to overlap. The size of other inputs
+// is not known, so they are assumed to be large.
+static int use_pipeline(const char *in_dir, size_t capacity, const CipherOptions *options) {
+    if (get_thread_count(options->threads) < 2) return 0;
+    struct stat in_stat;
+    if (strcmp(in_dir, "-") == 0 || stat(in_dir, &in_stat) || !S_ISREG(in_stat.st_mode)) return 1;
+    return (size_t)in_stat.st_size >= PIPELINE_MIN_BUFFERS * capacity;
+}
+
+static void remove_output(const char *dir) {
+    if (strcmp(dir, "-") != 0) remove(dir);
+}
+
+// Returns the buffer size for streaming, in whole blocks and at least two.
+static size_t get_buffer_capacity(unsigned Nb, const CipherOptions *options) {
+    const size_t block_size = 4 * Nb;
+    const size_t size = (options->buffer_size ? options->buffer_size : DEFAULT_BUFFER_SIZE) / block_size * block_size;
+    return size < 2 * block_size ? 2 * block_size : size;
+}
+
+// Ciphers the length bytes at offset in the data, held in buffer, in place,
+// along with the tag after them, if any.
+typedef FileStatus ChunkCipher(void *context, off_t offset, size_t length, byte buffer[]);
+
+// Returns where the chunk at offset in the data is stored in a file.
+typedef off_t ChunkOffset(void *context, off_t offset);
+
+// The part of the data from start to end, in chunks of chunk_size bytes that
+// worker threads read, cipher and write. The data is at its own offsets in
+// the input, or where in_offset puts each chunk, followed by its tag. In the
+// output, it is at its own offsets less out_start, only from out_start to
+// out_end, or in order in out_file if set; or where out_offset puts each
+// chunk, followed by its tag. The lead bytes before each chunk are read in
+// front of it as well, where the input has them.
+typedef struct ChunkedFile {
+    int in_fd;
+    int out_fd;
+    FILE *out_file;
+    off_t start, end;
+    off_t out_start, out_end;
+    size_t chunk_size;
+    size_t lead;
+    size_t tag_size;
+    ChunkOffset *in_offset;
+    ChunkOffset *out_offset;
+    ChunkCipher *cipher;
+    void *context;
+    byte **buffers;
+    atomic_int status;  // the first failure, as a FileStatus
+} ChunkedFile;
+
+static void fail_chunked_file(ChunkedFile *file, FileStatus status) {
+    int expected = FILE_SUCCESS;
+    atomic_compare_exchange_strong(&file->status, &expected, (int)status);
+}
+
+static void chunked_file_task(void *context, unsigned worker, size_t i) {
+    ChunkedFile *file = (ChunkedFile *)context;
+    if (atomic_load(&file->status) != FILE_SUCCESS) return;
+
+    // the chunk starts after room for the lead, to keep it aligned
+    const size_t room = (file->lead + 31) / 32 * 32;
+    if (!file->buffers[worker]) {
+        file->buffers[worker] = (byte *)alloc_buffer(room + file->chunk_size + file->tag_size);
+    }
+    byte *buffer = file->buffers[worker] + room;
+
+    const off_t offset = file->start + (off_t)i * file->chunk_size;
+    const size_t length = file->end - offset < (off_t)file->chunk_size ? (size_t)(file->end - offset) : file->chunk_size;
+    const size_t lead = offset >= (off_t)file->lead ? file->lead : 0;
+
+    const int read = file->in_offset ? pread_full(file->in_fd, buffer, length + file->tag_size, file->in_offset(file->context, offset))
+                                     : pread_full(file->in_fd, buffer - lead, lead + length, offset - (off_t)lead);
+    if (!read) {
+        fail_chunked_file(file, FILE_READ_ERROR);
+        return;
+    }
+    StatsTimer timer;
+    stats_start(&timer);
+    const FileStatus status = file->cipher(file->context, offset, length, buffer);
+    stats_stop(&timer, STATS_CIPHER, length);
+    if (status != FILE_SUCCESS) {
+        fail_chunked_file(file, status);
+        return;
+    }
+
+    if (file->out_offset) {
+        if (!pwrite_full(file->out_fd, buffer, length + file->tag_size, file->out_offset(file->context, offset))) {
+            fail_chunked_file(file, FILE_WRITE_ERROR);
+        }
+        return;
+    }
+    const off_t from = offset > file->out_start ? offset : file->out_start;
+    const off_t to = offset + (off_t)length < file->out_end ? offset + (off_t)length : file->out_end;
+    const byte *out = buffer + (from - offset);
+    const size_t out_length = (size_t)(to - from);
+    if (file->out_file ? !write_stream(out, out_length, file->out_file)
+                       : !pwrite_full(file->out_fd, out, out_length, from - file->out_start)) {
+        fail_chunked_file(file, FILE_WRITE_ERROR);
+    }
+}
+
+// Runs the chunks on worker threads, or in order on this one when the output
+// is a stream, and returns the first failure.
+static FileStatus cipher_chunked_file(ChunkedFile *file, const CipherOptions *options) {
+    atomic_init(&file->status, FILE_SUCCESS);
+
+    const unsigned threads = file->out_file ? 1 : get_thread_count(options->threads);
+    const size_t chunks = (size_t)((file->end - file->start + (off_t)file->chunk_size - 1) / (off_t)file->chunk_size);
+    file->buffers = (byte **)calloc(threads, sizeof(byte *));
+
+    if (file->out_file) {
+        for (size_t i = 0; i < chunks; ++i) chunked_file_task(file, 0, i);
     } else {
-        inv_cipher_file_interface(Nb, Nk, key, in_dir, out_dir);
+        parallel_for(threads, chunks, chunked_file_task, file);
+    }
+
+    for (unsigned t = 0; t < threads; ++t) free(file->buffers[t]);
+    free(file->buffers);
+    return (FileStatus)atomic_load(&file->status);
+}
+
+typedef struct EcbFileJob {
+    unsigned Nb;
+    unsigned Nr;
+    const KeySchedule *key;
+    int for_encryption;
+} EcbFileJob;
+
+static FileStatus ecb_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    (void)offset;
+    const EcbFileJob *job = (const EcbFileJob *)context;
+    const size_t blocks = length / (4 * job->Nb);
+    if (job->for_encryption) {
+        CipherBlocks(job->Nb, job->Nr, blocks, (word *)buffer, (word *)buffer, job->key);
+    } else {
+        InvCipherBlocks(job->Nb, job->Nr, blocks, (word *)buffer, (word *)buffer, job->key);
+    }
+    return FILE_SUCCESS;
+}
+
+// Every block is independent, so a regular file is split into chunks of whole
+// blocks, one buffer each, which are encrypted by worker threads and written
+// in place; only the rest of the input, padded to a block, is left for the
+// end. Other inputs and outputs, such as pipes, are streamed instead, where
+// only the data left at the end of the input is padded, so the input size
+// need not be known in advance.
+static void cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t block_size = 4 * Nb;
+
+    if (!is_regular_file(in_dir) || strcmp(out_dir, "-") == 0) {
+        BlockStream stream = {Nb, Nr};
+        stream_file_interface(&stream, Nk, key, in_dir, out_dir, ecb_encrypt_transform, options);
+        return;
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+    EcbFileJob job = {Nb, Nr, &key_schedule, 1};
+    ChunkedFile file = {.chunk_size = get_buffer_capacity(Nb, options), .cipher = ecb_file_chunk, .context = &job};
+
+    struct stat in_stat;
+    if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
+        error(": Failed to open input file.", in_dir);
+    }
+    file.end = file.out_end = in_stat.st_size / (off_t)block_size * (off_t)block_size;
+    if ((file.out_fd = open(out_dir, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    FileStatus status = ftruncate(file.out_fd, file.end + (off_t)block_size) ? FILE_WRITE_ERROR : cipher_chunked_file(&file, options);
+
+    const size_t rest = (size_t)(in_stat.st_size - file.end);
+    word block[8];
+    if (status == FILE_SUCCESS && !pread_full(file.in_fd, (byte *)block, rest, file.end)) {
+        status = FILE_READ_ERROR;
+    }
+    if (status == FILE_SUCCESS) {
+        block_bit_padding(Nb, (byte *)block, rest);
+        CipherBlocks(Nb, Nr, 1, block, block, &key_schedule);
+        if (!pwrite_full(file.out_fd, (byte *)block, block_size, file.end)) status = FILE_WRITE_ERROR;
+    }
+    wipe_key_schedule(&key_schedule);
+
+    close(file.in_fd);
+    if (close(file.out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
     }
 }
 
-static void cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir) {
+// As for encryption, a regular file is decrypted in chunks on worker threads;
+// the padding is then read back from the end of the output and cut off.
+static void inv_cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
     unsigned Nr = get_Nr(Nb, Nk);
+    const size_t block_size = 4 * Nb;
+
+    if (!is_regular_file(in_dir) || strcmp(out_dir, "-") == 0) {
+        BlockStream stream = {Nb, Nr};
+        stream_file_interface(&stream, Nk, key, in_dir, out_dir, ecb_decrypt_transform, options);
+        return;
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+    EcbFileJob job = {Nb, Nr, &key_schedule, 0};
+    ChunkedFile file = {.chunk_size = get_buffer_capacity(Nb, options), .cipher = ecb_file_chunk, .context = &job};
+
+    struct stat in_stat;
+    if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
+        error(": Failed to open input file.", in_dir);
+    }
+    file.end = file.out_end = in_stat.st_size;
+    if (file.end == 0 || file.end % block_size) {
+        close(file.in_fd);
+        report_file_status(FILE_FORMAT_ERROR, in_dir, out_dir);
+    }
+    if ((file.out_fd = open(out_dir, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    FileStatus status = cipher_chunked_file(&file, options);
+    wipe_key_schedule(&key_schedule);
+
+    byte last_block[32];
+    if (status == FILE_SUCCESS && !pread_full(file.out_fd, last_block, block_size, file.end - (off_t)block_size)) {
+        status = FILE_READ_ERROR;
+    }
+    if (status == FILE_SUCCESS) {
+        int pos = get_block_padding_position(Nb, last_block);
+        if (pos < 0) {
+            status = FILE_PADDING_ERROR;
+        } else if (ftruncate(file.out_fd, file.end - (off_t)block_size + pos)) {
+            status = FILE_WRITE_ERROR;
+        }
+    }
+
+    close(file.in_fd);
+    if (close(file.out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+static FileStatus ecb_encrypt_transform(void *context, byte data[], size_t *length, int last) {
+    const BlockStream *stream = (const BlockStream *)context;
+    const size_t block_size = 4 * stream->Nb;
+
+    size_t full = *length / block_size * block_size;
+    if (last) {
+        block_bit_padding(stream->Nb, data + full, *length - full);
+        full += block_size;
+    }
+    CipherBlocks(stream->Nb, stream->Nr, full / block_size, (word *)data, (word *)data, &stream->key);
+    *length = full;
+    return FILE_SUCCESS;
+}
+
+// The last buffer is never empty unless the whole input is, so it always holds
+// the padded block.
+static FileStatus ecb_decrypt_transform(void *context, byte data[], size_t *length, int last) {
+    const BlockStream *stream = (const BlockStream *)context;
+    const size_t block_size = 4 * stream->Nb;
+
+    if (*length % block_size || (last && *length == 0)) return FILE_FORMAT_ERROR;
+    InvCipherBlocks(stream->Nb, stream->Nr, *length / block_size, (word *)data, (word *)data, &stream->key);
+    if (last) {
+        int pos = get_block_padding_position(stream->Nb, data + *length - block_size);
+        if (pos < 0) return FILE_PADDING_ERROR;
+        *length -= block_size - pos;
+    }
+    return FILE_SUCCESS;
+}
+
+// Every buffer but the last is whole blocks, so the counter only has to
+// advance by the blocks in each.
+static FileStatus ctr_transform(void *context, byte data[], size_t *length, int last) {
+    (void)last;
+    BlockStream *stream = (BlockStream *)context;
+    ctr_blocks(stream->Nb, stream->Nr, &stream->key, stream->iv, stream->offset, *length, data, data);
+    stream->offset += *length / (4 * stream->Nb);
+    return FILE_SUCCESS;
+}
+
+// As in ECB mode, only the data left at the end is padded. The IV in the
+// stream carries the chain from one buffer to the next.
+static FileStatus cbc_encrypt_transform(void *context, byte data[], size_t *length, int last) {
+    BlockStream *stream = (BlockStream *)context;
+    const size_t block_size = 4 * stream->Nb;
+
+    size_t full = *length / block_size * block_size;
+    if (last) {
+        block_bit_padding(stream->Nb, data + full, *length - full);
+        full += block_size;
+    }
+    cbc_encrypt(stream->Nb, stream->Nr, &stream->key, stream->iv, full, data, data);
+    *length = full;
+    return FILE_SUCCESS;
+}
+
+static FileStatus cbc_decrypt_transform(void *context, byte data[], size_t *length, int last) {
+    BlockStream *stream = (BlockStream *)context;
+    const size_t block_size = 4 * stream->Nb;
+
+    if (*length % block_size || (last && *length == 0)) return FILE_FORMAT_ERROR;
+    cbc_decrypt(stream->Nb, stream->Nr, &stream->key, stream->iv, *length, data, data);
+    if (last) {
+        int pos = get_block_padding_position(stream->Nb, data + *length - block_size);
+        if (pos < 0) return FILE_PADDING_ERROR;
+        *length -= block_size - pos;
+    }
+    return FILE_SUCCESS;
+}
+
+// Streams the input through transform() with the expanded key in the stream,
+// using the read/cipher/write pipeline where it is expected to pay off.
+static void stream_file_interface(BlockStream *stream, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, StreamTransform *transform, const CipherOptions *options) {
+    const size_t capacity = get_buffer_capacity(stream->Nb, options);
 
     FILE *in_file, *out_file;
-    if (!(in_file = fopen(in_dir, "rb"))) {
+    if (!(in_file = open_input(in_dir))) {
         error(": Failed to open input file.", in_dir);
     }
-    fseek(in_file, 0, SEEK_END);
-    long file_size = (ftell(in_file) / (4 * Nb) + 1) * (4 * Nb);
-    rewind(in_file);
-    if (!(out_file = fopen(out_dir, "wb"))) {
-        fclose(in_file);
+    if (!(out_file = open_output(out_dir))) {
+        close_file(in_file);
         error(": Failed to open output file.", out_dir);
     }
 
-    word **key_processed = hex_string_to_expanded_key(Nb, Nr, key, Nk, 1);
+    hex_string_to_key_schedule(stream->Nb, stream->Nr, key, Nk, &stream->key, options);
 
-    {
-        {
-            word *in_buffer = (word *)malloc(Nb * sizeof(word));
-            size_t words_read = 0;
+    FileStatus status = stream_file(in_file, out_file, capacity, transform, stream, use_pipeline(in_dir, capacity, options), options->stats);
+    wipe_key_schedule(&stream->key);
 
-            while (4 * (words_read + Nb) < file_size) {
-                words_read += fread(in_buffer, sizeof(word), Nb, in_file);
-                word *out_buffer = Cipher(Nb, Nr, in_buffer, key_processed);
-                fwrite(out_buffer, sizeof(word), Nb, out_file);
-                free(out_buffer);
-            }
+    close_file(in_file);
+    if (close_file(out_file) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove_output(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+struct HexBatch {
+    unsigned Nb;
+    unsigned Nr;
+    int for_encryption;
+    KeySchedule key;
+    char *digits;  // digits of the current line that are not yet ciphered
+    size_t digit_count;
+    size_t digit_capacity;
+    byte *blocks;
+    char *out;  // output that is not yet written
+    size_t out_length;
+    size_t line_start;  // where the output of the current line starts in out
+    size_t line_digits;
+    unsigned long line;
+    double write_time;
+};
+
+// Ciphers each line of hexadecimal blocks in the input in ECB mode, and
+// prints the results a line each. The key is expanded once, and lines are
+// gathered into large batches for the cipher and for the output.
+void cipher_hex_batch(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, int for_encryption, const CipherOptions *options) {
+    if (options->mode != MODE_ECB) error("Batch mode only supports ECB.", NULL);
+
+    FILE *in_file = open_input(in_dir);
+    if (!in_file) error(": Failed to open input file.", in_dir);
+    const int in_fd = fileno(in_file);
 
-            free(in_buffer);
+    HexBatch *batch = (HexBatch *)alloc_buffer(sizeof(HexBatch));
+    *batch = (HexBatch){Nb, get_Nr(Nb, Nk), for_encryption};
+    batch->digit_capacity = BATCH_BLOCKS * 8 * Nb;
+    batch->digits = (char *)alloc_buffer(batch->digit_capacity);
+    batch->blocks = (byte *)alloc_buffer(BATCH_BLOCKS * 4 * Nb);
+    batch->out = (char *)alloc_buffer(BATCH_OUTPUT_SIZE);
+    batch->line = 1;
+    char *in = (char *)alloc_buffer(BATCH_INPUT_SIZE);
+
+    double start = get_monotonic_time(), read_time = 0;
+    hex_string_to_key_schedule(Nb, batch->Nr, key, Nk, &batch->key, options);
+
+    for (;;) {
+        double read_start = get_monotonic_time();
+        StatsTimer timer;
+        stats_start(&timer);
+        ssize_t n = read(in_fd, in, BATCH_INPUT_SIZE);
+        stats_stop(&timer, STATS_READ, n > 0 ? (uint64_t)n : 0);
+        read_time += get_monotonic_time() - read_start;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            batch_flush(batch);
+            error(": Failed to read input file.", in_dir);
+        }
+        if (n == 0) break;
+
+        const char *p = in, *end = in + n;
+        while (p < end) {
+            const char *newline = (const char *)memchr(p, '\n', (size_t)(end - p));
+            batch_append(batch, p, (size_t)((newline ? newline : end) - p));
+            if (!newline) break;
+            batch_end_line(batch);
+            p = newline + 1;
         }
+        // answer each line as soon as no more input is waiting, so that the
+        // batch mode also serves a caller that waits for every result
+        if ((size_t)n < BATCH_INPUT_SIZE) batch_flush(batch);
+    }
+    // the last line need not end with a newline
+    if (batch->line_digits) batch_end_line(batch);
+    batch_flush(batch);
+
+    if (options->stats) {
+        StreamStats *stats = options->stats;
+        stats->wall_time = get_monotonic_time() - start;
+        stats->read_time = read_time;
+        stats->write_time = batch->write_time;
+        stats->cipher_time = stats->wall_time - read_time - batch->write_time;
+        stats->pipelined = 0;
+    }
 
-        {
-            byte *in_buffer = (byte *)malloc(4 * Nb * sizeof(byte));
-            size_t bytes_read = fread(in_buffer, sizeof(byte), 4 * Nb, in_file);
+    close_file(in_file);
+    free(in);
+    free(batch->out);
+    free(batch->blocks);
+    free(batch->digits);
+    wipe_key_schedule(&batch->key);
+    free(batch);
+}
+
+// Adds str[0, length), which holds no newline, to the current line.
+static void batch_append(HexBatch *batch, const char *str, size_t length) {
+    while (length) {
+        size_t take = batch->digit_capacity - batch->digit_count;
+        if (take > length) take = length;
+        size_t n = hex_strip(str, take, batch->digits + batch->digit_count);
+        if (n == (size_t)-1) batch_error(batch, ": Input contains invalid hexadecimal digit.");
+        batch->digit_count += n;
+        batch->line_digits += n;
+        if (batch->digit_count == batch->digit_capacity) batch_cipher(batch);
+        str += take;
+        length -= take;
+    }
+}
+
+static void batch_end_line(HexBatch *batch) {
+    if (batch->digit_count % (8 * batch->Nb)) batch_error(batch, ": Incorrect input length.");
+    batch_cipher(batch);
+    if (batch->out_length == BATCH_OUTPUT_SIZE) batch_flush(batch);
+    batch->out[batch->out_length++] = '\n';
+    batch->line_start = batch->out_length;
+    batch->line_digits = 0;
+    ++batch->line;
+}
+
+// Ciphers the whole blocks among the pending digits and appends them to the
+// output. The digits of a partial block are kept.
+static void batch_cipher(HexBatch *batch) {
+    const size_t block_digits = 8 * batch->Nb;
+    const size_t n = batch->digit_count / block_digits;
+    if (n == 0) return;
+
+    hex_decode(batch->digits, n * 4 * batch->Nb, batch->blocks);
+    StatsTimer timer;
+    stats_start(&timer);
+    if (batch->for_encryption) {
+        CipherBlocks(batch->Nb, batch->Nr, n, (word *)batch->blocks, (word *)batch->blocks, &batch->key);
+    } else {
+        InvCipherBlocks(batch->Nb, batch->Nr, n, (word *)batch->blocks, (word *)batch->blocks, &batch->key);
+    }
+    stats_stop(&timer, STATS_CIPHER, n * 4 * batch->Nb);
+    if (batch->out_length + n * block_digits > BATCH_OUTPUT_SIZE) batch_flush(batch);
+    hex_encode(batch->blocks, n * 4 * batch->Nb, batch->out + batch->out_length);
+    batch->out_length += n * block_digits;
+
+    batch->digit_count -= n * block_digits;
+    memmove(batch->digits, batch->digits + n * block_digits, batch->digit_count);
+}
+
+static void batch_flush(HexBatch *batch) {
+    double start = get_monotonic_time();
+    StatsTimer timer;
+    stats_start(&timer);
+    if (fwrite(batch->out, 1, batch->out_length, stdout) != batch->out_length || fflush(stdout)) {
+        error(": Failed to write output file.", "-");
+    }
+    stats_stop(&timer, STATS_WRITE, batch->out_length);
+    batch->out_length = 0;
+    batch->line_start = 0;
+    batch->write_time += get_monotonic_time() - start;
+}
 
-            block_bit_padding(Nb, in_buffer, bytes_read);
+// Writes out the results of the lines before the failing one, then exits.
+static void batch_error(HexBatch *batch, const char *msg) {
+    char line[32];
+    snprintf(line, sizeof(line), "Line %lu", batch->line);
+    batch->out_length = batch->line_start;
+    batch_flush(batch);
+    error(msg, line);
+}
+
+typedef struct CtrFileJob {
+    unsigned Nb;
+    unsigned Nr;
+    const KeySchedule *key;
+    byte iv[32];
+} CtrFileJob;
+
+static FileStatus ctr_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    const CtrFileJob *job = (const CtrFileJob *)context;
+    ctr_blocks(job->Nb, job->Nr, job->key, job->iv, offset / (4 * job->Nb), length, buffer, buffer);
+    return FILE_SUCCESS;
+}
+
+// Splits a regular file into chunks of one buffer each, which are processed by
+// worker threads at their own counter offsets and written in place. Other
+// inputs and outputs, such as pipes, are streamed on one thread instead.
+static void ctr_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+
+    CtrFileJob job = {Nb, Nr};
+    hex_string_to_iv(Nb, options->iv, job.iv);
+
+    if (!is_regular_file(in_dir) || strcmp(out_dir, "-") == 0) {
+        BlockStream stream = {Nb, Nr};
+        memcpy(stream.iv, job.iv, sizeof(stream.iv));
+        stream_file_interface(&stream, Nk, key, in_dir, out_dir, ctr_transform, options);
+        return;
+    }
+
+    ChunkedFile file = {.chunk_size = get_buffer_capacity(Nb, options), .cipher = ctr_file_chunk, .context = &job};
+    struct stat in_stat;
+    if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
+        error(": Failed to open input file.", in_dir);
+    }
+    file.end = file.out_end = in_stat.st_size;
+    if ((file.out_fd = open(out_dir, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
+        error(": Failed to open output file.", out_dir);
+    }
 
-            word *out_buffer = Cipher(Nb, Nr, (word *)in_buffer, key_processed);
-            fwrite(out_buffer, sizeof(word), Nb, out_file);
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+    job.key = &key_schedule;
 
-            free(in_buffer);
-            free(out_buffer);
+    FileStatus status = ftruncate(file.out_fd, file.end) ? FILE_WRITE_ERROR : cipher_chunked_file(&file, options);
+    wipe_key_schedule(&key_schedule);
+
+    close(file.in_fd);
+    if (close(file.out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+// Encryption chains every block to the one before, so it is streamed on one
+// thread, with reading and writing pipelined around it.
+static void cbc_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    BlockStream stream = {Nb, get_Nr(Nb, Nk)};
+    hex_string_to_iv(Nb, options->iv, stream.iv);
+    stream_file_interface(&stream, Nk, key, in_dir, out_dir, cbc_encrypt_transform, options);
+}
+
+typedef struct CbcFileJob {
+    unsigned Nb;
+    unsigned Nr;
+    const KeySchedule *key;
+    byte iv[32];
+} CbcFileJob;
+
+// Each chunk is read along with the ciphertext block before it, which is the
+// IV for its first block.
+static FileStatus cbc_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    const CbcFileJob *job = (const CbcFileJob *)context;
+    const size_t block_size = 4 * job->Nb;
+    byte *iv = buffer - block_size;
+    if (offset == 0) memcpy(iv, job->iv, block_size);
+    cbc_decrypt(job->Nb, job->Nr, job->key, iv, length, buffer, buffer);
+    return FILE_SUCCESS;
+}
+
+// Splits a regular file into chunks of one buffer each, which are decrypted
+// by worker threads and written in place; the padding is then read back from
+// the end of the output and cut off. Other inputs and outputs, such as pipes,
+// are streamed on one thread instead.
+static void inv_cbc_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t block_size = 4 * Nb;
+
+    CbcFileJob job = {Nb, Nr};
+    hex_string_to_iv(Nb, options->iv, job.iv);
+
+    if (!is_regular_file(in_dir) || strcmp(out_dir, "-") == 0) {
+        BlockStream stream = {Nb, Nr};
+        memcpy(stream.iv, job.iv, sizeof(stream.iv));
+        stream_file_interface(&stream, Nk, key, in_dir, out_dir, cbc_decrypt_transform, options);
+        return;
+    }
+
+    ChunkedFile file = {.chunk_size = get_buffer_capacity(Nb, options), .lead = block_size, .cipher = cbc_file_chunk, .context = &job};
+    struct stat in_stat;
+    if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
+        error(": Failed to open input file.", in_dir);
+    }
+    file.end = file.out_end = in_stat.st_size;
+    if (file.end == 0 || file.end % block_size) {
+        close(file.in_fd);
+        report_file_status(FILE_FORMAT_ERROR, in_dir, out_dir);
+    }
+    if ((file.out_fd = open(out_dir, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+    job.key = &key_schedule;
+
+    FileStatus status = cipher_chunked_file(&file, options);
+    wipe_key_schedule(&key_schedule);
+    byte last_block[32];
+    if (status == FILE_SUCCESS && !pread_full(file.out_fd, last_block, block_size, file.end - (off_t)block_size)) {
+        status = FILE_READ_ERROR;
+    }
+    if (status == FILE_SUCCESS) {
+        int pos = get_block_padding_position(Nb, last_block);
+        if (pos < 0) {
+            status = FILE_PADDING_ERROR;
+        } else if (ftruncate(file.out_fd, file.end - (off_t)block_size + pos)) {
+            status = FILE_WRITE_ERROR;
         }
     }
 
-    for (unsigned i = 0; i <= Nr; ++i) free(key_processed[i]);
-    free(key_processed);
+    close(file.in_fd);
+    if (close(file.out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
 
-    fclose(in_file);
-    fclose(out_file);
+typedef struct XtsFileJob {
+    unsigned Nr;
+    const XtsKey *key;
+    int for_encryption;
+    size_t unit_size;
+    uint64_t unit;  // the next data unit of a stream
+} XtsFileJob;
+
+static FileStatus xts_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    const XtsFileJob *job = (const XtsFileJob *)context;
+    xts_units(job->Nr, job->key, (uint64_t)offset / job->unit_size, job->unit_size, length, buffer, buffer, job->for_encryption);
+    return FILE_SUCCESS;
 }
 
-static void inv_cipher_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir) {
+// Every buffer but the last is a whole number of data units, so only the last
+// can end in a short unit.
+static FileStatus xts_transform(void *context, byte data[], size_t *length, int last) {
+    XtsFileJob *job = (XtsFileJob *)context;
+    if (last && !xts_length_valid(job->unit * job->unit_size + *length, job->unit_size)) return FILE_FORMAT_ERROR;
+    xts_units(job->Nr, job->key, job->unit, job->unit_size, *length, data, data, job->for_encryption);
+    job->unit += *length / job->unit_size;
+    return FILE_SUCCESS;
+}
+
+// Numbers the data units of the file from 0, so that any of them can be
+// deciphered on its own. Regular files are split into chunks of whole units,
+// which are processed by worker threads and written in place; with a range,
+// only the units covering it are read, and only the range is written. Other
+// inputs, such as pipes, are streamed on one thread instead.
+static void xts_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options) {
     unsigned Nr = get_Nr(Nb, Nk);
 
-    FILE *in_file, *out_file;
-    if (!(in_file = fopen(in_dir, "rb"))) {
+    XtsKey xts_key;
+    XtsFileJob job = {Nr, &xts_key, for_encryption, options->unit_size ? options->unit_size : DEFAULT_UNIT_SIZE};
+    // a whole number of data units
+    const size_t capacity = get_buffer_capacity(Nb, options);
+    const size_t chunk_size = capacity < job.unit_size ? job.unit_size : capacity / job.unit_size * job.unit_size;
+
+    if (!is_regular_file(in_dir)) {
+        if (options->range) error(": A range needs a regular input file.", in_dir);
+        FILE *in_file, *out_file;
+        if (!(in_file = open_input(in_dir))) {
+            error(": Failed to open input file.", in_dir);
+        }
+        if (!(out_file = open_output(out_dir))) {
+            close_file(in_file);
+            error(": Failed to open output file.", out_dir);
+        }
+        hex_string_to_xts_key(Nb, Nr, key, Nk, &xts_key, options);
+
+        FileStatus status = stream_file(in_file, out_file, chunk_size, xts_transform, &job, use_pipeline(in_dir, chunk_size, options), options->stats);
+        wipe_key_schedule(&xts_key.data);
+        wipe_key_schedule(&xts_key.tweak);
+
+        close_file(in_file);
+        if (close_file(out_file) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+        if (status != FILE_SUCCESS) {
+            remove_output(out_dir);
+            report_file_status(status, in_dir, out_dir);
+        }
+        return;
+    }
+
+    ChunkedFile file = {.chunk_size = chunk_size, .cipher = xts_file_chunk, .context = &job};
+    struct stat in_stat;
+    if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
         error(": Failed to open input file.", in_dir);
     }
-    fseek(in_file, 0, SEEK_END);
-    long file_size = ftell(in_file);
-    rewind(in_file);
-    if (file_size == 0 || file_size % (4 * Nb)) {
-        fclose(in_file);
-        error(": Incorrect input file. Is it empty or modified?", in_dir);
+    if (!xts_length_valid((uint64_t)in_stat.st_size, job.unit_size)) {
+        close(file.in_fd);
+        error(": Incorrect input file. Every data unit must be at least 16 bytes long.", in_dir);
+    }
+    file.end = file.out_end = in_stat.st_size;
+    if (options->range) {
+        // only the data units covering the range are read
+        const ByteRange *range = options->range;
+        if (range->length == 0 || range->offset > (uint64_t)in_stat.st_size || range->length > (uint64_t)in_stat.st_size - range->offset) {
+            close(file.in_fd);
+            error(": The range is outside the input file.", in_dir);
+        }
+        file.out_start = (off_t)range->offset;
+        file.out_end = (off_t)(range->offset + range->length);
+        file.start = file.out_start / job.unit_size * job.unit_size;
+        const uint64_t end = (range->offset + range->length + job.unit_size - 1) / job.unit_size * job.unit_size;
+        if (end < (uint64_t)file.end) file.end = (off_t)end;
     }
-    if (!(out_file = fopen(out_dir, "wb"))) {
-        fclose(in_file);
+
+    if (strcmp(out_dir, "-") == 0) {
+        file.out_file = stdout;
+        file.out_fd = -1;
+    } else if ((file.out_fd = open(out_dir, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
         error(": Failed to open output file.", out_dir);
+    } else if (ftruncate(file.out_fd, file.out_end - file.out_start)) {
+        close(file.in_fd);
+        close(file.out_fd);
+        remove(out_dir);
+        error(": Failed to resize output file.", out_dir);
     }
 
-    word **key_processed = hex_string_to_expanded_key(Nb, Nr, key, Nk, 0);
+    hex_string_to_xts_key(Nb, Nr, key, Nk, &xts_key, options);
+    FileStatus status = cipher_chunked_file(&file, options);
+    wipe_key_schedule(&xts_key.data);
+    wipe_key_schedule(&xts_key.tweak);
 
-    {
-        {
-            word *in_buffer = (word *)malloc(Nb * sizeof(word));
-            size_t words_read = 0;
+    close(file.in_fd);
+    if ((file.out_file ? fflush(stdout) : close(file.out_fd)) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        if (!file.out_file) remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
 
-            while (4 * (words_read + Nb) < file_size) {
-                words_read += fread(in_buffer, sizeof(word), Nb, in_file);
-                word *out_buffer = InvCipher(Nb, Nr, in_buffer, key_processed);
-                fwrite(out_buffer, sizeof(word), Nb, out_file);
-                free(out_buffer);
-            }
+typedef struct ContainerFileJob {
+    unsigned Nr;
+    const KeySchedule *key;
+    ContainerHeader header;
+} ContainerFileJob;
+
+// Returns where the chunk at offset in the plaintext is stored in the
+// container, its tag following it.
+static off_t container_file_offset(void *context, off_t offset) {
+    const ContainerFileJob *job = (const ContainerFileJob *)context;
+    return (off_t)container_chunk_offset(&job->header, (uint64_t)offset / job->header.chunk_size);
+}
+
+static FileStatus container_seal_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    const ContainerFileJob *job = (const ContainerFileJob *)context;
+    container_seal_chunk(job->Nr, job->key, &job->header, (uint64_t)offset / job->header.chunk_size, length, buffer, buffer, buffer + length);
+    return FILE_SUCCESS;
+}
+
+// Each chunk is only written once its tag has been verified, so no
+// unauthenticated plaintext is ever output, though a failure part way leaves
+// the chunks before it on the standard output.
+static FileStatus container_open_file_chunk(void *context, off_t offset, size_t length, byte buffer[]) {
+    const ContainerFileJob *job = (const ContainerFileJob *)context;
+    const uint64_t chunk = (uint64_t)offset / job->header.chunk_size;
+    if (!container_open_chunk(job->Nr, job->key, &job->header, chunk, length, buffer, buffer, buffer + length)) {
+        return FILE_AUTHENTICATION_ERROR;
+    }
+    return FILE_SUCCESS;
+}
+
+// Writes a container (see container.c) of chunks sealed with a new random
+// nonce. A regular file going to a regular file is split across worker
+// threads, each sealing whole chunks in place; other inputs and outputs are
+// sealed a chunk at a time as they are read.
+static void container_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    if (Nb != 4) error("Container mode requires 128-bit blocks.", NULL);
+    ContainerFileJob job = {get_Nr(Nb, Nk)};
+    job.header.chunk_size = (uint32_t)(options->unit_size ? options->unit_size : DEFAULT_CHUNK_SIZE);
+    if (!random_bytes(job.header.nonce, sizeof(job.header.nonce))) error("Failed to generate a nonce.", NULL);
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, job.Nr, key, Nk, &key_schedule, options);
+    job.key = &key_schedule;
+
+    byte header[CONTAINER_HEADER_SIZE];
+    container_encode_header(&job.header, header);
+    FileStatus status = FILE_SUCCESS;
+    uint64_t length = 0;  // of the plaintext
+
+    if (is_regular_file(in_dir) && strcmp(out_dir, "-") != 0) {
+        ChunkedFile file = {
+            .chunk_size = job.header.chunk_size,
+            .tag_size = CONTAINER_TAG_SIZE,
+            .out_offset = container_file_offset,
+            .cipher = container_seal_file_chunk,
+            .context = &job,
+        };
+        struct stat in_stat;
+        if ((file.in_fd = open(in_dir, O_RDONLY)) < 0 || fstat(file.in_fd, &in_stat)) {
+            error(": Failed to open input file.", in_dir);
+        }
+        file.end = in_stat.st_size;
+        length = (uint64_t)in_stat.st_size;
+        if ((file.out_fd = open(out_dir, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            close(file.in_fd);
+            error(": Failed to open output file.", out_dir);
+        }
+
+        status = cipher_chunked_file(&file, options);
 
-            free(in_buffer);
+        const uint64_t chunks = container_chunk_count(&job.header, length);
+        const size_t index_size = container_index_size(chunks);
+        byte *index = (byte *)malloc(index_size);
+        container_seal_index(job.Nr, job.key, &job.header, length, index);
+        if (status == FILE_SUCCESS &&
+            (!pwrite_full(file.out_fd, header, CONTAINER_HEADER_SIZE, 0) ||
+             !pwrite_full(file.out_fd, index, index_size, (off_t)(CONTAINER_HEADER_SIZE + length + chunks * CONTAINER_TAG_SIZE)))) {
+            status = FILE_WRITE_ERROR;
         }
+        free(index);
 
-        {
-            word *in_buffer = (word *)malloc(Nb * sizeof(word));
-            size_t words_read = fread(in_buffer, sizeof(word), Nb, in_file);
-            word *out_buffer = InvCipher(Nb, Nr, in_buffer, key_processed);
+        close(file.in_fd);
+        if (close(file.out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    } else {
+        FILE *in_file, *out_file;
+        if (!(in_file = open_input(in_dir))) {
+            error(": Failed to open input file.", in_dir);
+        }
+        if (!(out_file = open_output(out_dir))) {
+            close_file(in_file);
+            error(": Failed to open output file.", out_dir);
+        }
+
+        byte *buffer = (byte *)alloc_buffer(job.header.chunk_size + CONTAINER_TAG_SIZE);
+        if (fwrite(header, sizeof(byte), CONTAINER_HEADER_SIZE, out_file) != CONTAINER_HEADER_SIZE) status = FILE_WRITE_ERROR;
+        size_t bytes_read;
+        for (uint64_t chunk = 0; status == FILE_SUCCESS && (bytes_read = read_stream(buffer, job.header.chunk_size, in_file)) > 0; ++chunk) {
+            StatsTimer timer;
+            stats_start(&timer);
+            container_seal_chunk(job.Nr, job.key, &job.header, chunk, bytes_read, buffer, buffer, buffer + bytes_read);
+            stats_stop(&timer, STATS_CIPHER, bytes_read);
+            if (!write_stream(buffer, bytes_read + CONTAINER_TAG_SIZE, out_file)) status = FILE_WRITE_ERROR;
+            length += bytes_read;
+        }
+        if (status == FILE_SUCCESS && ferror(in_file)) status = FILE_READ_ERROR;
+        free(buffer);
+
+        if (status == FILE_SUCCESS) {
+            const size_t index_size = container_index_size(container_chunk_count(&job.header, length));
+            byte *index = (byte *)malloc(index_size);
+            container_seal_index(job.Nr, job.key, &job.header, length, index);
+            if (fwrite(index, sizeof(byte), index_size, out_file) != index_size) status = FILE_WRITE_ERROR;
+            free(index);
+        }
+
+        close_file(in_file);
+        if (close_file(out_file) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    }
+    wipe_key_schedule(&key_schedule);
+
+    if (status != FILE_SUCCESS) {
+        remove_output(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+// Copies a stream into an anonymous temporary file, as decrypting a container
+// starts from the index at its end. Returns NULL on failure.
+static FILE *spool_input(FILE *in_file) {
+    FILE *temp_file = tmpfile();
+    if (!temp_file) return NULL;
+    byte *buffer = (byte *)alloc_buffer(DEFAULT_BUFFER_SIZE);
+    size_t bytes_read;
+    int failed = 0;
+    while (!failed && (bytes_read = fread(buffer, sizeof(byte), DEFAULT_BUFFER_SIZE, in_file)) > 0) {
+        failed = fwrite(buffer, sizeof(byte), bytes_read, temp_file) != bytes_read;
+    }
+    free(buffer);
+    if (failed || ferror(in_file) || fflush(temp_file)) {
+        fclose(temp_file);
+        return NULL;
+    }
+    return temp_file;
+}
+
+// Checks the index, then decrypts the chunks covering the range, or all of
+// them, on worker threads, writing each in place once it is verified.
+static void inv_container_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    if (Nb != 4) error("Container mode requires 128-bit blocks.", NULL);
+    ContainerFileJob job = {get_Nr(Nb, Nk)};
+    ChunkedFile file = {
+        .tag_size = CONTAINER_TAG_SIZE,
+        .in_offset = container_file_offset,
+        .cipher = container_open_file_chunk,
+        .context = &job,
+    };
+
+    if (is_regular_file(in_dir)) {
+        file.in_fd = open(in_dir, O_RDONLY);
+    } else {
+        FILE *in_file = open_input(in_dir);
+        if (!in_file) error(": Failed to open input file.", in_dir);
+        FILE *spooled = spool_input(in_file);
+        close_file(in_file);
+        if (!spooled) error(": Failed to read input file.", in_dir);
+        // the temporary file lives on as long as a descriptor refers to it
+        file.in_fd = dup(fileno(spooled));
+        fclose(spooled);
+    }
+    struct stat in_stat;
+    if (file.in_fd < 0 || fstat(file.in_fd, &in_stat)) {
+        error(": Failed to open input file.", in_dir);
+    }
+    const uint64_t in_size = (uint64_t)in_stat.st_size;
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, job.Nr, key, Nk, &key_schedule, options);
+    job.key = &key_schedule;
+
+    // the trailer gives the number of chunks, and so the size of the index
+    byte header[CONTAINER_HEADER_SIZE], trailer[CONTAINER_TRAILER_SIZE];
+    FileStatus status = FILE_SUCCESS;
+    uint64_t chunks = 0, length = 0;
+    if (in_size < CONTAINER_HEADER_SIZE + CONTAINER_TRAILER_SIZE) {
+        status = FILE_FORMAT_ERROR;
+    } else if (!pread_full(file.in_fd, header, CONTAINER_HEADER_SIZE, 0) ||
+               !pread_full(file.in_fd, trailer, CONTAINER_TRAILER_SIZE, (off_t)(in_size - CONTAINER_TRAILER_SIZE))) {
+        status = FILE_READ_ERROR;
+    } else if (!container_decode_header(header, &job.header) ||
+               (chunks = container_load64(trailer + 8)) > (in_size - CONTAINER_HEADER_SIZE - CONTAINER_TRAILER_SIZE) / (8 + CONTAINER_TAG_SIZE)) {
+        status = FILE_FORMAT_ERROR;
+    } else {
+        const size_t index_size = container_index_size(chunks);
+        byte *index = (byte *)malloc(index_size);
+        if (!pread_full(file.in_fd, index, index_size, (off_t)(in_size - index_size))) {
+            status = FILE_READ_ERROR;
+        } else if (!container_open_index(job.Nr, job.key, &job.header, index, index_size, in_size, &length)) {
+            status = FILE_AUTHENTICATION_ERROR;
+        }
+        free(index);
+    }
+    if (status != FILE_SUCCESS) {
+        wipe_key_schedule(&key_schedule);
+        close(file.in_fd);
+        report_file_status(status, in_dir, out_dir);
+    }
+
+    // only the chunks covering the range are read
+    file.chunk_size = job.header.chunk_size;
+    file.end = file.out_end = (off_t)length;
+    if (options->range) {
+        const ByteRange *range = options->range;
+        if (range->length == 0 || range->offset > length || range->length > length - range->offset) {
+            close(file.in_fd);
+            error(": The range is outside the decrypted data.", in_dir);
+        }
+        file.out_start = (off_t)range->offset;
+        file.out_end = (off_t)(range->offset + range->length);
+        file.start = file.out_start / (off_t)file.chunk_size * (off_t)file.chunk_size;
+        const off_t end = (file.out_end - 1) / (off_t)file.chunk_size * (off_t)file.chunk_size + (off_t)file.chunk_size;
+        if (end < file.end) file.end = end;
+    }
+
+    if (strcmp(out_dir, "-") == 0) {
+        file.out_file = stdout;
+        file.out_fd = -1;
+    } else if ((file.out_fd = open(out_dir, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(file.in_fd);
+        error(": Failed to open output file.", out_dir);
+    } else if (ftruncate(file.out_fd, file.out_end - file.out_start)) {
+        status = FILE_WRITE_ERROR;
+    }
+
+    if (status == FILE_SUCCESS) status = cipher_chunked_file(&file, options);
+    wipe_key_schedule(&key_schedule);
+
+    close(file.in_fd);
+    if ((file.out_file ? fflush(stdout) : close(file.out_fd)) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove_output(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+typedef struct MappedFileJob {
+    unsigned Nb;
+    unsigned Nr;
+    const KeySchedule *key;
+    OperationMode mode;
+    int for_encryption;
+    byte iv[32];
+    const byte *in;
+    byte *out;
+    size_t length;
+    size_t chunk_size;
+} MappedFileJob;
+
+static void mapped_file_task(void *context, unsigned worker, size_t i) {
+    (void)worker;
+    const MappedFileJob *job = (const MappedFileJob *)context;
+    const size_t block_size = 4 * job->Nb;
+
+    const size_t offset = i * job->chunk_size;
+    const size_t length = job->length - offset < job->chunk_size ? job->length - offset : job->chunk_size;
+    const byte *in = job->in + offset;
+    byte *out = job->out + offset;
+
+    // the mapped pages are read and written as they are touched, so that
+    // time counts as ciphering
+    StatsTimer timer;
+    stats_start(&timer);
+    if (job->mode == MODE_CTR) {
+        ctr_blocks(job->Nb, job->Nr, job->key, job->iv, offset / block_size, length, in, out);
+    } else if (job->for_encryption) {
+        CipherBlocks(job->Nb, job->Nr, length / block_size, (const word *)in, (word *)out, job->key);
+    } else {
+        InvCipherBlocks(job->Nb, job->Nr, length / block_size, (const word *)in, (word *)out, job->key);
+    }
+    stats_stop(&timer, STATS_CIPHER, length);
+}
+
+// Maps both files into memory and runs the engine directly over the mapped
+// pages, split into chunks across threads. The output is sized up front: one
+// padding block more than the whole blocks of the input for ECB encryption,
+// and trimmed after removing the padding for ECB decryption.
+static void mapped_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t block_size = 4 * Nb;
+
+    MappedFileJob job = {Nb, Nr, NULL, options->mode, for_encryption};
+    if (options->mode == MODE_CTR) hex_string_to_iv(Nb, options->iv, job.iv);
+    job.chunk_size = get_buffer_capacity(Nb, options);
+
+    int in_fd, out_fd;
+    struct stat in_stat;
+    if ((in_fd = open(in_dir, O_RDONLY)) < 0) {
+        error(": Failed to open input file.", in_dir);
+    }
+    if (fstat(in_fd, &in_stat)) {
+        close(in_fd);
+        error(": Failed to read input file.", in_dir);
+    }
+    const size_t in_size = (size_t)in_stat.st_size;
+    if (options->mode == MODE_ECB && !for_encryption && (in_size == 0 || in_size % block_size)) {
+        close(in_fd);
+        error(": Incorrect input file. Is it empty or modified?", in_dir);
+    }
+
+    size_t out_size = in_size;
+    job.length = in_size;
+    if (options->mode == MODE_ECB && for_encryption) {
+        out_size = (in_size / block_size + 1) * block_size;
+        job.length = in_size / block_size * block_size;
+    }
+
+    if ((out_fd = open(out_dir, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(in_fd);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    byte *in = NULL, *out = NULL;
+    const size_t mapped_out_size = out_size;
+    FileStatus status = FILE_SUCCESS;
+    if (in_size && (in = (byte *)mmap(NULL, in_size, PROT_READ, MAP_SHARED, in_fd, 0)) == MAP_FAILED) {
+        in = NULL;
+        status = FILE_READ_ERROR;
+    } else if (ftruncate(out_fd, (off_t)out_size) ||
+               (out_size && (out = (byte *)mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0)) == MAP_FAILED)) {
+        out = NULL;
+        status = FILE_WRITE_ERROR;
+    }
+
+    if (status == FILE_SUCCESS) {
+        if (in) posix_madvise(in, in_size, POSIX_MADV_SEQUENTIAL);
+        if (out) posix_madvise(out, out_size, POSIX_MADV_SEQUENTIAL);
 
-            int pos = get_block_padding_position(Nb, (byte *)out_buffer);
+        KeySchedule key_schedule;
+        hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+        job.key = &key_schedule;
+        job.in = in;
+        job.out = out;
+
+        parallel_for(options->threads, (job.length + job.chunk_size - 1) / job.chunk_size, mapped_file_task, &job);
+
+        if (options->mode == MODE_ECB && for_encryption) {
+            word block[8];
+            if (in) memcpy(block, in + job.length, in_size - job.length);
+            block_bit_padding(Nb, (byte *)block, in_size - job.length);
+            CipherBlocks(Nb, Nr, 1, block, block, job.key);
+            memcpy(out + job.length, block, block_size);
+        } else if (options->mode == MODE_ECB) {
+            int pos = get_block_padding_position(Nb, out + out_size - block_size);
             if (pos < 0) {
-                free(in_buffer);
-                free(out_buffer);
-                for (unsigned i = 0; i <= Nr; ++i) free(key_processed[i]);
-                free(key_processed);
-                fclose(in_file);
-                fclose(out_file);
-                remove(out_dir);
-                error(": Could not correctly interpret input.", in_dir);
+                status = FILE_PADDING_ERROR;
+            } else {
+                out_size -= block_size - pos;
             }
+        }
+        wipe_key_schedule(&key_schedule);
+    }
+
+    if (in) munmap(in, in_size);
+    if (out) munmap(out, mapped_out_size);
+    if (status == FILE_SUCCESS && ftruncate(out_fd, (off_t)out_size)) status = FILE_WRITE_ERROR;
+
+    close(in_fd);
+    if (close(out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+typedef struct TreeJob {
+    BlockStream stream;  // shared, and read only once the key is expanded
+    int for_encryption;
+    size_t chunk_size;
+    byte **buffers;  // one for each worker, allocated when first needed
+    atomic_size_t failures;
+} TreeJob;
+
+typedef struct TreeChunk {
+    TreeFile *file;
+    size_t index;
+} TreeChunk;
+
+struct TreeFile {
+    TreeJob *job;
+    const FileEntry *entry;
+    int in_fd;
+    int out_fd;
+    off_t in_size;
+    off_t out_size;
+    size_t chunks;
+    atomic_size_t remaining;
+    atomic_int status;
+    TreeChunk *chunk_tasks;
+};
 
-            fwrite(out_buffer, sizeof(byte), pos, out_file);
+// Ciphers every file listed for in (see list_files()) into out_dir in ECB
+// mode. Each file is a task in a work-stealing pool, and files of more than
+// one buffer are split into a task per buffer, so that a large file is
+// shared out among idle workers. The key is expanded once for all of them.
+void cipher_tree(unsigned Nb, unsigned Nk, const char *key, const char *in, const char *out_dir, int for_encryption, const CipherOptions *options) {
+    // the same IV for every file would be unsafe in CTR and GCM mode
+    if (options->mode != MODE_ECB) error("Directory mode only supports ECB.", NULL);
+
+    FileList list;
+    list_files(in, out_dir, &list);
+
+    TreeJob *job = (TreeJob *)alloc_buffer(sizeof(TreeJob));
+    *job = (TreeJob){{Nb, get_Nr(Nb, Nk)}, for_encryption};
+    hex_string_to_key_schedule(Nb, job->stream.Nr, key, Nk, &job->stream.key, options);
+    job->chunk_size = get_buffer_capacity(Nb, options);
+    atomic_init(&job->failures, 0);
+
+    WorkPool *pool = work_pool_new(options->threads);
+    const unsigned threads = work_pool_threads(pool);
+    job->buffers = (byte **)calloc(threads, sizeof(byte *));
+    TreeFile *files = (TreeFile *)calloc(list.count ? list.count : 1, sizeof(TreeFile));
+    for (size_t i = 0; i < list.count; ++i) {
+        files[i].job = job;
+        files[i].entry = &list.entries[i];
+        work_pool_push(pool, (unsigned)(i % threads), tree_file_task, &files[i]);
+    }
+    work_pool_run(pool);
+    work_pool_free(pool);
+
+    const size_t failures = atomic_load(&job->failures);
+    for (unsigned t = 0; t < threads; ++t) {
+        free(job->buffers[t]);
+    }
+    free(job->buffers);
+    free(files);
+    free_file_list(&list);
+    wipe_key_schedule(&job->stream.key);
+    free(job);
+
+    if (failures) {
+        char count[32];
+        snprintf(count, sizeof(count), "%zu", failures);
+        error(failures == 1 ? " file could not be processed." : " files could not be processed.", count);
+    }
+}
+
+// Opens the file and ciphers it, or splits it into chunks for other workers
+// to take some of.
+static void tree_file_task(WorkPool *pool, unsigned worker, void *context) {
+    TreeFile *file = (TreeFile *)context;
+    const TreeJob *job = file->job;
+    const size_t block_size = 4 * job->stream.Nb;
+    atomic_init(&file->status, FILE_SUCCESS);
+
+    struct stat in_stat, out_stat;
+    if ((file->in_fd = open(file->entry->in_path, O_RDONLY)) < 0 || fstat(file->in_fd, &in_stat)) {
+        if (file->in_fd >= 0) close(file->in_fd);
+        print_error(": Failed to open input file.", file->entry->in_path);
+        atomic_fetch_add(&file->job->failures, 1);
+        return;
+    }
+    if ((file->out_fd = open(file->entry->out_path, O_WRONLY | O_CREAT, 0666)) < 0 || fstat(file->out_fd, &out_stat)) {
+        if (file->out_fd >= 0) close(file->out_fd);
+        close(file->in_fd);
+        print_error(": Failed to open output file.", file->entry->out_path);
+        atomic_fetch_add(&file->job->failures, 1);
+        return;
+    }
+    // truncating the output must not destroy the input
+    if (in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+        close(file->in_fd);
+        close(file->out_fd);
+        print_error(": The input and output files are the same.", file->entry->in_path);
+        atomic_fetch_add(&file->job->failures, 1);
+        return;
+    }
 
-            free(in_buffer);
-            free(out_buffer);
+    file->in_size = in_stat.st_size;
+    if (job->for_encryption) {
+        // the last chunk is the data after the last whole buffer, padded
+        file->out_size = (file->in_size / block_size + 1) * block_size;
+        file->chunks = (size_t)file->in_size / job->chunk_size + 1;
+    } else {
+        file->out_size = file->in_size;
+        file->chunks = ((size_t)file->in_size + job->chunk_size - 1) / job->chunk_size;
+        if (file->in_size == 0 || file->in_size % block_size) {
+            atomic_store(&file->status, FILE_FORMAT_ERROR);
+            file->chunks = 0;
         }
     }
+    if (ftruncate(file->out_fd, file->out_size)) {
+        atomic_store(&file->status, FILE_WRITE_ERROR);
+        file->chunks = 0;
+    }
+
+    if (file->chunks <= 1) {
+        if (file->chunks) tree_cipher_chunk(file, 0, worker);
+        tree_finish_file(file);
+        return;
+    }
 
-    for (unsigned i = 0; i <= Nr; ++i) free(key_processed[i]);
-    free(key_processed);
+    atomic_init(&file->remaining, file->chunks);
+    file->chunk_tasks = (TreeChunk *)malloc(file->chunks * sizeof(TreeChunk));
+    for (size_t i = file->chunks; i-- > 1;) {
+        file->chunk_tasks[i] = (TreeChunk){file, i};
+        work_pool_push(pool, worker, tree_chunk_task, &file->chunk_tasks[i]);
+    }
+    tree_cipher_chunk(file, 0, worker);
+    if (atomic_fetch_sub(&file->remaining, 1) == 1) tree_finish_file(file);
+}
 
-    fclose(in_file);
-    fclose(out_file);
+static void tree_chunk_task(WorkPool *pool, unsigned worker, void *context) {
+    (void)pool;
+    const TreeChunk *chunk = (const TreeChunk *)context;
+    TreeFile *file = chunk->file;
+    tree_cipher_chunk(file, chunk->index, worker);
+    if (atomic_fetch_sub(&file->remaining, 1) == 1) tree_finish_file(file);
+}
+
+// Chunks are buffers at the same offsets in the input and the output, so
+// they can be ciphered in any order. Only the last is padded or unpadded.
+static void tree_cipher_chunk(TreeFile *file, size_t index, unsigned worker) {
+    TreeJob *job = file->job;
+    if (atomic_load(&file->status) != FILE_SUCCESS) return;
+
+    if (!job->buffers[worker]) job->buffers[worker] = (byte *)alloc_buffer(job->chunk_size);
+    byte *buffer = job->buffers[worker];
+
+    const off_t offset = (off_t)(index * job->chunk_size);
+    size_t length = file->in_size - offset < (off_t)job->chunk_size ? (size_t)(file->in_size - offset) : job->chunk_size;
+    const int last = index == file->chunks - 1;
+
+    FileStatus status = FILE_SUCCESS;
+    StatsTimer timer;
+    const size_t in_length = length;
+    if (!pread_full(file->in_fd, buffer, length, offset)) {
+        status = FILE_READ_ERROR;
+    } else if (job->for_encryption) {
+        stats_start(&timer);
+        status = ecb_encrypt_transform(&job->stream, buffer, &length, last);
+        stats_stop(&timer, STATS_CIPHER, in_length);
+    } else {
+        stats_start(&timer);
+        status = ecb_decrypt_transform(&job->stream, buffer, &length, last);
+        stats_stop(&timer, STATS_CIPHER, in_length);
+        if (last) file->out_size = offset + (off_t)length;
+    }
+    if (status == FILE_SUCCESS && !pwrite_full(file->out_fd, buffer, length, offset)) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) atomic_store(&file->status, status);
+}
+
+// Runs once every chunk is done, on the worker that did the last one.
+static void tree_finish_file(TreeFile *file) {
+    FileStatus status = (FileStatus)atomic_load(&file->status);
+    if (status == FILE_SUCCESS && !file->job->for_encryption && ftruncate(file->out_fd, file->out_size)) {
+        status = FILE_WRITE_ERROR;
+    }
+    close(file->in_fd);
+    if (close(file->out_fd) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    free(file->chunk_tasks);
+    file->chunk_tasks = NULL;
+
+    if (status != FILE_SUCCESS) {
+        remove(file->entry->out_path);
+        print_file_status(status, file->entry->in_path, file->entry->out_path);
+        atomic_fetch_add(&file->job->failures, 1);
+    }
+}
+
+// Writes the ciphertext followed by the 16-byte authentication tag.
+static void gcm_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t capacity = get_buffer_capacity(Nb, options);
+
+    size_t iv_length;
+    byte *iv = hex_string_to_gcm_iv(Nb, options->iv, &iv_length);
+
+    FILE *in_file, *out_file;
+    if (!(in_file = open_input(in_dir))) {
+        free(iv);
+        error(": Failed to open input file.", in_dir);
+    }
+    if (!(out_file = open_output(out_dir))) {
+        free(iv);
+        close_file(in_file);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+
+    GcmState gcm;
+    gcm_init(&gcm, Nr, &key_schedule, iv, iv_length);
+    free(iv);
+
+    byte *buffer = (byte *)alloc_buffer(capacity);
+    FileStatus status = FILE_SUCCESS;
+
+    size_t bytes_read;
+    while ((bytes_read = read_stream(buffer, capacity, in_file)) > 0) {
+        StatsTimer timer;
+        stats_start(&timer);
+        gcm_encrypt(&gcm, bytes_read, buffer, buffer);
+        stats_stop(&timer, STATS_CIPHER, bytes_read);
+        if (!write_stream(buffer, bytes_read, out_file)) {
+            status = FILE_WRITE_ERROR;
+            break;
+        }
+    }
+    if (status == FILE_SUCCESS && ferror(in_file)) status = FILE_READ_ERROR;
+
+    byte tag[16];
+    gcm_finish(&gcm, tag);
+    wipe_key_schedule(&key_schedule);
+    if (status == FILE_SUCCESS && fwrite(tag, sizeof(byte), 16, out_file) != 16) status = FILE_WRITE_ERROR;
+
+    free(buffer);
+
+    close_file(in_file);
+    if (close_file(out_file) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        remove_output(out_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+}
+
+// Decrypts into a temporary file, which only replaces the output once the tag
+// has been verified, so no unauthenticated plaintext is ever visible at
+// out_dir. The last 16 bytes read are always held back as the tag.
+static void inv_gcm_file_interface(unsigned Nb, unsigned Nk, const char *key, const char *in_dir, const char *out_dir, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t capacity = get_buffer_capacity(Nb, options);
+
+    size_t iv_length;
+    byte *iv = hex_string_to_gcm_iv(Nb, options->iv, &iv_length);
+
+    FILE *in_file, *temp_file;
+    if (!(in_file = open_input(in_dir))) {
+        free(iv);
+        error(": Failed to open input file.", in_dir);
+    }
+
+    // for the standard output, the plaintext is copied over after verification
+    char *temp_dir = NULL;
+    if (strcmp(out_dir, "-") == 0) {
+        temp_file = tmpfile();
+    } else {
+        temp_dir = (char *)malloc(strlen(out_dir) + 8);
+        sprintf(temp_dir, "%s.XXXXXX", out_dir);
+        int temp_fd = mkstemp(temp_dir);
+        if (!(temp_file = temp_fd < 0 ? NULL : fdopen(temp_fd, "w+b")) && temp_fd >= 0) {
+            close(temp_fd);
+            remove(temp_dir);
+        }
+    }
+    if (!temp_file) {
+        free(temp_dir);
+        free(iv);
+        close_file(in_file);
+        error(": Failed to open output file.", out_dir);
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+
+    GcmState gcm;
+    gcm_init(&gcm, Nr, &key_schedule, iv, iv_length);
+    free(iv);
+
+    byte *buffer = (byte *)alloc_buffer(capacity);
+    size_t held = 0;
+    FileStatus status = FILE_SUCCESS;
+
+    for (;;) {
+        const size_t bytes = held + read_stream(buffer + held, capacity - held, in_file);
+        StatsTimer timer;
+        if (bytes < capacity) {
+            if (ferror(in_file)) {
+                status = FILE_READ_ERROR;
+            } else if (bytes < 16) {
+                status = FILE_FORMAT_ERROR;
+            } else {
+                byte tag[16];
+                stats_start(&timer);
+                gcm_decrypt(&gcm, bytes - 16, buffer, buffer);
+                gcm_finish(&gcm, tag);
+                stats_stop(&timer, STATS_CIPHER, bytes - 16);
+                if (!write_stream(buffer, bytes - 16, temp_file)) {
+                    status = FILE_WRITE_ERROR;
+                } else if (!gcm_tag_equal(tag, buffer + bytes - 16)) {
+                    status = FILE_AUTHENTICATION_ERROR;
+                }
+            }
+            break;
+        }
+        stats_start(&timer);
+        gcm_decrypt(&gcm, capacity - 16, buffer, buffer);
+        stats_stop(&timer, STATS_CIPHER, capacity - 16);
+        if (!write_stream(buffer, capacity - 16, temp_file)) {
+            status = FILE_WRITE_ERROR;
+            break;
+        }
+        memcpy(buffer, buffer + capacity - 16, 16);
+        held = 16;
+    }
+    wipe_key_schedule(&key_schedule);
+
+    close_file(in_file);
+
+    if (status == FILE_SUCCESS && !temp_dir) {
+        rewind(temp_file);
+        size_t bytes_read;
+        while ((bytes_read = read_stream(buffer, capacity, temp_file)) > 0) {
+            if (!write_stream(buffer, bytes_read, stdout)) break;
+        }
+        if (ferror(temp_file) || close_file(stdout)) status = FILE_WRITE_ERROR;
+    }
+    free(buffer);
+
+    if (fclose(temp_file) && status == FILE_SUCCESS) status = FILE_WRITE_ERROR;
+    if (status == FILE_SUCCESS && temp_dir && rename(temp_dir, out_dir)) status = FILE_WRITE_ERROR;
+    if (status != FILE_SUCCESS) {
+        if (temp_dir) remove(temp_dir);
+        free(temp_dir);
+        report_file_status(status, in_dir, out_dir);
+    }
+    free(temp_dir);
 }
 
 char *process_hex_string(const char *str) {
     const size_t str_len = strlen(str);
     char *new_str = (char *)malloc((str_len + 1) * sizeof(char));
-    size_t n = 0;
-    for (size_t i = 0; i < str_len; ++i) {
-        if (isspace(str[i])) continue;
-        if (!isxdigit(str[i])) {
-            free(new_str);
-            error("Input contains invalid hexadecimal digit.", NULL);
-        }
-        new_str[n++] = str[i];
+    size_t n = hex_strip(str, str_len, new_str);
+    if (n == (size_t)-1) {
+        free(new_str);
+        error("Input contains invalid hexadecimal digit.", NULL);
     }
     new_str[n] = '\0';
     return new_str;
@@ -219,40 +1785,180 @@ static inline unsigned get_Nr(unsigned Nb, unsigned Nk) {
     return 0;
 }
 
-static char *cipher_hex_interface(unsigned Nb, unsigned Nk, unsigned Nr, word **key, word in[], int for_encryption) {
-    change_endianness(Nb, in);
+static char *cipher_hex_interface(unsigned Nb, unsigned Nk, unsigned Nr, const KeySchedule *key, word in[], int for_encryption) {
     word *out_bytes = for_encryption ? Cipher(Nb, Nr, in, key)
                                      : InvCipher(Nb, Nr, in, key);
-    change_endianness(Nb, out_bytes);
     char *out = block_to_hex_string(Nb, out_bytes);
     free(out_bytes);
     return out;
 }
 
-static word **hex_string_to_expanded_key(unsigned Nb, unsigned Nr, const char *key_str, unsigned Nk, int for_encryption) {
-    word *key = (word *)malloc(Nk * sizeof(word *));
-    for (unsigned i = 0; i < Nk; ++i) {
-        char buffer[9];
-        memcpy(buffer, key_str + i * 8, 8 * sizeof(char));
-        buffer[8] = '\0';
-        key[i] = strtoul(buffer, NULL, 16);
-    }
-    change_endianness(Nb, key);
-    word **key_expanded = KeyExpansion(Nb, Nr, key, Nk);
-    free(key);
-    if (!for_encryption) {
-        for (unsigned round = 1; round < Nr; ++round) {
-            for (unsigned j = 0; j < Nb; ++j) {
-                const uword w = {key_expanded[round][j]};
-                key_expanded[round][j] =
-                    InvMixColumns_table[0][w.bytes[0]] ^
-                    InvMixColumns_table[1][w.bytes[1]] ^
-                    InvMixColumns_table[2][w.bytes[2]] ^
-                    InvMixColumns_table[3][w.bytes[3]];
-            }
+static char *ctr_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+
+    byte iv[32];
+    hex_string_to_iv(Nb, options->iv, iv);
+
+    char *in_processed = process_hex_string(in);
+    size_t length;
+    byte *bytes = hex_string_to_bytes(in_processed, &length);
+    free(in_processed);
+    if (!bytes) error("Incorrect input length.", NULL);
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+
+    ctr_blocks(Nb, Nr, &key_schedule, iv, 0, length, bytes, bytes);
+    wipe_key_schedule(&key_schedule);
+    char *out = bytes_to_hex_string(bytes, length);
+
+    free(bytes);
+
+    return out;
+}
+
+// Outputs the ciphertext followed by the tag, or the plaintext if the tag
+// at the end of the input is correct.
+static char *gcm_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+
+    size_t iv_length;
+    byte *iv = hex_string_to_gcm_iv(Nb, options->iv, &iv_length);
+
+    char *in_processed = process_hex_string(in);
+    size_t length;
+    byte *bytes = hex_string_to_bytes(in_processed, &length);
+    free(in_processed);
+    if (!bytes || (!for_encryption && length < 16)) {
+        free(iv);
+        free(bytes);
+        error("Incorrect input length.", NULL);
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+
+    GcmState gcm;
+    gcm_init(&gcm, Nr, &key_schedule, iv, iv_length);
+    free(iv);
+
+    char *out;
+    if (for_encryption) {
+        byte *out_bytes = (byte *)malloc(length + 16);
+        gcm_encrypt(&gcm, length, bytes, out_bytes);
+        gcm_finish(&gcm, out_bytes + length);
+        wipe_key_schedule(&key_schedule);
+        out = bytes_to_hex_string(out_bytes, length + 16);
+        free(out_bytes);
+    } else {
+        byte tag[16];
+        gcm_decrypt(&gcm, length - 16, bytes, bytes);
+        gcm_finish(&gcm, tag);
+        wipe_key_schedule(&key_schedule);
+        if (!gcm_tag_equal(tag, bytes + length - 16)) {
+            free(bytes);
+            error("Authentication failed.", NULL);
         }
+        out = bytes_to_hex_string(bytes, length - 16);
     }
-    return key_expanded;
+
+    free(bytes);
+
+    return out;
+}
+
+// The input must be a whole number of blocks, and is not padded.
+static char *cbc_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+
+    byte iv[32];
+    hex_string_to_iv(Nb, options->iv, iv);
+
+    char *in_processed = process_hex_string(in);
+    size_t length;
+    byte *bytes = hex_string_to_bytes(in_processed, &length);
+    free(in_processed);
+    if (!bytes || length == 0 || length % (4 * Nb)) {
+        free(bytes);
+        error("Incorrect input length.", NULL);
+    }
+
+    KeySchedule key_schedule;
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &key_schedule, options);
+
+    if (for_encryption) {
+        cbc_encrypt(Nb, Nr, &key_schedule, iv, length, bytes, bytes);
+    } else {
+        cbc_decrypt(Nb, Nr, &key_schedule, iv, length, bytes, bytes);
+    }
+    wipe_key_schedule(&key_schedule);
+    char *out = bytes_to_hex_string(bytes, length);
+
+    free(bytes);
+
+    return out;
+}
+
+// The input is ciphered as data units numbered from 0.
+static char *xts_hex_interface(unsigned Nb, unsigned Nk, const char *key, const char *in, int for_encryption, const CipherOptions *options) {
+    unsigned Nr = get_Nr(Nb, Nk);
+    const size_t unit_size = options->unit_size ? options->unit_size : DEFAULT_UNIT_SIZE;
+
+    char *in_processed = process_hex_string(in);
+    size_t length;
+    byte *bytes = hex_string_to_bytes(in_processed, &length);
+    free(in_processed);
+    if (!bytes || !xts_length_valid(length, unit_size)) {
+        free(bytes);
+        error("Incorrect input length.", NULL);
+    }
+
+    XtsKey xts_key;
+    hex_string_to_xts_key(Nb, Nr, key, Nk, &xts_key, options);
+
+    xts_units(Nr, &xts_key, 0, unit_size, length, bytes, bytes, for_encryption);
+    wipe_key_schedule(&xts_key.data);
+    wipe_key_schedule(&xts_key.tweak);
+    char *out = bytes_to_hex_string(bytes, length);
+
+    free(bytes);
+
+    return out;
+}
+
+// Key bytes in order are the key words as laid out in memory, as FIPS-197
+// reads them. Versions before CTR mode reversed the bytes of every word after
+// the first Nb, which only made a difference for 192- and 256-bit keys; files
+// they wrote are read with options->legacy_key_order.
+static void hex_string_to_key_schedule(unsigned Nb, unsigned Nr, const char *key_str, unsigned Nk, KeySchedule *schedule, const CipherOptions *options) {
+    word key[MAX_NB];
+    StatsTimer timer;
+    stats_start(&timer);
+    hex_decode(key_str, 4 * Nk, (byte *)key);
+    if (options->legacy_key_order) {
+        for (unsigned i = Nb; i < Nk; ++i) {
+            const uword w = {key[i]};
+            key[i] = (word)w.bytes[3] | (word)w.bytes[2] << 8 | (word)w.bytes[1] << 16 | (word)w.bytes[0] << 24;
+        }
+    }
+    key_cache_expand(Nb, Nr, key, Nk, schedule);
+    // the raw key is not left on the stack
+    volatile word *p = key;
+    for (unsigned i = 0; i < MAX_NB; ++i) p[i] = 0;
+    stats_stop(&timer, STATS_KEY, 4 * Nk);
+}
+
+// An XTS key is two keys of the same size: the first for the data, and the
+// second for the tweaks.
+static void hex_string_to_xts_key(unsigned Nb, unsigned Nr, const char *key, unsigned Nk, XtsKey *xts_key, const CipherOptions *options) {
+    if (Nb != 4) error("XTS mode requires 128-bit blocks.", NULL);
+    hex_string_to_key_schedule(Nb, Nr, key, Nk, &xts_key->data, options);
+    hex_string_to_key_schedule(Nb, Nr, key + 8 * Nk, Nk, &xts_key->tweak, options);
+}
+
+// Every data unit, including a shorter last one, must hold at least a block.
+static int xts_length_valid(uint64_t length, size_t unit_size) {
+    return length >= 16 && (length % unit_size == 0 || length % unit_size >= 16);
 }
 
 static void block_bit_padding(unsigned Nb, byte block[], unsigned start) {
@@ -272,22 +1978,58 @@ static int get_block_padding_position(unsigned Nb, const byte block[]) {
     return -1;
 }
 
+// The bytes of the block are in the order of the digits in the string.
 static word *hex_string_to_block(unsigned Nb, const char *str) {
     word *block = (word *)malloc(Nb * sizeof(word));
-    for (unsigned j = 0; j < Nb; ++j) {
-        char buffer[9];
-        memcpy(buffer, str + j * 8, 8 * sizeof(char));
-        buffer[8] = '\0';
-        block[j] = strtoul(buffer, NULL, 16);
-    }
+    hex_decode(str, 4 * Nb, (byte *)block);
     return block;
 }
 
 static char *block_to_hex_string(unsigned Nb, const word block[]) {
     char *str = (char *)malloc((8 * Nb + 1) * sizeof(char));
-    for (unsigned j = 0; j < Nb; ++j) {
-        snprintf(str + j * 8, 9, "%08x", block[j]);
+    hex_encode((const byte *)block, 4 * Nb, str);
+    str[8 * Nb] = '\0';
+    return str;
+}
+
+static void hex_string_to_iv(unsigned Nb, const char *str, byte iv[]) {
+    char *iv_processed = process_hex_string(str);
+    if (strlen(iv_processed) != 8 * Nb) {
+        free(iv_processed);
+        error("Incorrect IV length.", NULL);
+    }
+    word *block = hex_string_to_block(Nb, iv_processed);
+    free(iv_processed);
+    memcpy(iv, block, 4 * Nb);
+    free(block);
+}
+
+static byte *hex_string_to_gcm_iv(unsigned Nb, const char *str, size_t *length) {
+    if (Nb != 4) error("GCM mode requires 128-bit blocks.", NULL);
+    char *iv_processed = process_hex_string(str);
+    byte *iv = hex_string_to_bytes(iv_processed, length);
+    free(iv_processed);
+    if (!iv || *length == 0) {
+        free(iv);
+        error("Incorrect IV length.", NULL);
     }
-    // the terminating null character is handled by the last snprintf() call
+    return iv;
+}
+
+// Returns NULL if str does not consist of whole bytes.
+static byte *hex_string_to_bytes(const char *str, size_t *length) {
+    const size_t str_len = strlen(str);
+    if (str_len % 2) return NULL;
+    *length = str_len / 2;
+    // one spare byte so that an empty string still gives a valid pointer
+    byte *bytes = (byte *)malloc(*length + 1);
+    hex_decode(str, *length, bytes);
+    return bytes;
+}
+
+static char *bytes_to_hex_string(const byte bytes[], size_t length) {
+    char *str = (char *)malloc((2 * length + 1) * sizeof(char));
+    hex_encode(bytes, length, str);
+    str[2 * length] = '\0';
     return str;
 }
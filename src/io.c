@@ -1,12 +1,20 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "io.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "aes.h"
 
-void error(const char *msg, const char *from) {
+void print_error(const char *msg, const char *from) {
     fprintf(stderr, "Error: %s%s\n\n", from ? from : "", msg);
+}
+
+void error(const char *msg, const char *from) {
+    print_error(msg, from);
     exit(EXIT_FAILURE);
 }
 
@@ -18,3 +26,61 @@ void print_block(unsigned Nb, const word block[]) {
         }
     }
 }
+
+// Allocates a page-aligned buffer of at least size bytes, to be released with
+// free().
+void *alloc_buffer(size_t size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    const size_t alignment = page_size > 0 ? (size_t)page_size : 4096;
+    void *buffer = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (!buffer) error("Out of memory.", NULL);
+    return buffer;
+}
+
+// Reads exactly length bytes at offset, retrying short reads. Returns 0 on
+// failure or premature end of file.
+int pread_full(int fd, void *buffer, size_t length, off_t offset) {
+    byte *p = (byte *)buffer;
+    StatsTimer timer;
+    stats_start(&timer);
+    const size_t total = length;
+    while (length) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    stats_stop(&timer, STATS_READ, total);
+    return 1;
+}
+
+// Writes exactly length bytes at offset, retrying short writes. Returns 0 on
+// failure.
+int pwrite_full(int fd, const void *buffer, size_t length, off_t offset) {
+    const byte *p = (const byte *)buffer;
+    StatsTimer timer;
+    stats_start(&timer);
+    const size_t total = length;
+    while (length) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    stats_stop(&timer, STATS_WRITE, total);
+    return 1;
+}
+
+// Fills out[] with length bytes from the system's random number generator.
+// Returns 0 on failure.
+int random_bytes(byte out[], size_t length) {
+    FILE *file = fopen("/dev/urandom", "rb");
+    if (!file) return 0;
+    const int read = fread(out, sizeof(byte), length, file) == length;
+    fclose(file);
+    return read;
+}
@@ -5,30 +5,69 @@
 
 static inline word SubWord(word w);
 static inline word RotWord(word w);
+static inline word InvMixColumn(word w);
 
-word **KeyExpansion(unsigned Nb, unsigned Nr, const word key[], unsigned Nk) {
-    word *w = (word *)malloc(Nb * (Nr + 1) * sizeof(word));
+// Expands the key into both schedules in place; no memory is allocated, so
+// the schedule may live on the stack and be reused for another key.
+void KeyExpansion(unsigned Nb, unsigned Nr, const word key[], unsigned Nk, KeySchedule *schedule) {
+    word *w = schedule->encryption;
+    // the bitsliced engine promises that no table is indexed by the key, so
+    // its circuits are used to expand the key as well
+    const int bitsliced = Nb == 4 && get_engine(4) == &bitslice_engine;
 
     memcpy(w, key, Nk * sizeof(word));
 
     for (unsigned i = Nk; i < Nb * (Nr + 1); ++i) {
-        w[i] = w[i - Nk] ^
-               ((i % Nk == 0)             ? (SubWord(RotWord(w[i - 1])) ^ Rcon[i / Nk])
-                : (Nk > 6 && i % Nk == 4) ? SubWord(w[i - 1])
-                                          : w[i - 1]);
+        word temp = w[i - 1];
+        if (i % Nk == 0) {
+            temp = RotWord(temp);
+            temp = (bitsliced ? bitslice_sub_word(temp) : SubWord(temp)) ^ Rcon[i / Nk];
+        } else if (Nk > 6 && i % Nk == 4) {
+            temp = bitsliced ? bitslice_sub_word(temp) : SubWord(temp);
+        }
+        w[i] = w[i - Nk] ^ temp;
     }
 
-    word **out = (word **)malloc((Nr + 1) * sizeof(word *));
-    for (unsigned i = 0; i <= Nr; ++i) {
-        out[i] = (word *)malloc(Nb * sizeof(word));
-        memcpy(out[i], w + i * Nb, Nb * sizeof(word));
+    word *dw = schedule->decryption;
+    for (unsigned i = 0; i < Nb * (Nr + 1); ++i) {
+        dw[i] = (i < Nb || i >= Nb * Nr) ? w[i]
+                : bitsliced              ? bitslice_inv_mix_column(w[i])
+                                         : InvMixColumn(w[i]);
     }
 
-    free(w);
+    schedule->Nb = Nb;
+    schedule->Nr = Nr;
+    select_rounds(schedule);
+}
+
+// Expands n keys of Nk words each, one after another in keys[], into the
+// schedules, with the same result as KeyExpansion() on each. With 128-bit
+// blocks, AES-NI expands several keys at once where the processor has it;
+// otherwise the keys are expanded one at a time.
+void KeyExpansionBulk(unsigned Nb, unsigned Nr, size_t n, const word keys[], unsigned Nk, KeySchedule *const schedules[]) {
+    if (Nb == 4 && aesni_expand_keys(Nr, n, keys, Nk, schedules)) return;
+    for (size_t i = 0; i < n; ++i) KeyExpansion(Nb, Nr, keys + i * Nk, Nk, schedules[i]);
+}
+
+// Clears the schedule in a way the compiler cannot optimise away, before the
+// memory is released or reused.
+void wipe_key_schedule(KeySchedule *schedule) {
+    volatile byte *p = (volatile byte *)schedule;
+    for (size_t i = 0; i < sizeof(KeySchedule); ++i) p[i] = 0;
+}
 
-    return out;
+#if AES_COMPACT_TABLES
+
+static inline word SubWord(word w) {
+    const uword temp = {w};
+    return (word)byte_s_box[temp.bytes[0]] |
+           (word)byte_s_box[temp.bytes[1]] << 8 |
+           (word)byte_s_box[temp.bytes[2]] << 16 |
+           (word)byte_s_box[temp.bytes[3]] << 24;
 }
 
+#else
+
 static inline word SubWord(word w) {
     const uword temp = {w};
     return s_box[0][temp.bytes[0]] ^
@@ -37,6 +76,33 @@ static inline word SubWord(word w) {
            s_box[3][temp.bytes[3]];
 }
 
+#endif
+
 static inline word RotWord(word w) {
     return (w << 24) | (w >> 8);
 }
+
+#if AES_COMPACT_TABLES
+
+// The inverse cipher table holds InvMixColumns() of the inverse S-box, so
+// passing each byte through the S-box first leaves InvMixColumns() alone.
+static inline word InvMixColumn(word w) {
+    const uword temp = {w};
+    const word t0 = compact_inv_cipher_table[byte_s_box[temp.bytes[0]]];
+    const word t1 = compact_inv_cipher_table[byte_s_box[temp.bytes[1]]];
+    const word t2 = compact_inv_cipher_table[byte_s_box[temp.bytes[2]]];
+    const word t3 = compact_inv_cipher_table[byte_s_box[temp.bytes[3]]];
+    return t0 ^ (t1 << 8 | t1 >> 24) ^ (t2 << 16 | t2 >> 16) ^ (t3 << 24 | t3 >> 8);
+}
+
+#else
+
+static inline word InvMixColumn(word w) {
+    const uword temp = {w};
+    return InvMixColumns_table[0][temp.bytes[0]] ^
+           InvMixColumns_table[1][temp.bytes[1]] ^
+           InvMixColumns_table[2][temp.bytes[2]] ^
+           InvMixColumns_table[3][temp.bytes[3]];
+}
+
+#endif
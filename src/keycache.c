@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "aes.h"
+
+// Enough for a handful of keys in flight at once; lookups scan every slot,
+// which at this size is cheaper than maintaining a hash table.
+#define KEY_CACHE_CAPACITY 16
+
+typedef struct KeyCacheEntry {
+    uint64_t hash;
+    uint64_t last_used;  // 0 for an empty slot
+    unsigned Nb, Nk;
+    word key[MAX_NB];
+    KeySchedule schedule;
+} KeyCacheEntry;
+
+static KeyCacheEntry entries[KEY_CACHE_CAPACITY];
+static KeyCacheStats cache_stats;
+static uint64_t clock_tick;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_key(unsigned Nb, const word key[], unsigned Nk);
+static int key_equal(const word a[], const word b[], unsigned Nk);
+static KeyCacheEntry *find_victim(void);
+static void wipe_entry(KeyCacheEntry *entry);
+
+// Fills schedule with the expansion of key, reusing a previous expansion of
+// the same key and block size when one is still cached.
+void key_cache_expand(unsigned Nb, unsigned Nr, const word key[], unsigned Nk, KeySchedule *schedule) {
+    uint64_t hash = hash_key(Nb, key, Nk);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (unsigned i = 0; i < KEY_CACHE_CAPACITY; ++i) {
+        KeyCacheEntry *entry = &entries[i];
+        if (entry->last_used && entry->hash == hash && entry->Nb == Nb && entry->Nk == Nk &&
+            key_equal(entry->key, key, Nk)) {
+            entry->last_used = ++clock_tick;
+            ++cache_stats.hits;
+            *schedule = entry->schedule;
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+    }
+    ++cache_stats.misses;
+    pthread_mutex_unlock(&cache_mutex);
+
+    // expand outside the lock so that misses on other threads proceed
+    KeyExpansion(Nb, Nr, key, Nk, schedule);
+
+    pthread_mutex_lock(&cache_mutex);
+    KeyCacheEntry *entry = find_victim();
+    if (entry->last_used) {
+        ++cache_stats.evictions;
+        wipe_entry(entry);
+    }
+    entry->hash = hash;
+    entry->Nb = Nb;
+    entry->Nk = Nk;
+    memcpy(entry->key, key, Nk * sizeof(word));
+    entry->schedule = *schedule;
+    entry->last_used = ++clock_tick;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// Wipes every cached schedule. The counters are kept.
+void key_cache_clear(void) {
+    pthread_mutex_lock(&cache_mutex);
+    for (unsigned i = 0; i < KEY_CACHE_CAPACITY; ++i) {
+        if (entries[i].last_used) wipe_entry(&entries[i]);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void key_cache_get_stats(KeyCacheStats *stats) {
+    pthread_mutex_lock(&cache_mutex);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// FNV-1a over the key words. Only used to reject mismatches quickly; a
+// matching hash is always confirmed against the stored key.
+static uint64_t hash_key(unsigned Nb, const word key[], unsigned Nk) {
+    uint64_t hash = 0xcbf29ce484222325u ^ (Nb << 4 | Nk);
+    for (unsigned i = 0; i < Nk; ++i) {
+        hash ^= key[i];
+        hash *= 0x100000001b3u;
+    }
+    return hash;
+}
+
+// Compares without branching on the key material.
+static int key_equal(const word a[], const word b[], unsigned Nk) {
+    word difference = 0;
+    for (unsigned i = 0; i < Nk; ++i) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+// An empty slot if there is one, otherwise the least recently used entry.
+static KeyCacheEntry *find_victim(void) {
+    KeyCacheEntry *victim = &entries[0];
+    for (unsigned i = 0; i < KEY_CACHE_CAPACITY; ++i) {
+        if (!entries[i].last_used) return &entries[i];
+        if (entries[i].last_used < victim->last_used) victim = &entries[i];
+    }
+    return victim;
+}
+
+static void wipe_entry(KeyCacheEntry *entry) {
+    volatile word *key = entry->key;
+    for (unsigned i = 0; i < MAX_NB; ++i) key[i] = 0;
+    wipe_key_schedule(&entry->schedule);
+    entry->hash = 0;
+    entry->last_used = 0;
+}
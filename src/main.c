@@ -4,17 +4,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "aes.h"
 #include "io.h"
 
 int time_display = 0;
 
+typedef enum StatsFormat {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
 typedef enum InputMode {
     INPUT_UNDEFINED,
     HEX_STRING_INPUT,
+    HEX_BATCH_INPUT,
     FILE_INPUT,
+    TREE_INPUT,
 } InputMode;
 
 typedef enum KeyMode {
@@ -32,13 +39,20 @@ static const char *get_basename(const char *path) {
 }
 
 static char *read_from_file(const char *filename);
+static size_t parse_size(const char *str);
+static int parse_range(const char *str, ByteRange *range);
 
 void usage(const char *basename, int is_failure) {
     fprintf(
         is_failure ? stderr : stdout,
         "Usage:\n"
-        "    %s {-e|-d} [-t] { -s <hex-string> | -f <in> <out> }\n"
+        "    %s {-e|-d} [-t] [-engine <name>] [-m <mode>] [-iv <iv>] [-j <threads>]\n"
+        "        [-b <size>] [-mmap] [-unit <size>] [-range <offset>:<length>]\n"
+        "        [--stats {text|json}] [--legacy-key-order]\n"
+        "        { -s <hex-string> | -S <in> | -f <in> <out>\n"
+        "        | -F <in> <out-dir> }\n"
         "        { -k <key> | -kfile <file> }\n"
+        "    %s --serve <socket> [-engine <name>] [-j <threads>]\n"
         "    %s {-h|--help}\n"
         "\n"
         "Options:\n"
@@ -46,31 +60,90 @@ void usage(const char *basename, int is_failure) {
         "                    algorithm.\n"
         "          -d    Decryption (Inverse Cipher) mode: decrypts information with \n"
         "                    the AES algorithm.\n"
-        "          -t    Time display: displays time elapsed when finished.\n"
+        "          -t    Time display: displays time elapsed when finished, and \n"
+        "                    time spent reading, ciphering and writing files.\n"
+        "     --stats    Statistics: displays the calls, bytes, and wall and CPU \n"
+        "                    time of key setup, reading, ciphering and writing, \n"
+        "                    in total and for each thread, as text or JSON.\n"
+        "     -engine    Cipher engine: one of \"aesni\" (hardware instructions, \n"
+        "                    where supported), \"bitslice\" (constant-time software, \n"
+        "                    key expansion included), \"table\" (lookup tables) \n"
+        "                    or \"compact\" (a quarter of the tables, rotated). By \n"
+        "                    default, the fastest engine supported by the \n"
+        "                    processor is used.\n"
+        "          -m    Mode of operation: \"ecb\" (default), which encrypts every \n"
+        "                    block independently and pads files; \"ctr\" (counter \n"
+        "                    mode), which needs an IV and no padding; \"gcm\" \n"
+        "                    (Galois/Counter Mode), which needs an IV and appends a \n"
+        "                    128-bit authentication tag to the output; \"cbc\" \n"
+        "                    (cipher block chaining), which needs an IV and pads \n"
+        "                    files as in ECB mode; \"xts\" (IEEE 1619), which \n"
+        "                    takes two keys and no IV, and ciphers every data unit \n"
+        "                    independently without padding; \n"
+        "                    or \"container\", which writes a seekable file of \n"
+        "                    independently authenticated GCM chunks with an index, \n"
+        "                    under a random nonce.\n"
+        "         -iv    Initial counter block for CTR mode or IV for CBC mode, \n"
+        "                    which must be a valid 128-bit hexadecimal string, or IV \n"
+        "                    for GCM mode, which should preferably be 96 bits long. \n"
+        "                    Never reuse an IV with the same key.\n"
+        "          -j    Number of threads used for file modes that run in parallel. \n"
+        "                    Defaults to the number of processors.\n"
+        "          -b    Buffer size for file mode, in bytes, or with a suffix of K \n"
+        "                    or M. Defaults to 1M.\n"
+        "       -mmap    Memory-maps the input and output files in ECB and CTR modes, \n"
+        "                    when both are regular files, instead of copying the data \n"
+        "                    through buffers.\n"
+        "       -unit    Data unit size for XTS mode, or chunk size for container \n"
+        "                    mode, in bytes, or with a suffix of K or M. It must be a \n"
+        "                    multiple of 16. Defaults to 4K for XTS and 64K for \n"
+        "                    containers.\n"
+        "      -range    Decrypts only <length> bytes from <offset> of a file in XTS \n"
+        "                    or container mode, reading no more than the data units \n"
+        "                    or chunks covering them.\n"
         "          -s    Hexadecimal string mode: encrypts the single-block hexadecimal \n"
         "                    string given. <hex-string> must be a valid 128-bit \n"
-        "                    hexadecimal string.\n"
+        "                    hexadecimal string; in CTR and GCM modes, it may be of \n"
+        "                    any whole number of bytes.\n"
+        "          -S    Batch hexadecimal mode: encrypts every line of hexadecimal \n"
+        "                    blocks in <in> in ECB mode, and prints the results a \n"
+        "                    line each. Each line must be a whole number of 128-bit \n"
+        "                    blocks. \"-\" stands for the standard input.\n"
         "          -f    File mode: encrypts the file given. <in> must be a valid path \n"
         "                    to an existing file with read access. <out> must be a \n"
         "                    valid path to a file with write access. If the output file \n"
         "                    already exists, it is overwritten; otherwise, it is \n"
-        "                    created.\n"
+        "                    created. \"-\" stands for the standard input or output.\n"
+        "          -F    Directory mode: encrypts many files in ECB mode on all \n"
+        "                    threads. <in> is a directory, whose tree is mirrored \n"
+        "                    in <out-dir>; a single file; or @<list>, a file listing \n"
+        "                    a path on each line (\"@-\" for the standard input), \n"
+        "                    each of which is written under <out-dir> at its \n"
+        "                    relative path. <out-dir> is created if needed.\n"
         "          -k    Key provided as an argument. <key> must be a valid hexadecimal \n"
         "                    string. The length of the key should be 128, 192, or 256 \n"
         "                    bits. The AES algorithm is automatically deduced from the \n"
-        "                    key length.\n"
+        "                    key length. In XTS mode, two 128-bit or two 256-bit keys \n"
+        "                    are given one after the other.\n"
         "      -kfile    Key provided as a file. <file> must be a valid path to the key \n"
         "                    file, which contains a valid hexadecimal string. The \n"
         "                    length of the key should be 128, 192, or 256 bits. The AES \n"
         "                    algorithm is automatically deduced from the key length.\n"
+        "--legacy-key-order  Reads 192- and 256-bit keys with the bytes of each word \n"
+        "                    after the fourth reversed, as versions before CTR mode \n"
+        "                    did, to decrypt files they wrote.\n"
+        "     --serve    Server mode: answers encryption and decryption requests in \n"
+        "                    ECB and CTR modes from clients of the Unix domain socket \n"
+        "                    <socket>, gathering small requests into batches on \n"
+        "                    <threads> threads. Runs until interrupted.\n"
         "  -h, --help    Display this help message.\n"
         "\n",
-        basename, basename);
+        basename, basename, basename);
     exit(is_failure ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 int main(int argc, char **argv) {
-    clock_t begin = clock();
+    const double begin = get_monotonic_time();
 
     const char *basename = get_basename(argv[0]);
 
@@ -84,6 +157,12 @@ int main(int argc, char **argv) {
     char *out_dir = NULL;
     char *key_dir = NULL;
     char *key = NULL;
+    char *socket_path = NULL;
+    StatsFormat stats_format = STATS_NONE;
+    StreamStats stream_stats = {0};
+    ByteRange range;
+    CipherOptions options = {MODE_ECB, NULL, 0, 0, 0, NULL, 0, NULL};
+    int operation_mode_set = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-e") == 0) {
@@ -95,11 +174,71 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[i], "-t") == 0) {
             if (time_display != 0) error("-t can only be specified once.", NULL);
             time_display = 1;
+        } else if (strcmp(argv[i], "-engine") == 0) {
+            if (++i == argc) error("No engine name.", NULL);
+            if (!select_engine(argv[i])) error(": Engine not available.", argv[i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (operation_mode_set) error("Only one mode of operation can be specified.", NULL);
+            operation_mode_set = 1;
+            if (++i == argc) error("No mode of operation.", NULL);
+            if (strcmp(argv[i], "ecb") == 0) {
+                options.mode = MODE_ECB;
+            } else if (strcmp(argv[i], "ctr") == 0) {
+                options.mode = MODE_CTR;
+            } else if (strcmp(argv[i], "gcm") == 0) {
+                options.mode = MODE_GCM;
+            } else if (strcmp(argv[i], "cbc") == 0) {
+                options.mode = MODE_CBC;
+            } else if (strcmp(argv[i], "xts") == 0) {
+                options.mode = MODE_XTS;
+            } else if (strcmp(argv[i], "container") == 0) {
+                options.mode = MODE_CONTAINER;
+            } else {
+                error(": Unknown mode of operation.", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-iv") == 0) {
+            if (options.iv) error("-iv can only be specified once.", NULL);
+            if (++i == argc) error("No IV.", NULL);
+            options.iv = argv[i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (options.threads) error("-j can only be specified once.", NULL);
+            if (++i == argc) error("No thread count.", NULL);
+            char *end;
+            unsigned long threads = strtoul(argv[i], &end, 10);
+            if (*end || threads == 0 || threads > 1024) error(": Invalid thread count.", argv[i]);
+            options.threads = (unsigned)threads;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            if (options.buffer_size) error("-b can only be specified once.", NULL);
+            if (++i == argc) error("No buffer size.", NULL);
+            options.buffer_size = parse_size(argv[i]);
+            if (options.buffer_size < 4096 || options.buffer_size > ((size_t)1 << 30)) {
+                error(": Invalid buffer size. It should be between 4K and 1024M.", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-mmap") == 0) {
+            if (options.memory_map) error("-mmap can only be specified once.", NULL);
+            options.memory_map = 1;
+        } else if (strcmp(argv[i], "-unit") == 0) {
+            if (options.unit_size) error("-unit can only be specified once.", NULL);
+            if (++i == argc) error("No data unit size.", NULL);
+            options.unit_size = parse_size(argv[i]);
+            if (options.unit_size < 16 || options.unit_size % 16 || options.unit_size > ((size_t)1 << 24)) {
+                error(": Invalid data unit size. It should be a multiple of 16 up to 16M.", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-range") == 0) {
+            if (options.range) error("-range can only be specified once.", NULL);
+            if (++i == argc) error("No range.", NULL);
+            if (!parse_range(argv[i], &range)) error(": Invalid range.", argv[i]);
+            options.range = &range;
         } else if (strcmp(argv[i], "-s") == 0) {
             if (input_mode != INPUT_UNDEFINED) error("Only one input mode can be specified.", NULL);
             input_mode = HEX_STRING_INPUT;
             if (++i == argc) error("No input string.", NULL);
             in_str = argv[i];
+        } else if (strcmp(argv[i], "-S") == 0) {
+            if (input_mode != INPUT_UNDEFINED) error("Only one input mode can be specified.", NULL);
+            input_mode = HEX_BATCH_INPUT;
+            if (++i == argc) error("No input file.", NULL);
+            in_dir = argv[i];
         } else if (strcmp(argv[i], "-f") == 0) {
             if (input_mode != INPUT_UNDEFINED) error("Only one input mode can be specified.", NULL);
             input_mode = FILE_INPUT;
@@ -107,6 +246,13 @@ int main(int argc, char **argv) {
             in_dir = argv[i];
             if (++i == argc) error("No output file.", NULL);
             out_dir = argv[i];
+        } else if (strcmp(argv[i], "-F") == 0) {
+            if (input_mode != INPUT_UNDEFINED) error("Only one input mode can be specified.", NULL);
+            input_mode = TREE_INPUT;
+            if (++i == argc) error("No input directory.", NULL);
+            in_dir = argv[i];
+            if (++i == argc) error("No output directory.", NULL);
+            out_dir = argv[i];
         } else if (strcmp(argv[i], "-k") == 0) {
             if (key_mode != KEY_UNDEFINED) error("Only one key mode can be specified.", NULL);
             key_mode = KEY_STRING;
@@ -117,6 +263,23 @@ int main(int argc, char **argv) {
             key_mode = KEY_FILE;
             if (++i == argc) error("No key file.", NULL);
             key_dir = argv[i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            if (stats_format != STATS_NONE) error("--stats can only be specified once.", NULL);
+            if (++i == argc) error("No statistics format.", NULL);
+            if (strcmp(argv[i], "text") == 0) {
+                stats_format = STATS_TEXT;
+            } else if (strcmp(argv[i], "json") == 0) {
+                stats_format = STATS_JSON;
+            } else {
+                error(": Unknown statistics format.", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--legacy-key-order") == 0) {
+            if (options.legacy_key_order) error("--legacy-key-order can only be specified once.", NULL);
+            options.legacy_key_order = 1;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (socket_path) error("--serve can only be specified once.", NULL);
+            if (++i == argc) error("No socket path.", NULL);
+            socket_path = argv[i];
         } else if (strcmp(argv[i], "-h") == 0) {
             usage(basename, 0);
         } else if (strcmp(argv[i], "--help") == 0) {
@@ -126,9 +289,29 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (socket_path) {
+        // clients give the operation, mode, key and data with each request
+        if (mode != UNDEFINED || input_mode != INPUT_UNDEFINED || key_mode != KEY_UNDEFINED || operation_mode_set || options.iv ||
+            time_display || stats_format != STATS_NONE || options.buffer_size || options.memory_map || options.unit_size || options.range ||
+            options.legacy_key_order) {
+            error("--serve only takes -engine and -j.", NULL);
+        }
+        serve(socket_path, &options);
+    }
+
     if (mode == UNDEFINED) error("The cipher mode is not specified.", NULL);
     if (input_mode == INPUT_UNDEFINED) error("The input mode is not specified.", NULL);
     if (key_mode == KEY_UNDEFINED) error("The key mode is not specified.", NULL);
+    if ((options.mode == MODE_CTR || options.mode == MODE_GCM || options.mode == MODE_CBC) && !options.iv) error("The mode of operation requires an IV.", NULL);
+    if (options.mode == MODE_ECB && options.iv) error("ECB mode does not use an IV.", NULL);
+    if (options.mode == MODE_XTS && options.iv) error("XTS mode does not use an IV.", NULL);
+    if (options.mode == MODE_CONTAINER && options.iv) error("Container mode generates its own nonce.", NULL);
+    if (options.mode != MODE_XTS && options.mode != MODE_CONTAINER && options.unit_size) {
+        error("-unit is only used in XTS and container modes.", NULL);
+    }
+    if (options.range && ((options.mode != MODE_XTS && options.mode != MODE_CONTAINER) || mode != INVCIPHER || input_mode != FILE_INPUT)) {
+        error("-range is only used when decrypting a file in XTS or container mode.", NULL);
+    }
 
     if (key_mode == KEY_FILE) {
         key = read_from_file(key_dir);
@@ -137,7 +320,16 @@ int main(int argc, char **argv) {
     if (key_mode == KEY_FILE) free(key);
     unsigned Nb = 4;
     unsigned Nk;
-    switch (strlen(key_processed)) {
+    size_t key_length = strlen(key_processed);
+    if (options.mode == MODE_XTS) {
+        // the data key and the tweak key, of the same size
+        if (key_length != 64 && key_length != 128) {
+            free(key_processed);
+            error("Incorrect key length. XTS mode takes two 128-bit or two 256-bit keys.", NULL);
+        }
+        key_length /= 2;
+    }
+    switch (key_length) {
         case 32: {
             Nk = 4;
             break;
@@ -156,16 +348,33 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (time_display) options.stats = &stream_stats;
+    if (stats_format != STATS_NONE) {
+#if AES_STATS
+        stats_enable();
+#else
+        error("--stats is not available in this build.", NULL);
+#endif
+    }
+
     char *out = NULL;
     switch (input_mode) {
         case HEX_STRING_INPUT: {
-            out = cipher_hex(Nb, Nk, key_processed, in_str, (mode == CIPHER));
+            out = cipher_hex(Nb, Nk, key_processed, in_str, (mode == CIPHER), &options);
             printf("%s\n\n", out);
             free(out);
             break;
         }
+        case HEX_BATCH_INPUT: {
+            cipher_hex_batch(Nb, Nk, key_processed, in_dir, (mode == CIPHER), &options);
+            break;
+        }
         case FILE_INPUT: {
-            cipher_file(Nb, Nk, key_processed, in_dir, out_dir, (mode == CIPHER));
+            cipher_file(Nb, Nk, key_processed, in_dir, out_dir, (mode == CIPHER), &options);
+            break;
+        }
+        case TREE_INPUT: {
+            cipher_tree(Nb, Nk, key_processed, in_dir, out_dir, (mode == CIPHER), &options);
             break;
         }
         case INPUT_UNDEFINED: {
@@ -174,10 +383,21 @@ int main(int argc, char **argv) {
     }
 
     free(key_processed);
+    key_cache_clear();
 
-    clock_t end = clock();
+    const double end = get_monotonic_time();
+    // keep the standard output clean when it carries the file output
+    FILE *report = input_mode == HEX_BATCH_INPUT || (out_dir && strcmp(out_dir, "-") == 0) ? stderr : stdout;
+#if AES_STATS
+    if (stats_format != STATS_NONE) stats_report(report, stats_format == STATS_JSON);
+#endif
     if (time_display) {
-        printf("Time elapsed: %.3fs.\n\n", (double)(end - begin) / CLOCKS_PER_SEC);
+        if (stream_stats.wall_time > 0) {
+            fprintf(report, "Read: %.3fs, cipher: %.3fs, write: %.3fs in %.3fs (%s).\n",
+                    stream_stats.read_time, stream_stats.cipher_time, stream_stats.write_time,
+                    stream_stats.wall_time, stream_stats.pipelined ? "pipelined" : "serial");
+        }
+        fprintf(report, "Time elapsed: %.3fs.\n\n", end - begin);
     }
 
     return 0;
@@ -202,3 +422,34 @@ static char *read_from_file(const char *filename) {
 
     return out;
 }
+
+// Parses a size in bytes, optionally followed by K or M. Returns 0 if invalid.
+static size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str) return 0;
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        ++end;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        ++end;
+    }
+    if (*end || size > SIZE_MAX) return 0;
+    return (size_t)size;
+}
+
+// Parses "<offset>:<length>", each in bytes and optionally followed by K or M.
+// Returns 0 if invalid.
+static int parse_range(const char *str, ByteRange *range) {
+    const char *colon = strchr(str, ':');
+    if (!colon || colon == str) return 0;
+    char offset[32];
+    if ((size_t)(colon - str) >= sizeof(offset)) return 0;
+    memcpy(offset, str, colon - str);
+    offset[colon - str] = '\0';
+    // parse_size() takes 0 as invalid, which is a valid offset
+    range->offset = strcmp(offset, "0") == 0 ? 0 : parse_size(offset);
+    range->length = parse_size(colon + 1);
+    return (range->offset || strcmp(offset, "0") == 0) && range->length;
+}
@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+typedef struct ParallelJob {
+    ParallelTask *task;
+    void *context;
+    size_t n;
+    atomic_size_t next;
+} ParallelJob;
+
+typedef struct ParallelWorker {
+    ParallelJob *job;
+    unsigned id;
+} ParallelWorker;
+
+typedef struct WorkItem {
+    WorkTask *task;
+    void *context;
+} WorkItem;
+
+// A worker's own tasks. The owner takes the newest from the bottom, and
+// thieves take the oldest from the top.
+typedef struct WorkDeque {
+    pthread_mutex_t mutex;
+    WorkItem *items;
+    size_t top, bottom, capacity;  // items[top % capacity, bottom % capacity)
+} WorkDeque;
+
+struct WorkPool {
+    unsigned threads;
+    WorkDeque *deques;
+    atomic_size_t queued;   // tasks pushed but not yet taken
+    atomic_size_t pending;  // tasks pushed but not yet finished
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+};
+
+typedef struct PoolWorker {
+    WorkPool *pool;
+    unsigned id;
+} PoolWorker;
+
+static void *run_worker(void *arg);
+static int take_work(WorkPool *pool, unsigned worker, WorkItem *item);
+static void *run_pool_worker(void *arg);
+
+unsigned get_thread_count(unsigned requested) {
+    if (requested) return requested;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned)cores : 1;
+}
+
+// Runs task(context, worker, i) for every i in [0, n) on up to threads
+// threads (0 for one per processor). Indices are handed out in increasing
+// order; worker is in [0, threads) and unique among concurrent calls, so it
+// may index per-thread state. The calling thread acts as worker 0.
+void parallel_for(unsigned threads, size_t n, ParallelTask *task, void *context) {
+    threads = get_thread_count(threads);
+    if (threads > n) threads = (unsigned)n;
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; ++i) task(context, 0, i);
+        return;
+    }
+
+    ParallelJob job = {task, context, n};
+    atomic_init(&job.next, 0);
+
+    pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    ParallelWorker *workers = (ParallelWorker *)malloc(threads * sizeof(ParallelWorker));
+
+    unsigned started = 1;
+    for (; started < threads; ++started) {
+        workers[started] = (ParallelWorker){&job, started};
+        if (pthread_create(&ids[started], NULL, run_worker, &workers[started])) break;
+    }
+    workers[0] = (ParallelWorker){&job, 0};
+    run_worker(&workers[0]);
+
+    for (unsigned t = 1; t < started; ++t) {
+        pthread_join(ids[t], NULL);
+    }
+
+    free(ids);
+    free(workers);
+}
+
+static void *run_worker(void *arg) {
+    const ParallelWorker *worker = (const ParallelWorker *)arg;
+    ParallelJob *job = worker->job;
+    for (size_t i; (i = atomic_fetch_add(&job->next, 1)) < job->n;) {
+        job->task(job->context, worker->id, i);
+    }
+    return NULL;
+}
+
+WorkPool *work_pool_new(unsigned threads) {
+    WorkPool *pool = (WorkPool *)malloc(sizeof(WorkPool));
+    pool->threads = get_thread_count(threads);
+    pool->deques = (WorkDeque *)calloc(pool->threads, sizeof(WorkDeque));
+    for (unsigned t = 0; t < pool->threads; ++t) {
+        pthread_mutex_init(&pool->deques[t].mutex, NULL);
+    }
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->pending, 0);
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    return pool;
+}
+
+void work_pool_free(WorkPool *pool) {
+    for (unsigned t = 0; t < pool->threads; ++t) {
+        pthread_mutex_destroy(&pool->deques[t].mutex);
+        free(pool->deques[t].items);
+    }
+    pthread_mutex_destroy(&pool->idle_mutex);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->deques);
+    free(pool);
+}
+
+unsigned work_pool_threads(const WorkPool *pool) {
+    return pool->threads;
+}
+
+// Adds a task to the deque of the given worker. Tasks may push more tasks,
+// normally onto their own worker, where idle workers can steal them.
+void work_pool_push(WorkPool *pool, unsigned worker, WorkTask *task, void *context) {
+    // counted first, so that the pool cannot finish while the task is added
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+
+    WorkDeque *deque = &pool->deques[worker % pool->threads];
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom - deque->top == deque->capacity) {
+        const size_t capacity = deque->capacity ? 2 * deque->capacity : 64;
+        WorkItem *items = (WorkItem *)malloc(capacity * sizeof(WorkItem));
+        for (size_t i = deque->top; i < deque->bottom; ++i) {
+            items[i - deque->top] = deque->items[i % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+    deque->items[deque->bottom++ % deque->capacity] = (WorkItem){task, context};
+    pthread_mutex_unlock(&deque->mutex);
+
+    pthread_mutex_lock(&pool->idle_mutex);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+// Runs the pushed tasks, and any they push in turn, on the pool's threads
+// until none are left. The calling thread acts as worker 0.
+void work_pool_run(WorkPool *pool) {
+    pthread_t *ids = (pthread_t *)malloc(pool->threads * sizeof(pthread_t));
+    PoolWorker *workers = (PoolWorker *)malloc(pool->threads * sizeof(PoolWorker));
+
+    unsigned started = 1;
+    for (; started < pool->threads; ++started) {
+        workers[started] = (PoolWorker){pool, started};
+        if (pthread_create(&ids[started], NULL, run_pool_worker, &workers[started])) break;
+    }
+    workers[0] = (PoolWorker){pool, 0};
+    run_pool_worker(&workers[0]);
+
+    for (unsigned t = 1; t < started; ++t) {
+        pthread_join(ids[t], NULL);
+    }
+
+    free(ids);
+    free(workers);
+}
+
+// Takes the newest task of the worker's own deque, or else the oldest of
+// another's, starting with the next worker along.
+static int take_work(WorkPool *pool, unsigned worker, WorkItem *item) {
+    for (unsigned k = 0; k < pool->threads; ++k) {
+        WorkDeque *deque = &pool->deques[(worker + k) % pool->threads];
+        pthread_mutex_lock(&deque->mutex);
+        if (deque->top == deque->bottom) {
+            pthread_mutex_unlock(&deque->mutex);
+            continue;
+        }
+        *item = k == 0 ? deque->items[--deque->bottom % deque->capacity]
+                       : deque->items[deque->top++ % deque->capacity];
+        pthread_mutex_unlock(&deque->mutex);
+        atomic_fetch_sub(&pool->queued, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// Idle workers sleep until a task is pushed, and all leave once every task
+// has finished, as no more can be pushed then.
+static void *run_pool_worker(void *arg) {
+    const PoolWorker *worker = (const PoolWorker *)arg;
+    WorkPool *pool = worker->pool;
+    for (;;) {
+        WorkItem item;
+        if (take_work(pool, worker->id, &item)) {
+            item.task(pool, worker->id, item.context);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_mutex);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_mutex);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_mutex);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        const int done = atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_mutex);
+        if (done) return NULL;
+    }
+}
@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "io.h"
+#include "libaes.h"
+
+// Each request on a connection is answered before the next is read:
+//
+//     request   body length (4 bytes, little-endian), operation (0 to encrypt,
+//               1 to decrypt), mode (an AesMode: ECB or CTR), key length,
+//               IV length, key, IV, data
+//     response  body length (4 bytes, little-endian), status (an AesStatus),
+//               and the result, as long as the data, if the status is
+//               AES_SUCCESS
+//
+// Requests from all connections are queued, and each worker takes as many as
+// fit into a batch of SERVE_BATCH_BLOCKS blocks, so that small requests with
+// the same key share one call into the engine. Key schedules stay in the key
+// cache between requests.
+
+#define SERVE_BATCH_BLOCKS 1024
+#define SERVE_MAX_DATA ((size_t)1 << 24)
+#define SERVE_BACKLOG 64
+
+typedef struct ServeRequest {
+    int for_encryption;
+    AesMode mode;
+    unsigned Nk;
+    word key[MAX_NB];
+    byte iv[16];
+    byte *data;
+    size_t length;
+    int done;
+    struct ServeRequest *next;
+} ServeRequest;
+
+typedef struct Server {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    ServeRequest *head, *tail;
+} Server;
+
+typedef struct Connection {
+    Server *server;
+    int fd;
+} Connection;
+
+static const char *socket_path;
+
+static void *serve_worker(void *arg);
+static void *serve_connection(void *arg);
+static AesStatus read_request(int fd, ServeRequest *request, int *connected);
+static int write_response(int fd, AesStatus status, const byte data[], size_t length);
+static void cipher_batch(ServeRequest *batch[], size_t n, word buffer[]);
+static void cipher_request(ServeRequest *request);
+static int read_full(int fd, void *buffer, size_t length);
+static int write_full(int fd, const void *buffer, size_t length);
+static void stop_serving(int signal_number);
+
+static inline size_t request_blocks(const ServeRequest *request) {
+    return (request->length + 15) / 16;
+}
+
+// ECB decryption is the only request that needs the inverse cipher; CTR
+// requests of either direction encrypt counter blocks.
+static inline int uses_inverse(const ServeRequest *request) {
+    return request->mode == AES_ECB && !request->for_encryption;
+}
+
+// Listens on a Unix domain socket at path, which only the owner may connect
+// to, and answers requests until interrupted. Never returns.
+void serve(const char *path, const CipherOptions *options) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) error(": The socket path is too long.", path);
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) error(": Failed to create socket.", path);
+
+    // a socket left behind by an earlier server is replaced, but not one that
+    // a running server still accepts connections on
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+        const int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        const int refused = probe_fd >= 0 && connect(probe_fd, (const struct sockaddr *)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+        if (probe_fd >= 0) close(probe_fd);
+        if (!refused) {
+            close(listen_fd);
+            error(": A server is already listening on the socket.", path);
+        }
+        unlink(path);
+    }
+    const mode_t mask = umask(077);
+    const int bound = bind(listen_fd, (const struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listen_fd, SERVE_BACKLOG)) {
+        close(listen_fd);
+        error(": Failed to listen on socket.", path);
+    }
+
+    socket_path = path;
+    struct sigaction action = {.sa_handler = stop_serving};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // a client that goes away must not take the server with it
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    Server *server = (Server *)calloc(1, sizeof(Server));
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->queued, NULL);
+    pthread_cond_init(&server->finished, NULL);
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+    const unsigned threads = get_thread_count(options->threads);
+    for (unsigned t = 0; t < threads; ++t) {
+        pthread_t id;
+        if (pthread_create(&id, &detached, serve_worker, server)) error("Failed to start worker threads.", NULL);
+    }
+
+    for (;;) {
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error(": Failed to accept connection.", path);
+        }
+        Connection *connection = (Connection *)malloc(sizeof(Connection));
+        *connection = (Connection){server, fd};
+        pthread_t id;
+        if (pthread_create(&id, &detached, serve_connection, connection)) {
+            close(fd);
+            free(connection);
+        }
+    }
+}
+
+static void stop_serving(int signal_number) {
+    (void)signal_number;
+    unlink(socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+// Takes whole requests from the queue until a batch is full. A request larger
+// than a batch is taken on its own, and ciphered in place.
+static void *serve_worker(void *arg) {
+    Server *server = (Server *)arg;
+    word *buffer = (word *)alloc_buffer(SERVE_BATCH_BLOCKS * 16);
+    ServeRequest *batch[SERVE_BATCH_BLOCKS];
+
+    for (;;) {
+        pthread_mutex_lock(&server->mutex);
+        while (!server->head) pthread_cond_wait(&server->queued, &server->mutex);
+        size_t n = 0, blocks = 0;
+        while (server->head && blocks < SERVE_BATCH_BLOCKS) {
+            ServeRequest *request = server->head;
+            if (n && blocks + request_blocks(request) > SERVE_BATCH_BLOCKS) break;
+            server->head = request->next;
+            batch[n++] = request;
+            blocks += request_blocks(request);
+        }
+        if (!server->head) server->tail = NULL;
+        pthread_mutex_unlock(&server->mutex);
+
+        if (blocks > SERVE_BATCH_BLOCKS) {
+            cipher_request(batch[0]);
+        } else {
+            cipher_batch(batch, n, buffer);
+        }
+
+        pthread_mutex_lock(&server->mutex);
+        for (size_t i = 0; i < n; ++i) batch[i]->done = 1;
+        pthread_cond_broadcast(&server->finished);
+        pthread_mutex_unlock(&server->mutex);
+    }
+    return NULL;
+}
+
+// Answers the requests on a connection one at a time, until it is closed or
+// a request cannot be read.
+static void *serve_connection(void *arg) {
+    Connection connection = *(Connection *)arg;
+    free(arg);
+    Server *server = connection.server;
+
+    for (;;) {
+        ServeRequest request = {0};
+        int connected;
+        const AesStatus status = read_request(connection.fd, &request, &connected);
+        if (!connected) {
+            free(request.data);
+            break;
+        }
+
+        if (status == AES_SUCCESS && request.length) {
+            pthread_mutex_lock(&server->mutex);
+            if (server->tail) {
+                server->tail->next = &request;
+            } else {
+                server->head = &request;
+            }
+            server->tail = &request;
+            pthread_cond_signal(&server->queued);
+            while (!request.done) pthread_cond_wait(&server->finished, &server->mutex);
+            pthread_mutex_unlock(&server->mutex);
+        }
+
+        const int sent = write_response(connection.fd, status, request.data, status == AES_SUCCESS ? request.length : 0);
+        volatile word *key = request.key;
+        for (unsigned i = 0; i < MAX_NB; ++i) key[i] = 0;
+        free(request.data);
+        if (!sent) break;
+    }
+    close(connection.fd);
+    return NULL;
+}
+
+// Reads a whole request, so that the connection stays in step even when the
+// request is invalid. connected is cleared if the connection is closed or the
+// request is too long to read.
+static AesStatus read_request(int fd, ServeRequest *request, int *connected) {
+    byte header[8], fields[510];
+    *connected = 0;
+    if (!read_full(fd, header, sizeof(header))) return AES_INVALID_ARGUMENT;
+    const size_t length = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+    const size_t key_length = header[6], iv_length = header[7];
+    if (length < 4 + key_length + iv_length || length - 4 - key_length - iv_length > SERVE_MAX_DATA) {
+        // the rest of the request cannot be skipped safely, so the
+        // connection is answered and then closed
+        write_response(fd, AES_INVALID_LENGTH, NULL, 0);
+        return AES_INVALID_LENGTH;
+    }
+    request->length = length - 4 - key_length - iv_length;
+    request->data = (byte *)malloc(request->length + 1);
+    if (!read_full(fd, fields, key_length + iv_length) || !read_full(fd, request->data, request->length)) {
+        return AES_INVALID_ARGUMENT;
+    }
+    *connected = 1;
+
+    request->for_encryption = header[4] == 0;
+    request->mode = (AesMode)header[5];
+    if (header[4] > 1) return AES_INVALID_ARGUMENT;
+    if (request->mode != AES_ECB && request->mode != AES_CTR) return AES_INVALID_MODE;
+    if (key_length != 16 && key_length != 24 && key_length != 32) return AES_INVALID_KEY;
+    if (iv_length != (request->mode == AES_CTR ? 16 : 0)) return AES_INVALID_IV;
+    if (request->mode == AES_ECB && request->length % 16) return AES_INVALID_LENGTH;
+
+    request->Nk = (unsigned)key_length / 4;
+    memcpy(request->key, fields, key_length);
+    memcpy(request->iv, fields + key_length, iv_length);
+    volatile byte *copy = fields;
+    for (size_t i = 0; i < key_length; ++i) copy[i] = 0;
+    return AES_SUCCESS;
+}
+
+static int write_response(int fd, AesStatus status, const byte data[], size_t length) {
+    byte header[5];
+    const size_t body_length = length + 1;
+    for (unsigned i = 0; i < 4; ++i) header[i] = (byte)(body_length >> (8 * i));
+    header[4] = (byte)status;
+    return write_full(fd, header, sizeof(header)) && write_full(fd, data, length);
+}
+
+// Gathers the blocks of every request with the same key and direction into
+// buffer[], runs the engine over them at once, and scatters the results:
+// data blocks for ECB, and counter blocks for CTR, whose keystream is then
+// applied to the data.
+static void cipher_batch(ServeRequest *batch[], size_t n, word buffer[]) {
+    byte group[SERVE_BATCH_BLOCKS] = {0};
+    byte *bytes = (byte *)buffer;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (group[i]) continue;
+        const ServeRequest *first = batch[i];
+        const int inverse = uses_inverse(first);
+
+        size_t blocks = 0;
+        for (size_t j = i; j < n; ++j) {
+            const ServeRequest *request = batch[j];
+            if (group[j] || request->Nk != first->Nk || uses_inverse(request) != inverse ||
+                memcmp(request->key, first->key, 4 * first->Nk) != 0) {
+                continue;
+            }
+            group[j] = 1;
+            if (request->mode == AES_CTR) {
+                ctr_counters(4, request->iv, 0, request_blocks(request), bytes + 16 * blocks);
+            } else {
+                memcpy(bytes + 16 * blocks, request->data, request->length);
+            }
+            blocks += request_blocks(request);
+        }
+        KeySchedule schedule;
+        key_cache_expand(4, first->Nk + 6, first->key, first->Nk, &schedule);
+        if (inverse) {
+            InvCipherBlocks(4, schedule.Nr, blocks, buffer, buffer, &schedule);
+        } else {
+            CipherBlocks(4, schedule.Nr, blocks, buffer, buffer, &schedule);
+        }
+
+        blocks = 0;
+        for (size_t j = i; j < n; ++j) {
+            ServeRequest *request = batch[j];
+            // members of this group are marked 1, and of earlier ones 2
+            if (group[j] != 1) continue;
+            group[j] = 2;
+            if (request->mode == AES_CTR) {
+                const byte *stream = bytes + 16 * blocks;
+                for (size_t k = 0; k < request->length; ++k) request->data[k] ^= stream[k];
+            } else {
+                memcpy(request->data, bytes + 16 * blocks, request->length);
+            }
+            blocks += request_blocks(request);
+        }
+    }
+}
+
+static void cipher_request(ServeRequest *request) {
+    KeySchedule schedule;
+    key_cache_expand(4, request->Nk + 6, request->key, request->Nk, &schedule);
+    if (request->mode == AES_CTR) {
+        ctr_blocks(4, schedule.Nr, &schedule, request->iv, 0, request->length, request->data, request->data);
+    } else if (request->for_encryption) {
+        CipherBlocks(4, schedule.Nr, request->length / 16, (const word *)request->data, (word *)request->data, &schedule);
+    } else {
+        InvCipherBlocks(4, schedule.Nr, request->length / 16, (const word *)request->data, (word *)request->data, &schedule);
+    }
+}
+
+static int read_full(int fd, void *buffer, size_t length) {
+    byte *p = (byte *)buffer;
+    while (length) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        length -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buffer, size_t length) {
+    const byte *p = (const byte *)buffer;
+    while (length) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        length -= (size_t)n;
+    }
+    return 1;
+}
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "aes.h"
+#include "io.h"
+
+#if AES_STATS
+
+// Threads record into slots of their own, so that the counters are not
+// shared; any threads beyond the last slot share it.
+#define STATS_SLOTS 64
+
+typedef struct StatsSlot {
+    _Alignas(64) atomic_uint_fast64_t calls[STATS_STAGES];
+    atomic_uint_fast64_t bytes[STATS_STAGES];
+    atomic_uint_fast64_t wall_ns[STATS_STAGES];
+    atomic_uint_fast64_t cpu_ns[STATS_STAGES];
+    atomic_uint_fast64_t blocks;  // ciphered, of 16 bytes
+} StatsSlot;
+
+int stats_enabled = 0;
+
+static StatsSlot slots[STATS_SLOTS];
+static atomic_uint slot_count;
+static _Thread_local int thread_slot = -1;
+static double start_wall_time, start_cpu_time;
+
+static const char *const stage_names[STATS_STAGES] = {"key", "read", "cipher", "write"};
+
+// a snapshot of one slot, or the sum of all
+typedef struct StatsCounts {
+    uint64_t calls[STATS_STAGES];
+    uint64_t bytes[STATS_STAGES];
+    uint64_t wall_ns[STATS_STAGES];
+    uint64_t cpu_ns[STATS_STAGES];
+    uint64_t blocks;
+} StatsCounts;
+
+static double get_clock(clockid_t clock);
+static void add_counts(const StatsSlot *slot, StatsCounts *counts);
+static void print_text_stages(FILE *file, const StatsCounts *counts);
+static void print_json_stages(FILE *file, const StatsCounts *counts);
+
+// Starts counting. Called once, before any other threads start.
+void stats_enable(void) {
+    stats_enabled = 1;
+    start_wall_time = get_monotonic_time();
+    start_cpu_time = get_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_start_timer(StatsTimer *timer) {
+    timer->wall_time = get_monotonic_time();
+    timer->cpu_time = get_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// Adds the time since stats_start_timer() and bytes to the stage, both for
+// the calling thread.
+void stats_stop_timer(const StatsTimer *timer, StatsStage stage, uint64_t bytes) {
+    const double wall_time = get_monotonic_time() - timer->wall_time;
+    const double cpu_time = get_clock(CLOCK_THREAD_CPUTIME_ID) - timer->cpu_time;
+    if (thread_slot < 0) {
+        const unsigned slot = atomic_fetch_add(&slot_count, 1);
+        thread_slot = slot < STATS_SLOTS ? (int)slot : STATS_SLOTS - 1;
+    }
+    StatsSlot *slot = &slots[thread_slot];
+    atomic_fetch_add_explicit(&slot->calls[stage], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->bytes[stage], bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->wall_ns[stage], (uint64_t)(wall_time * 1e9), memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->cpu_ns[stage], (uint64_t)(cpu_time * 1e9), memory_order_relaxed);
+    if (stage == STATS_CIPHER) atomic_fetch_add_explicit(&slot->blocks, (bytes + 15) / 16, memory_order_relaxed);
+}
+
+// Prints the totals of each stage over all threads, the key cache counters,
+// and then the stages of each thread. Stage times are summed over threads, so
+// with several threads they may add up to more than the wall time.
+void stats_report(FILE *file, int json) {
+    const double wall_time = get_monotonic_time() - start_wall_time;
+    const double cpu_time = get_clock(CLOCK_PROCESS_CPUTIME_ID) - start_cpu_time;
+    unsigned threads = atomic_load(&slot_count);
+    if (threads > STATS_SLOTS) threads = STATS_SLOTS;
+
+    StatsCounts sum = {0};
+    for (unsigned t = 0; t < threads; ++t) add_counts(&slots[t], &sum);
+    KeyCacheStats cache;
+    key_cache_get_stats(&cache);
+
+    if (json) {
+        fprintf(file, "{\"wall_time\": %.6f, \"cpu_time\": %.6f, ", wall_time, cpu_time);
+        print_json_stages(file, &sum);
+        fprintf(file, ", \"key_cache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}",
+                (unsigned long long)cache.hits, (unsigned long long)cache.misses, (unsigned long long)cache.evictions);
+        fprintf(file, ", \"threads\": [");
+        for (unsigned t = 0; t < threads; ++t) {
+            StatsCounts counts = {0};
+            add_counts(&slots[t], &counts);
+            fprintf(file, "%s{", t ? ", " : "");
+            print_json_stages(file, &counts);
+            fprintf(file, "}");
+        }
+        fprintf(file, "]}\n");
+        return;
+    }
+
+    fprintf(file, "Wall time: %.3fs, CPU time: %.3fs, threads: %u.\n", wall_time, cpu_time, threads);
+    print_text_stages(file, &sum);
+    fprintf(file, "Key cache: %llu hits, %llu misses, %llu evictions.\n", (unsigned long long)cache.hits,
+            (unsigned long long)cache.misses, (unsigned long long)cache.evictions);
+    for (unsigned t = 0; t < threads; ++t) {
+        StatsCounts counts = {0};
+        add_counts(&slots[t], &counts);
+        fprintf(file, "Thread %u:\n", t);
+        print_text_stages(file, &counts);
+    }
+}
+
+static double get_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void add_counts(const StatsSlot *slot, StatsCounts *counts) {
+    for (unsigned s = 0; s < STATS_STAGES; ++s) {
+        counts->calls[s] += atomic_load_explicit(&slot->calls[s], memory_order_relaxed);
+        counts->bytes[s] += atomic_load_explicit(&slot->bytes[s], memory_order_relaxed);
+        counts->wall_ns[s] += atomic_load_explicit(&slot->wall_ns[s], memory_order_relaxed);
+        counts->cpu_ns[s] += atomic_load_explicit(&slot->cpu_ns[s], memory_order_relaxed);
+    }
+    counts->blocks += atomic_load_explicit(&slot->blocks, memory_order_relaxed);
+}
+
+static void print_text_stages(FILE *file, const StatsCounts *counts) {
+    fprintf(file, "    %-8s %10s %14s %10s %10s %10s\n", "stage", "calls", "bytes", "wall", "cpu", "MB/s");
+    for (unsigned s = 0; s < STATS_STAGES; ++s) {
+        const double wall_time = counts->wall_ns[s] / 1e9;
+        fprintf(file, "    %-8s %10llu %14llu %9.3fs %9.3fs", stage_names[s], (unsigned long long)counts->calls[s],
+                (unsigned long long)counts->bytes[s], wall_time, counts->cpu_ns[s] / 1e9);
+        // the bytes of key setup are those of the keys
+        if (s != STATS_KEY && wall_time > 0) fprintf(file, " %10.1f", counts->bytes[s] / wall_time / 1e6);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "    %llu blocks ciphered.\n", (unsigned long long)counts->blocks);
+}
+
+static void print_json_stages(FILE *file, const StatsCounts *counts) {
+    fprintf(file, "\"blocks\": %llu, \"stages\": {", (unsigned long long)counts->blocks);
+    for (unsigned s = 0; s < STATS_STAGES; ++s) {
+        fprintf(file, "%s\"%s\": {\"calls\": %llu, \"bytes\": %llu, \"wall_time\": %.6f, \"cpu_time\": %.6f}",
+                s ? ", " : "", stage_names[s], (unsigned long long)counts->calls[s], (unsigned long long)counts->bytes[s],
+                counts->wall_ns[s] / 1e9, counts->cpu_ns[s] / 1e9);
+    }
+    fprintf(file, "}");
+}
+
+#endif
@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aes.h"
+#include "io.h"
+
+// number of buffers in the ring between the reader, cipher and writer stages
+#define PIPELINE_DEPTH 4
+
+// room left after each buffer for a transform to append a block of padding
+#define STREAM_RESERVE 32
+
+typedef struct StreamSlot {
+    byte *data;
+    size_t length;
+    int last;
+} StreamSlot;
+
+typedef struct Pipeline {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    StreamSlot slots[PIPELINE_DEPTH];
+    // number of slots each stage has finished with so far
+    size_t read_count;
+    size_t cipher_count;
+    size_t write_count;
+    FileStatus status;
+    FILE *in_file;
+    FILE *out_file;
+    size_t capacity;
+    double read_time;
+    double write_time;
+} Pipeline;
+
+static FileStatus read_chunk(FILE *file, byte buffer[], size_t capacity, size_t *length, int *last);
+static FileStatus serial_stream(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, StreamStats *stats);
+static FileStatus pipelined_stream(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, StreamStats *stats);
+static void fail_pipeline(Pipeline *pipeline, FileStatus status);
+static void *pipeline_reader(void *arg);
+static void *pipeline_writer(void *arg);
+static void destroy_pipeline(Pipeline *pipeline);
+
+double get_monotonic_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Passes the input through transform() one buffer of capacity bytes at a time,
+// and writes the result. Every buffer but the last is full. If pipelined, the
+// input is read and the output is written on two more threads, overlapping
+// with the transform. Time spent in each stage is added to stats if given.
+FileStatus stream_file(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, int pipelined, StreamStats *stats) {
+    const double begin = get_monotonic_time();
+    FileStatus status = pipelined ? pipelined_stream(in_file, out_file, capacity, transform, context, stats)
+                                  : serial_stream(in_file, out_file, capacity, transform, context, stats);
+    if (stats) {
+        stats->wall_time += get_monotonic_time() - begin;
+        stats->pipelined = pipelined;
+    }
+    return status;
+}
+
+// Fills the buffer unless the input ends first. The end is detected by peeking
+// one character ahead, so that the last buffer is known as such even when the
+// input size is a multiple of capacity.
+static FileStatus read_chunk(FILE *file, byte buffer[], size_t capacity, size_t *length, int *last) {
+    *length = fread(buffer, sizeof(byte), capacity, file);
+    if (*length == capacity) {
+        int c = getc(file);
+        *last = c == EOF;
+        if (c != EOF) ungetc(c, file);
+    } else {
+        *last = 1;
+    }
+    return ferror(file) ? FILE_READ_ERROR : FILE_SUCCESS;
+}
+
+static FileStatus serial_stream(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, StreamStats *stats) {
+    byte *buffer = (byte *)alloc_buffer(capacity + STREAM_RESERVE);
+    double read_time = 0, cipher_time = 0, write_time = 0;
+    FileStatus status;
+
+    for (;;) {
+        size_t length;
+        int last;
+        StatsTimer timer;
+
+        double t = get_monotonic_time();
+        stats_start(&timer);
+        status = read_chunk(in_file, buffer, capacity, &length, &last);
+        stats_stop(&timer, STATS_READ, length);
+        read_time += get_monotonic_time() - t;
+        if (status != FILE_SUCCESS) break;
+
+        t = get_monotonic_time();
+        stats_start(&timer);
+        const size_t in_length = length;
+        status = transform(context, buffer, &length, last);
+        stats_stop(&timer, STATS_CIPHER, in_length);
+        cipher_time += get_monotonic_time() - t;
+        if (status != FILE_SUCCESS) break;
+
+        t = get_monotonic_time();
+        stats_start(&timer);
+        if (fwrite(buffer, sizeof(byte), length, out_file) != length) status = FILE_WRITE_ERROR;
+        stats_stop(&timer, STATS_WRITE, length);
+        write_time += get_monotonic_time() - t;
+        if (status != FILE_SUCCESS || last) break;
+    }
+
+    free(buffer);
+    if (stats) {
+        stats->read_time += read_time;
+        stats->cipher_time += cipher_time;
+        stats->write_time += write_time;
+    }
+    return status;
+}
+
+// Records the first failure and wakes every stage so that they stop.
+static void fail_pipeline(Pipeline *pipeline, FileStatus status) {
+    if (pipeline->status == FILE_SUCCESS) pipeline->status = status;
+    pthread_cond_broadcast(&pipeline->changed);
+}
+
+static void *pipeline_reader(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    for (size_t i = 0;; ++i) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (i - pipeline->write_count >= PIPELINE_DEPTH && pipeline->status == FILE_SUCCESS) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        const int stopped = pipeline->status != FILE_SUCCESS;
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (stopped) break;
+
+        StreamSlot *slot = &pipeline->slots[i % PIPELINE_DEPTH];
+        size_t length;
+        int last;
+        StatsTimer timer;
+        const double t = get_monotonic_time();
+        stats_start(&timer);
+        FileStatus status = read_chunk(pipeline->in_file, slot->data, pipeline->capacity, &length, &last);
+        stats_stop(&timer, STATS_READ, length);
+        pipeline->read_time += get_monotonic_time() - t;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        if (status != FILE_SUCCESS) {
+            fail_pipeline(pipeline, status);
+        } else {
+            slot->length = length;
+            slot->last = last;
+            pipeline->read_count = i + 1;
+            pthread_cond_broadcast(&pipeline->changed);
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (status != FILE_SUCCESS || last) break;
+    }
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+    for (size_t i = 0;; ++i) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (i >= pipeline->cipher_count && pipeline->status == FILE_SUCCESS) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        const int stopped = pipeline->status != FILE_SUCCESS;
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (stopped) break;
+
+        const StreamSlot *slot = &pipeline->slots[i % PIPELINE_DEPTH];
+        const int last = slot->last;
+        StatsTimer timer;
+        const double t = get_monotonic_time();
+        stats_start(&timer);
+        const int written = fwrite(slot->data, sizeof(byte), slot->length, pipeline->out_file) == slot->length;
+        stats_stop(&timer, STATS_WRITE, slot->length);
+        pipeline->write_time += get_monotonic_time() - t;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        if (!written) {
+            fail_pipeline(pipeline, FILE_WRITE_ERROR);
+        } else {
+            pipeline->write_count = i + 1;
+            pthread_cond_broadcast(&pipeline->changed);
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (!written || last) break;
+    }
+    return NULL;
+}
+
+static void destroy_pipeline(Pipeline *pipeline) {
+    for (unsigned i = 0; i < PIPELINE_DEPTH; ++i) {
+        free(pipeline->slots[i].data);
+    }
+    pthread_mutex_destroy(&pipeline->mutex);
+    pthread_cond_destroy(&pipeline->changed);
+}
+
+// The calling thread runs the cipher stage between a reader and a writer
+// thread, which pass buffers around a ring of PIPELINE_DEPTH slots. Falls back
+// to the serial loop if the threads cannot be created.
+static FileStatus pipelined_stream(FILE *in_file, FILE *out_file, size_t capacity, StreamTransform *transform, void *context, StreamStats *stats) {
+    Pipeline pipeline = {.in_file = in_file, .out_file = out_file, .capacity = capacity, .status = FILE_SUCCESS};
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    for (unsigned i = 0; i < PIPELINE_DEPTH; ++i) {
+        pipeline.slots[i].data = (byte *)alloc_buffer(capacity + STREAM_RESERVE);
+    }
+
+    pthread_t reader, writer;
+    if (pthread_create(&writer, NULL, pipeline_writer, &pipeline) != 0) {
+        destroy_pipeline(&pipeline);
+        return serial_stream(in_file, out_file, capacity, transform, context, stats);
+    }
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipeline) != 0) {
+        // nothing has been read yet, so the writer can be stopped and discarded
+        pthread_mutex_lock(&pipeline.mutex);
+        fail_pipeline(&pipeline, FILE_READ_ERROR);
+        pthread_mutex_unlock(&pipeline.mutex);
+        pthread_join(writer, NULL);
+        destroy_pipeline(&pipeline);
+        return serial_stream(in_file, out_file, capacity, transform, context, stats);
+    }
+
+    double cipher_time = 0;
+    for (size_t i = 0;; ++i) {
+        pthread_mutex_lock(&pipeline.mutex);
+        while (i >= pipeline.read_count && pipeline.status == FILE_SUCCESS) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.mutex);
+        }
+        const int stopped = pipeline.status != FILE_SUCCESS;
+        pthread_mutex_unlock(&pipeline.mutex);
+        if (stopped) break;
+
+        StreamSlot *slot = &pipeline.slots[i % PIPELINE_DEPTH];
+        const int last = slot->last;
+        const size_t length = slot->length;
+        StatsTimer timer;
+        const double t = get_monotonic_time();
+        stats_start(&timer);
+        FileStatus status = transform(context, slot->data, &slot->length, last);
+        stats_stop(&timer, STATS_CIPHER, length);
+        cipher_time += get_monotonic_time() - t;
+
+        pthread_mutex_lock(&pipeline.mutex);
+        if (status != FILE_SUCCESS) {
+            fail_pipeline(&pipeline, status);
+        } else {
+            pipeline.cipher_count = i + 1;
+            pthread_cond_broadcast(&pipeline.changed);
+        }
+        pthread_mutex_unlock(&pipeline.mutex);
+        if (status != FILE_SUCCESS || last) break;
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    destroy_pipeline(&pipeline);
+
+    if (stats) {
+        stats->read_time += pipeline.read_time;
+        stats->cipher_time += cipher_time;
+        stats->write_time += pipeline.write_time;
+    }
+    return pipeline.status;
+}
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "io.h"
+
+typedef struct TreeWalk {
+    FileList *list;
+    dev_t out_dev;  // the output directory, which is never walked
+    ino_t out_ino;
+} TreeWalk;
+
+static void add_path(TreeWalk *walk, const char *in_path, const char *out_path);
+static void add_file(FileList *list, const char *in_path, const char *out_path, off_t size);
+static void add_list(TreeWalk *walk, const char *list_dir, const char *out_dir);
+static char *join_path(const char *dir, const char *name);
+static const char *relative_path(const char *path);
+static void make_directories(const char *path);
+
+// Lists the files to cipher for in, and creates out_dir and the directories
+// under it for their output. in is a directory, whose tree is mirrored in
+// out_dir; a file, which is written to out_dir under its own name; or "@"
+// followed by a file listing paths a line each ("@-" for the standard input),
+// each of which is mirrored in out_dir under its relative path.
+void list_files(const char *in, const char *out_dir, FileList *list) {
+    *list = (FileList){0};
+    make_directories(out_dir);
+
+    struct stat out_stat;
+    if (stat(out_dir, &out_stat)) error(": Failed to open output directory.", out_dir);
+    TreeWalk walk = {list, out_stat.st_dev, out_stat.st_ino};
+
+    if (in[0] == '@') {
+        add_list(&walk, in + 1, out_dir);
+        return;
+    }
+    struct stat in_stat;
+    if (stat(in, &in_stat)) error(": Failed to open input file.", in);
+    if (S_ISDIR(in_stat.st_mode)) {
+        if (in_stat.st_dev == walk.out_dev && in_stat.st_ino == walk.out_ino) {
+            error(": The output directory must differ from the input directory.", out_dir);
+        }
+        add_path(&walk, in, out_dir);
+    } else {
+        const char *name = strrchr(in, '/');
+        char *out_path = join_path(out_dir, name ? name + 1 : in);
+        add_path(&walk, in, out_path);
+        free(out_path);
+    }
+}
+
+void free_file_list(FileList *list) {
+    for (size_t i = 0; i < list->count; ++i) {
+        free(list->entries[i].in_path);
+        free(list->entries[i].out_path);
+    }
+    free(list->entries);
+    *list = (FileList){0};
+}
+
+// Symbolic links to files are followed; those to directories are not, so
+// that the walk cannot loop. Other kinds of files are skipped.
+static void add_path(TreeWalk *walk, const char *in_path, const char *out_path) {
+    struct stat in_stat;
+    if (lstat(in_path, &in_stat)) error(": Failed to open input file.", in_path);
+    if (S_ISLNK(in_stat.st_mode)) {
+        if (stat(in_path, &in_stat) || !S_ISREG(in_stat.st_mode)) return;
+    }
+
+    if (S_ISREG(in_stat.st_mode)) {
+        add_file(walk->list, in_path, out_path, in_stat.st_size);
+        return;
+    }
+    if (!S_ISDIR(in_stat.st_mode)) return;
+    if (in_stat.st_dev == walk->out_dev && in_stat.st_ino == walk->out_ino) return;
+
+    DIR *dir = opendir(in_path);
+    if (!dir) error(": Failed to open input directory.", in_path);
+    make_directories(out_path);
+    for (struct dirent *entry; (entry = readdir(dir));) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char *in_child = join_path(in_path, entry->d_name);
+        char *out_child = join_path(out_path, entry->d_name);
+        add_path(walk, in_child, out_child);
+        free(in_child);
+        free(out_child);
+    }
+    closedir(dir);
+}
+
+static void add_file(FileList *list, const char *in_path, const char *out_path, off_t size) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->entries = (FileEntry *)realloc(list->entries, list->capacity * sizeof(FileEntry));
+        if (!list->entries) error("Out of memory.", NULL);
+    }
+    FileEntry *entry = &list->entries[list->count++];
+    entry->in_path = strdup(in_path);
+    entry->out_path = strdup(out_path);
+    entry->size = size;
+}
+
+static void add_list(TreeWalk *walk, const char *list_dir, const char *out_dir) {
+    FILE *file = strcmp(list_dir, "-") == 0 ? stdin : fopen(list_dir, "r");
+    if (!file) error(": Failed to open file.", list_dir);
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, file)) >= 0) {
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length == 0) continue;
+        char *out_path = join_path(out_dir, relative_path(line));
+        // the directories above a listed path are not walked, so they are
+        // created here
+        char *parent = strrchr(out_path, '/');
+        *parent = '\0';
+        make_directories(out_path);
+        *parent = '/';
+        add_path(walk, line, out_path);
+        free(out_path);
+    }
+    free(line);
+    if (file != stdin) fclose(file);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    const size_t dir_length = strlen(dir), name_length = strlen(name);
+    const int separator = dir_length && dir[dir_length - 1] != '/';
+    char *path = (char *)malloc(dir_length + separator + name_length + 1);
+    memcpy(path, dir, dir_length);
+    if (separator) path[dir_length] = '/';
+    memcpy(path + dir_length + separator, name, name_length + 1);
+    return path;
+}
+
+// Drops leading "/" and "./" so that the path stays within the output
+// directory. Paths that could leave it through ".." are rejected.
+static const char *relative_path(const char *path) {
+    for (const char *p = path; *p;) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            error(": Listed paths may not contain \"..\".", path);
+        }
+        const char *slash = strchr(p, '/');
+        if (!slash) break;
+        p = slash + 1;
+    }
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) path += path[0] == '/' ? 1 : 2;
+    return path;
+}
+
+// Creates path and any missing directories above it.
+static void make_directories(const char *path) {
+    if (!*path) error("No output directory.", NULL);
+    char *copy = strdup(path);
+    for (char *p = copy + 1;; ++p) {
+        if (*p != '/' && *p != '\0') continue;
+        const char c = *p;
+        *p = '\0';
+        struct stat dir_stat;
+        if (mkdir(copy, 0777) && (errno != EEXIST || stat(copy, &dir_stat) || !S_ISDIR(dir_stat.st_mode))) {
+            free(copy);
+            error(": Failed to create output directory.", path);
+        }
+        *p = c;
+        if (c == '\0') break;
+    }
+    free(copy);
+}
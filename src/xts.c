@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XTS_SSE2 1
+#include <emmintrin.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#else
+#define XTS_SSE2 0
+#endif
+
+// number of blocks whitened and encrypted per engine call
+#define XTS_BATCH 64
+
+static void xts_unit(unsigned Nr, const XtsKey *key, uint64_t unit, size_t length, const byte in[], byte out[], int for_encryption);
+static void xts_batch(unsigned Nr, const KeySchedule *key, size_t n, const byte tweaks[], const byte in[], byte out[], int for_encryption);
+static void make_tweaks(byte tweak[], size_t n, byte out[]);
+
+// Encrypts or decrypts length bytes from in[] into out[], which may alias, in
+// XTS mode (IEEE 1619), as consecutive data units of unit_size bytes numbered
+// from unit. Every data unit, including a shorter last one, must be at least
+// one block long; the last is completed with ciphertext stealing.
+void xts_units(unsigned Nr, const XtsKey *key, uint64_t unit, size_t unit_size, size_t length, const byte in[], byte out[], int for_encryption) {
+    while (length) {
+        const size_t unit_length = length < unit_size ? length : unit_size;
+        xts_unit(Nr, key, unit++, unit_length, in, out, for_encryption);
+        in += unit_length;
+        out += unit_length;
+        length -= unit_length;
+    }
+}
+
+static void xts_unit(unsigned Nr, const XtsKey *key, uint64_t unit, size_t length, const byte in[], byte out[], int for_encryption) {
+    // the tweak is the encrypted data unit number, as a little-endian integer
+    word tweak_block[4] = {0};
+    byte *tweak = (byte *)tweak_block;
+    for (unsigned i = 0; i < 8; ++i) tweak[i] = (byte)(unit >> (8 * i));
+    CipherBlocks(4, Nr, 1, tweak_block, tweak_block, &key->tweak);
+
+    const size_t blocks = length / 16, partial = length % 16;
+    // with ciphertext stealing, the last whole block is done separately
+    size_t plain = partial ? blocks - 1 : blocks;
+    byte tweaks[XTS_BATCH * 16];
+    while (plain) {
+        const size_t n = plain < XTS_BATCH ? plain : XTS_BATCH;
+        make_tweaks(tweak, n, tweaks);
+        xts_batch(Nr, &key->data, n, tweaks, in, out, for_encryption);
+        in += 16 * n;
+        out += 16 * n;
+        plain -= n;
+    }
+    if (!partial) return;
+
+    // IEEE 1619 5.3.2: the last whole block takes the tail of the partial
+    // block, and gives it the head of its own result. Decryption uses the
+    // two tweaks the other way round.
+    byte last_tweaks[32], block[16];
+    make_tweaks(tweak, 2, last_tweaks);
+    const byte *first_tweak = last_tweaks + (for_encryption ? 0 : 16);
+    const byte *second_tweak = last_tweaks + (for_encryption ? 16 : 0);
+
+    xts_batch(Nr, &key->data, 1, first_tweak, in, block, for_encryption);
+    byte tail[16];
+    memcpy(tail, in + 16, partial);
+    memcpy(out + 16, block, partial);
+    memcpy(block, tail, partial);
+    xts_batch(Nr, &key->data, 1, second_tweak, block, out, for_encryption);
+}
+
+// out = E(in ^ tweak) ^ tweak for n blocks, or with D for decryption.
+static void xts_batch(unsigned Nr, const KeySchedule *key, size_t n, const byte tweaks[], const byte in[], byte out[], int for_encryption) {
+    word buffer[XTS_BATCH * 4];
+    byte *bytes = (byte *)buffer;
+    for (size_t i = 0; i < 16 * n; ++i) bytes[i] = in[i] ^ tweaks[i];
+    if (for_encryption) {
+        CipherBlocks(4, Nr, n, buffer, buffer, key);
+    } else {
+        InvCipherBlocks(4, Nr, n, buffer, buffer, key);
+    }
+    for (size_t i = 0; i < 16 * n; ++i) out[i] = bytes[i] ^ tweaks[i];
+}
+
+#if XTS_SSE2
+
+// Multiplies the tweak by alpha: a one-bit shift of the little-endian 128-bit
+// value, with the carry out of the low half moved into the high half and the
+// carry out of the top reduced by x^128 = x^7 + x^2 + x + 1.
+SSE2_TARGET
+static inline __m128i multiply_alpha(__m128i t) {
+    const __m128i carries = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+    return _mm_xor_si128(_mm_add_epi64(t, t), _mm_and_si128(carries, _mm_set_epi32(0, 1, 0, 0x87)));
+}
+
+// Multiplies the tweak by alpha^8: a one-byte shift, with the byte shifted out
+// multiplied by x^7 + x^2 + x + 1 and added back in.
+SSE2_TARGET
+static inline __m128i multiply_alpha8(__m128i t) {
+    const __m128i top = _mm_srli_si128(t, 15);
+    const __m128i reduced = _mm_xor_si128(_mm_xor_si128(top, _mm_slli_epi16(top, 1)),
+                                          _mm_xor_si128(_mm_slli_epi16(top, 2), _mm_slli_epi16(top, 7)));
+    return _mm_xor_si128(_mm_slli_si128(t, 1), reduced);
+}
+
+// Writes n consecutive tweaks starting with tweak, and advances tweak past
+// them. Eight tweaks are kept in registers and each advanced by alpha^8, so
+// the lanes do not wait on one another.
+SSE2_TARGET
+static void make_tweaks(byte tweak[], size_t n, byte out[]) {
+    __m128i lanes[8];
+    lanes[0] = _mm_loadu_si128((const __m128i *)tweak);
+    for (unsigned k = 1; k < 8; ++k) lanes[k] = multiply_alpha(lanes[k - 1]);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (unsigned k = 0; k < 8; ++k) {
+            _mm_storeu_si128((__m128i *)(out + 16 * (i + k)), lanes[k]);
+            lanes[k] = multiply_alpha8(lanes[k]);
+        }
+    }
+    for (unsigned k = 0; i + k < n; ++k) {
+        _mm_storeu_si128((__m128i *)(out + 16 * (i + k)), lanes[k]);
+    }
+    _mm_storeu_si128((__m128i *)tweak, lanes[n - i]);
+}
+
+#else
+
+static void double_tweak(byte tweak[]) {
+    byte carry = 0;
+    for (unsigned i = 0; i < 16; ++i) {
+        const byte next = tweak[i] >> 7;
+        tweak[i] = (byte)(tweak[i] << 1 | carry);
+        carry = next;
+    }
+    tweak[0] ^= (byte)(0x87 & -carry);
+}
+
+static void make_tweaks(byte tweak[], size_t n, byte out[]) {
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(out + 16 * i, tweak, 16);
+        double_tweak(tweak);
+    }
+}
+
+#endif
@@ -0,0 +1,1521 @@
+// Known-answer tests and differential tests across engines, modes and buffer
+// sizes. Run with `make test`; an optional argument seeds the random inputs.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "io.h"
+#include "libaes.h"
+
+typedef struct KatVector {
+    const char *key;
+    const char *plaintext;
+    const char *ciphertext;
+} KatVector;
+
+typedef struct MctVector {
+    int for_encryption;
+    const char *key;
+    const char *text;
+    const char *result;
+} MctVector;
+
+// FIPS-197 Appendix C
+static const KatVector fips197_vectors[] = {
+    {"000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a"},
+    {"000102030405060708090a0b0c0d0e0f1011121314151617", "00112233445566778899aabbccddeeff", "dda97ca4864cdfe06eaf70a0ec0d7191"},
+    {"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "00112233445566778899aabbccddeeff", "8ea2b7ca516745bfeafc49904b496089"},
+};
+
+// a selection of the AESAVS known-answer tests
+static const KatVector kat_vectors[] = {
+    // VarTxt
+    {"00000000000000000000000000000000", "80000000000000000000000000000000", "3ad78e726c1ec02b7ebfe92b23d9ec34"},
+    {"00000000000000000000000000000000", "c0000000000000000000000000000000", "aae5939c8efdf2f04e60b9fe7117b2c2"},
+    {"00000000000000000000000000000000", "ffffffff000000000000000000000000", "c26277437420c5d634f715aea81a9132"},
+    {"00000000000000000000000000000000", "ffffffffffffffff0000000000000000", "f807c3e7985fe0f5a50e2cdb25c5109e"},
+    {"00000000000000000000000000000000", "ffffffffffffffff8000000000000000", "41f992a856fb278b389a62f5d274d7e9"},
+    {"00000000000000000000000000000000", "ffffffffffffffffffffffff00000000", "123c1f4af313ad8c2ce648b2e71fb6e1"},
+    {"00000000000000000000000000000000", "fffffffffffffffffffffffffffffffe", "5c005e72c1418c44f569f2ea33ba54f3"},
+    {"00000000000000000000000000000000", "ffffffffffffffffffffffffffffffff", "3f5b8cc9ea855a0afa7347d23e8d664e"},
+    {"000000000000000000000000000000000000000000000000", "80000000000000000000000000000000", "6cd02513e8d4dc986b4afe087a60bd0c"},
+    {"000000000000000000000000000000000000000000000000", "c0000000000000000000000000000000", "2ce1f8b7e30627c1c4519eada44bc436"},
+    {"000000000000000000000000000000000000000000000000", "ffffffff000000000000000000000000", "1b38d4f7452afefcb7fc721244e4b72e"},
+    {"000000000000000000000000000000000000000000000000", "ffffffffffffffff0000000000000000", "93baaffb35fbe739c17c6ac22eecf18f"},
+    {"000000000000000000000000000000000000000000000000", "ffffffffffffffff8000000000000000", "c8aa80a7850675bc007c46df06b49868"},
+    {"000000000000000000000000000000000000000000000000", "ffffffffffffffffffffffff00000000", "2e3febfd625bfcd0a2c06eb460da1732"},
+    {"000000000000000000000000000000000000000000000000", "fffffffffffffffffffffffffffffffe", "cef41d16d266bdfe46938ad7884cc0cf"},
+    {"000000000000000000000000000000000000000000000000", "ffffffffffffffffffffffffffffffff", "b13db4da1f718bc6904797c82bcf2d32"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "80000000000000000000000000000000", "ddc6bf790c15760d8d9aeb6f9a75fd4e"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "c0000000000000000000000000000000", "0a6bdc6d4c1e6280301fd8e97ddbe601"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "ffffffff000000000000000000000000", "6a4981f2915e3e68af6c22385dd06756"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "ffffffffffffffff0000000000000000", "9b58dbfd77fe5aca9cfc190cd1b82d19"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "ffffffffffffffff8000000000000000", "77f392089042e478ac16c0c86a0b5db5"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "ffffffffffffffffffffffff00000000", "21d9ba49f276b45f11af8fc71a088e3d"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "fffffffffffffffffffffffffffffffe", "7bfe9d876c6d63c1d035da8fe21c409d"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "ffffffffffffffffffffffffffffffff", "acdace8078a32b1a182bfa4987ca1347"},
+    // VarKey
+    {"80000000000000000000000000000000", "00000000000000000000000000000000", "0edd33d3c621e546455bd8ba1418bec8"},
+    {"c0000000000000000000000000000000", "00000000000000000000000000000000", "4bc3f883450c113c64ca42e1112a9e87"},
+    {"ffffffffffffffff0000000000000000", "00000000000000000000000000000000", "84be19e053635f09f2665e7bae85b42d"},
+    {"fffffffffffffffffffffffffffffffe", "00000000000000000000000000000000", "9ba4a9143f4e5d4048521c4f8877d88e"},
+    {"ffffffffffffffffffffffffffffffff", "00000000000000000000000000000000", "a1f6258c877d5fcd8964484538bfc92c"},
+    {"800000000000000000000000000000000000000000000000", "00000000000000000000000000000000", "de885dc87f5a92594082d02cc1e1b42c"},
+    {"c00000000000000000000000000000000000000000000000", "00000000000000000000000000000000", "132b074e80f2a597bf5febd8ea5da55e"},
+    {"ffffffffffffffff00000000000000000000000000000000", "00000000000000000000000000000000", "707b075791878880b44189d3522b8c30"},
+    {"ffffffffffffffffffffffff000000000000000000000000", "00000000000000000000000000000000", "03aa9058490eda306001a8a9f48d0ca7"},
+    {"fffffffffffffffffffffffffffffffe0000000000000000", "00000000000000000000000000000000", "492e607e5aea4688594b45f3aee3df90"},
+    {"ffffffffffffffffffffffffffffffff0000000000000000", "00000000000000000000000000000000", "e8c4e4381feec74054954c05b777a00a"},
+    {"fffffffffffffffffffffffffffffffffffffffffffffffe", "00000000000000000000000000000000", "018596e15e78e2c064159defce5f3085"},
+    {"ffffffffffffffffffffffffffffffffffffffffffffffff", "00000000000000000000000000000000", "dd8a493514231cbf56eccee4c40889fb"},
+    {"8000000000000000000000000000000000000000000000000000000000000000", "00000000000000000000000000000000", "e35a6dcb19b201a01ebcfa8aa22b5759"},
+    {"c000000000000000000000000000000000000000000000000000000000000000", "00000000000000000000000000000000", "b29169cdcf2d83e838125a12ee6aa400"},
+    {"ffffffffffffffff000000000000000000000000000000000000000000000000", "00000000000000000000000000000000", "94efe7a0e2e031e2536da01df799c927"},
+    {"fffffffffffffffffffffffffffffffe00000000000000000000000000000000", "00000000000000000000000000000000", "b5f71d4dd9a71fe5d8bc8ba7e6ea3048"},
+    {"ffffffffffffffffffffffffffffffff00000000000000000000000000000000", "00000000000000000000000000000000", "6825a347ac479d4f9d95c5cb8d3fd7e9"},
+    {"fffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffe", "00000000000000000000000000000000", "b07d4f3e2cd2ef2eb545980754dfea0f"},
+    {"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff", "00000000000000000000000000000000", "4bf85f1b5d54adbc307b0a048389adcb"},
+    // GFSbox and KeySbox
+    {"00000000000000000000000000000000", "f34481ec3cc627bacd5dc3fb08f273e6", "0336763e966d92595a567cc9ce537f5e"},
+    {"000000000000000000000000000000000000000000000000", "f34481ec3cc627bacd5dc3fb08f273e6", "b234e51c9f51bf86784668bae8917dc4"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "f34481ec3cc627bacd5dc3fb08f273e6", "f2c375af7ddf517ef03e7cb9d193b72b"},
+    {"00000000000000000000000000000000", "9798c4640bad75c7c3227db910174e72", "a9a1631bf4996954ebc093957b234589"},
+    {"000000000000000000000000000000000000000000000000", "9798c4640bad75c7c3227db910174e72", "4bde6976f192d8539032ca40c553b6b1"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "9798c4640bad75c7c3227db910174e72", "83eb5d153cd2657555e74bb33c799a20"},
+    {"00000000000000000000000000000000", "96ab5c2ff612d9dfaae8c31f30c42168", "ff4f8391a6a40ca5b25d23bedd44a597"},
+    {"000000000000000000000000000000000000000000000000", "96ab5c2ff612d9dfaae8c31f30c42168", "a33a5055a0cb23401ebaa024ff6a1cd3"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "96ab5c2ff612d9dfaae8c31f30c42168", "cb714146af41c24bf55ed2c840473a8d"},
+    {"00000000000000000000000000000000", "6a118a874519e64e9963798a503f1d35", "dc43be40be0e53712f7e2bf5ca707209"},
+    {"000000000000000000000000000000000000000000000000", "6a118a874519e64e9963798a503f1d35", "eec8663e3f61f15fd0fa8ae0fe541ec5"},
+    {"0000000000000000000000000000000000000000000000000000000000000000", "6a118a874519e64e9963798a503f1d35", "0e164bc0460495a696a68b9ab1bc3589"},
+    {"10a58869d74be5a374cf867cfb473859", "00000000000000000000000000000000", "6d251e6944b051e04eaa6fb4dbf78465"},
+    {"e9f065d7c13573587f7875357dfbb16c53489f6a4bd0f7cd", "00000000000000000000000000000000", "0956259c9cd5cfd0181cca53380cde06"},
+    {"c47b0294dbbbee0fec4757f22ffeee3587ca4730c3d33b691df38bab076bc558", "00000000000000000000000000000000", "46f2fb342d6f0ab477476fc501242c5f"},
+};
+
+// the AESAVS Monte Carlo tests, with the result after the last of 100 rounds
+static const MctVector mct_vectors[] = {
+    {1, "139a35422f1d61de3c91787fe0507afd", "b9145a768b7dc489a096b546f43b231f", "fb2649694783b551eacd9d5db6126d47"},
+    {0, "139a35422f1d61de3c91787fe0507afd", "b9145a768b7dc489a096b546f43b231f", "15352fce6af016ef6ed7728e6fe63963"},
+    {1, "b9a63e09e1dfc42e93a90d9bad739e5967aef672eedd5da9", "85a1f7a58167b389cddc8a9ff175ee26", "5d1196da8f184975e240949a25104554"},
+    {0, "b9a63e09e1dfc42e93a90d9bad739e5967aef672eedd5da9", "85a1f7a58167b389cddc8a9ff175ee26", "00aef3d6884377d1d139dbe883acbd98"},
+    {1, "f9e8389f5b80712e3886cc1fa2d28a3b8c9cd88a2d4a54c6aa86ce0fef944be0", "b379777f9050e2a818f2940cbbd9aba4", "c5d2cb3d5b7ff0e23e308967ee074825"},
+    {0, "f9e8389f5b80712e3886cc1fa2d28a3b8c9cd88a2d4a54c6aa86ce0fef944be0", "b379777f9050e2a818f2940cbbd9aba4", "0fdb24f22b4a55eaa1633bf04a281b80"},
+};
+
+static const char *const engine_names[] = {"aesni", "bitslice", "table", "compact"};
+static const OperationMode modes[] = {MODE_ECB, MODE_CTR, MODE_GCM, MODE_CBC};
+static const char *const mode_names[] = {"ecb", "ctr", "gcm", "cbc"};
+static const size_t buffer_sizes[] = {4096, 12288, 65536, 1 << 20};
+static const char ctr_iv[] = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char gcm_iv[] = "cafebabefacedbaddecaf888";
+static const char cbc_iv[] = "000102030405060708090a0b0c0d0e0f";
+
+static unsigned failures = 0;
+static unsigned checks = 0;
+static uint64_t random_state;
+static char directory[4096];
+
+static void check(int condition, const char *format, ...);
+static uint64_t next_random(void);
+static void fill_random(byte data[], size_t length);
+static void hex_to_bytes(const char *hex, byte out[]);
+static void bytes_to_hex(const byte bytes[], size_t length, char out[]);
+static void expand_key(const char *key_hex, KeySchedule *schedule);
+static char *temp_path(const char *name);
+static void write_file(const char *path, const byte data[], size_t length);
+static byte *read_file(const char *path, size_t *length);
+static int file_fails(const char *key_hex, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options);
+static void cipher_file_stream(unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options);
+
+static void test_fips197(void);
+static void test_kat(void);
+static void test_mct(void);
+static void test_engines(void);
+static void test_key_cache(void);
+static void test_key_bulk(void);
+static void test_hex(void);
+static void test_padding(void);
+static void test_legacy_key_order(void);
+static void test_cbc(void);
+static void test_file_modes(void);
+static void test_xts(void);
+static void test_container(void);
+static void test_work_pool(void);
+static void test_tree(void);
+static void test_library(void);
+static void test_serve(void);
+static void test_stats(void);
+
+int main(int argc, char **argv) {
+    random_state = argc > 1 ? strtoull(argv[1], NULL, 0) : 0x2545f4914f6cdd1du;
+    if (!random_state) random_state = 1;
+    printf("Seed: 0x%llx\n", (unsigned long long)random_state);
+
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    snprintf(directory, sizeof(directory), "%s/aes-test-XXXXXX", tmp);
+    if (!mkdtemp(directory)) error(": Failed to create directory.", directory);
+
+    test_fips197();
+    test_kat();
+    test_mct();
+    test_engines();
+    test_key_cache();
+    test_key_bulk();
+    test_hex();
+    test_padding();
+    test_legacy_key_order();
+    test_cbc();
+    test_file_modes();
+    test_xts();
+    test_container();
+    test_work_pool();
+    test_tree();
+    test_library();
+    test_serve();
+    test_stats();
+
+    rmdir(directory);
+    printf("%u of %u checks failed.\n", failures, checks);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void check(int condition, const char *format, ...) {
+    ++checks;
+    if (condition) return;
+    ++failures;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAILED: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void fill_random(byte data[], size_t length) {
+    for (size_t i = 0; i < length; ++i) data[i] = (byte)next_random();
+}
+
+static void hex_to_bytes(const char *hex, byte out[]) {
+    for (size_t i = 0; hex[2 * i]; ++i) {
+        unsigned value;
+        sscanf(hex + 2 * i, "%2x", &value);
+        out[i] = (byte)value;
+    }
+}
+
+static void bytes_to_hex(const byte bytes[], size_t length, char out[]) {
+    for (size_t i = 0; i < length; ++i) snprintf(out + 2 * i, 3, "%02x", bytes[i]);
+}
+
+// Key bytes in order are the key words as laid out in memory.
+static void expand_key(const char *key_hex, KeySchedule *schedule) {
+    word key[MAX_NB];
+    const unsigned Nk = (unsigned)strlen(key_hex) / 8;
+    hex_to_bytes(key_hex, (byte *)key);
+    KeyExpansion(4, Nk + 6, key, Nk, schedule);
+}
+
+static char *temp_path(const char *name) {
+    static char paths[4][4096];
+    static unsigned next = 0;
+    char *path = paths[next++ % 4];
+    snprintf(path, sizeof(paths[0]), "%s/%s", directory, name);
+    return path;
+}
+
+static void write_file(const char *path, const byte data[], size_t length) {
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(data, 1, length, file) != length || fclose(file)) error(": Failed to write file.", path);
+}
+
+static byte *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        *length = 0;
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *length = (size_t)ftell(file);
+    rewind(file);
+    byte *data = (byte *)malloc(*length + 1);
+    if (fread(data, 1, *length, file) != *length) error(": Failed to read file.", path);
+    fclose(file);
+    return data;
+}
+
+// cipher_file() exits on errors, so cases expected to fail run in a child.
+static int file_fails(const char *key_hex, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stderr)) _exit(EXIT_SUCCESS);
+        // an XTS key is two keys
+        const unsigned Nk = (unsigned)strlen(key_hex) / (options->mode == MODE_XTS ? 16 : 8);
+        cipher_file(4, Nk, key_hex, in_dir, out_dir, for_encryption, options);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS;
+}
+
+// Runs cipher_file() with the input file as the standard input, which takes
+// the streaming path.
+static void cipher_file_stream(unsigned Nk, const char *key, const char *in_dir, const char *out_dir, int for_encryption, const CipherOptions *options) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen(in_dir, "rb", stdin)) _exit(EXIT_FAILURE);
+        cipher_file(4, Nk, key, "-", out_dir, for_encryption, options);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+// Checks a single block through cipher_hex(), Cipher() and InvCipher() with the
+// current engine.
+static void check_vector(const KatVector *v, const char *engine) {
+    const unsigned Nk = (unsigned)strlen(v->key) / 8;
+    const CipherOptions options = {MODE_ECB};
+
+    char *out = cipher_hex(4, Nk, v->key, v->plaintext, 1, &options);
+    check(strcmp(out, v->ciphertext) == 0, "%s: cipher_hex() encrypting %s with key %s gave %s", engine, v->plaintext, v->key, out);
+    free(out);
+    out = cipher_hex(4, Nk, v->key, v->ciphertext, 0, &options);
+    check(strcmp(out, v->plaintext) == 0, "%s: cipher_hex() decrypting %s with key %s gave %s", engine, v->ciphertext, v->key, out);
+    free(out);
+
+    KeySchedule schedule;
+    expand_key(v->key, &schedule);
+    word in[4];
+    char hex[33];
+    hex_to_bytes(v->plaintext, (byte *)in);
+    word *block = Cipher(4, Nk + 6, in, &schedule);
+    bytes_to_hex((byte *)block, 16, hex);
+    check(strcmp(hex, v->ciphertext) == 0, "%s: Cipher() encrypting %s with key %s gave %s", engine, v->plaintext, v->key, hex);
+    free(block);
+    hex_to_bytes(v->ciphertext, (byte *)in);
+    block = InvCipher(4, Nk + 6, in, &schedule);
+    bytes_to_hex((byte *)block, 16, hex);
+    check(strcmp(hex, v->plaintext) == 0, "%s: InvCipher() decrypting %s with key %s gave %s", engine, v->ciphertext, v->key, hex);
+    free(block);
+}
+
+static void test_fips197(void) {
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (!select_engine(engine_names[e])) continue;
+        for (size_t i = 0; i < sizeof(fips197_vectors) / sizeof(fips197_vectors[0]); ++i) {
+            check_vector(&fips197_vectors[i], engine_names[e]);
+        }
+    }
+    select_engine(NULL);
+
+    // in file mode, the block is followed by a block of padding
+    const CipherOptions options = {MODE_ECB};
+    char *in_dir = temp_path("fips197.in"), *out_dir = temp_path("fips197.out"), *back_dir = temp_path("fips197.back");
+    for (size_t i = 0; i < sizeof(fips197_vectors) / sizeof(fips197_vectors[0]); ++i) {
+        const KatVector *v = &fips197_vectors[i];
+        const unsigned Nk = (unsigned)strlen(v->key) / 8;
+        byte plaintext[16];
+        hex_to_bytes(v->plaintext, plaintext);
+        write_file(in_dir, plaintext, 16);
+        cipher_file(4, Nk, v->key, in_dir, out_dir, 1, &options);
+
+        size_t length;
+        byte *out = read_file(out_dir, &length);
+        char hex[33];
+        bytes_to_hex(out, 16, hex);
+        check(length == 32 && strcmp(hex, v->ciphertext) == 0, "file mode encrypting %s with key %s gave %s", v->plaintext, v->key, hex);
+        free(out);
+
+        cipher_file(4, Nk, v->key, out_dir, back_dir, 0, &options);
+        out = read_file(back_dir, &length);
+        check(length == 16 && memcmp(out, plaintext, 16) == 0, "file mode round trip of %s with key %s", v->plaintext, v->key);
+        free(out);
+    }
+    remove(in_dir);
+    remove(out_dir);
+    remove(back_dir);
+}
+
+static void test_kat(void) {
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (!select_engine(engine_names[e])) continue;
+        for (size_t i = 0; i < sizeof(kat_vectors) / sizeof(kat_vectors[0]); ++i) {
+            check_vector(&kat_vectors[i], engine_names[e]);
+        }
+    }
+    select_engine(NULL);
+}
+
+// Each of the 100 rounds runs 1000 chained blocks, then mixes the last one or
+// two outputs into the key (AESAVS section 6.4).
+static void run_mct(const MctVector *v, char result[]) {
+    const unsigned Nk = (unsigned)strlen(v->key) / 8;
+    byte key[32], text[16], previous[16];
+    word key_words[MAX_NB];
+    hex_to_bytes(v->key, key);
+    hex_to_bytes(v->text, text);
+
+    for (unsigned i = 0; i < 100; ++i) {
+        KeySchedule schedule;
+        memcpy(key_words, key, 4 * Nk);
+        KeyExpansion(4, Nk + 6, key_words, Nk, &schedule);
+        for (unsigned j = 0; j < 1000; ++j) {
+            memcpy(previous, text, 16);
+            if (v->for_encryption) {
+                CipherBlocks(4, Nk + 6, 1, (word *)text, (word *)text, &schedule);
+            } else {
+                InvCipherBlocks(4, Nk + 6, 1, (word *)text, (word *)text, &schedule);
+            }
+        }
+        // previous is now the output of the 999th block
+        byte mix[32];
+        memcpy(mix, previous, 16);
+        memcpy(mix + 16, text, 16);
+        for (unsigned k = 0; k < 4 * Nk; ++k) key[k] ^= mix[32 - 4 * Nk + k];
+    }
+    bytes_to_hex(text, 16, result);
+}
+
+static void test_mct(void) {
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (!select_engine(engine_names[e])) continue;
+        for (size_t i = 0; i < sizeof(mct_vectors) / sizeof(mct_vectors[0]); ++i) {
+            char result[33];
+            run_mct(&mct_vectors[i], result);
+            check(strcmp(result, mct_vectors[i].result) == 0, "%s: Monte Carlo test %zu gave %s", engine_names[e], i, result);
+        }
+    }
+    select_engine(NULL);
+}
+
+// Every engine must agree with the table engine on random keys and block
+// counts, covering partial and full batches of each engine, with schedules
+// expanded both while it is selected and while another engine is. The
+// schedules themselves must match too, as the bitsliced engine expands keys
+// through its own circuits.
+static void test_engines(void) {
+    enum { MAX_BLOCKS = 300 };
+    static word in[4 * MAX_BLOCKS], expected[4 * MAX_BLOCKS], out[4 * MAX_BLOCKS];
+
+    for (unsigned round = 0; round < 200; ++round) {
+        const unsigned Nk = 4 + 2 * (unsigned)(next_random() % 3);
+        const size_t n = 1 + next_random() % MAX_BLOCKS;
+        word key[MAX_NB];
+        fill_random((byte *)key, sizeof(key));
+        fill_random((byte *)in, sizeof(in));
+        KeySchedule schedule;
+        KeyExpansion(4, Nk + 6, key, Nk, &schedule);
+
+        for (int inverse = 0; inverse <= 1; ++inverse) {
+            select_engine("table");
+            BlocksFunction *blocks = inverse ? InvCipherBlocks : CipherBlocks;
+            blocks(4, Nk + 6, n, in, expected, &schedule);
+            for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+                if (!select_engine(engine_names[e])) continue;
+                KeySchedule engine_schedule;
+                KeyExpansion(4, Nk + 6, key, Nk, &engine_schedule);
+                const size_t words = 4 * (Nk + 7);
+                check(memcmp(engine_schedule.encryption, schedule.encryption, words * sizeof(word)) == 0 &&
+                          memcmp(engine_schedule.decryption, schedule.decryption, words * sizeof(word)) == 0,
+                      "%s: the schedule of a %u-bit key differs from the table engine's", engine_names[e], 32 * Nk);
+                blocks(4, Nk + 6, n, in, out, &engine_schedule);
+                check(memcmp(out, expected, 16 * n) == 0, "%s: %s of %zu blocks with a %u-bit key differs from the table engine",
+                      engine_names[e], inverse ? "decryption" : "encryption", n, 32 * Nk);
+                // in place, with the schedule expanded for the table engine
+                memcpy(out, in, 16 * n);
+                blocks(4, Nk + 6, n, out, out, &schedule);
+                check(memcmp(out, expected, 16 * n) == 0, "%s: in-place %s of %zu blocks differs from the table engine",
+                      engine_names[e], inverse ? "decryption" : "encryption", n);
+            }
+        }
+    }
+    select_engine(NULL);
+}
+
+static int schedule_equal(const KeySchedule *a, const KeySchedule *b) {
+    const size_t words = (a->Nr + 1) * a->Nb;
+    return a->Nb == b->Nb && a->Nr == b->Nr && a->cipher_rounds == b->cipher_rounds &&
+           a->inv_cipher_rounds == b->inv_cipher_rounds &&
+           memcmp(a->encryption, b->encryption, words * sizeof(word)) == 0 &&
+           memcmp(a->decryption, b->decryption, words * sizeof(word)) == 0;
+}
+
+// Cached schedules must match fresh expansions, whether they were hits or not.
+static void test_key_cache(void) {
+    enum { KEYS = 40 };
+    static word keys[KEYS][MAX_NB];
+    KeySchedule cached, expected;
+    KeyCacheStats before, after;
+
+    key_cache_get_stats(&before);
+    for (unsigned i = 0; i < KEYS; ++i) {
+        fill_random((byte *)keys[i], sizeof(keys[i]));
+        for (unsigned Nk = 4; Nk <= 8; Nk += 2) {
+            key_cache_expand(4, Nk + 6, keys[i], Nk, &cached);
+            KeyExpansion(4, Nk + 6, keys[i], Nk, &expected);
+            check(schedule_equal(&cached, &expected), "key cache: schedule %u for Nk = %u differs on a miss", i, Nk);
+        }
+    }
+    key_cache_get_stats(&after);
+    check(after.misses - before.misses == 3 * KEYS, "key cache: %llu misses for %u new keys",
+          (unsigned long long)(after.misses - before.misses), 3 * KEYS);
+    check(after.evictions > before.evictions, "key cache: no evictions after %u new keys", 3 * KEYS);
+
+    // the most recent key is still cached, also under another block size
+    key_cache_get_stats(&before);
+    key_cache_expand(4, 14, keys[KEYS - 1], 8, &cached);
+    KeyExpansion(4, 14, keys[KEYS - 1], 8, &expected);
+    check(schedule_equal(&cached, &expected), "key cache: schedule differs on a hit");
+    key_cache_expand(8, 14, keys[KEYS - 1], 8, &cached);
+    KeyExpansion(8, 14, keys[KEYS - 1], 8, &expected);
+    check(schedule_equal(&cached, &expected), "key cache: schedule for Nb = 8 differs");
+    key_cache_get_stats(&after);
+    check(after.hits - before.hits == 1 && after.misses - before.misses == 1,
+          "key cache: %llu hits and %llu misses on a repeated key", (unsigned long long)(after.hits - before.hits),
+          (unsigned long long)(after.misses - before.misses));
+
+    // the oldest key has been evicted
+    key_cache_get_stats(&before);
+    key_cache_expand(4, 10, keys[0], 4, &cached);
+    key_cache_get_stats(&after);
+    check(after.misses - before.misses == 1, "key cache: the least recently used key was not evicted");
+
+    key_cache_clear();
+    key_cache_get_stats(&before);
+    key_cache_expand(4, 10, keys[0], 4, &cached);
+    key_cache_get_stats(&after);
+    check(after.misses - before.misses == 1, "key cache: a key survived key_cache_clear()");
+}
+
+// The hexadecimal helpers against snprintf() and sscanf(), with each
+// implementation the processor supports, on every length up to a few vectors'
+// worth.
+// Bulk expansion must match KeyExpansion() on every key, for numbers of keys
+// around the lane count and for block sizes it does not accelerate.
+static void test_key_bulk(void) {
+    enum { KEYS = 19 };
+    static const size_t counts[] = {1, 7, 8, 9, KEYS};
+    static word keys[KEYS * MAX_NB];
+    static KeySchedule schedules[KEYS], expected;
+    KeySchedule *pointers[KEYS];
+    for (unsigned i = 0; i < KEYS; ++i) pointers[i] = &schedules[i];
+
+    for (unsigned Nb = 4; Nb <= 8; Nb += 4) {
+        for (unsigned Nk = 4; Nk <= 8; Nk += 2) {
+            const unsigned Nr = (Nb > Nk ? Nb : Nk) + 6;
+            for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+                fill_random((byte *)keys, sizeof(keys));
+                KeyExpansionBulk(Nb, Nr, counts[c], keys, Nk, pointers);
+                for (size_t i = 0; i < counts[c]; ++i) {
+                    KeyExpansion(Nb, Nr, keys + i * Nk, Nk, &expected);
+                    check(schedule_equal(&schedules[i], &expected), "bulk keys: schedule %zu of %zu differs for Nb = %u, Nk = %u",
+                          i, counts[c], Nb, Nk);
+                }
+            }
+        }
+    }
+}
+
+static void test_hex(void) {
+    static const char *const levels[] = {"scalar", "sse2", "avx2"};
+    byte bytes[100], back[100];
+    char hex[201], expected[201], spaced[401], stripped[401];
+
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+        if (!hex_select(levels[l])) continue;
+        const char *level = levels[l];
+
+        for (size_t length = 0; length <= 100; ++length) {
+            fill_random(bytes, length);
+            bytes_to_hex(bytes, length, expected);
+            hex_encode(bytes, length, hex);
+            check(memcmp(hex, expected, 2 * length) == 0, "hex %s: encoding %zu bytes gave %.*s", level, length, (int)(2 * length), hex);
+
+            // mixed case and whitespace are accepted
+            for (size_t i = 0; i < 2 * length; ++i) {
+                if (next_random() % 2) hex[i] = (char)toupper((unsigned char)hex[i]);
+            }
+            size_t spaced_length = 0;
+            for (size_t i = 0; i < 2 * length; ++i) {
+                if (next_random() % 4 == 0) spaced[spaced_length++] = " \t\r\n\v\f"[next_random() % 6];
+                spaced[spaced_length++] = hex[i];
+            }
+            check(hex_strip(spaced, spaced_length, stripped) == 2 * length && memcmp(stripped, hex, 2 * length) == 0,
+                  "hex %s: stripping %zu digits", level, 2 * length);
+            check(hex_strip(spaced, spaced_length, spaced) == 2 * length && memcmp(spaced, hex, 2 * length) == 0,
+                  "hex %s: stripping %zu digits in place", level, 2 * length);
+            check(hex_decode(stripped, length, back) && memcmp(back, bytes, length) == 0, "hex %s: decoding %zu bytes", level, length);
+
+            if (length == 0) continue;
+            const size_t position = next_random() % (2 * length);
+            const char invalid = "g/:@G`\x80\xff"[next_random() % 8];
+            hex[position] = invalid;
+            check(!hex_decode(hex, length, back), "hex %s: decoded 0x%02x at %zu", level, (unsigned char)invalid, position);
+            check(hex_strip(hex, 2 * length, stripped) == (size_t)-1, "hex %s: stripped 0x%02x at %zu", level, (unsigned char)invalid, position);
+        }
+    }
+    hex_select(NULL);
+}
+
+// The plaintext is followed by 0x80 and zeros up to a whole number of blocks,
+// so a plaintext ending in such bytes must survive the round trip.
+static void test_padding(void) {
+    const char *key = "2b7e151628aed2a6abf7158809cf4f3c";
+    const CipherOptions options = {MODE_ECB};
+    char *in_dir = temp_path("padding.in"), *out_dir = temp_path("padding.out"), *back_dir = temp_path("padding.back");
+    KeySchedule schedule;
+    expand_key(key, &schedule);
+
+    for (size_t length = 0; length <= 48; ++length) {
+        for (int tail = 0; tail < 3; ++tail) {
+            byte plaintext[64], expected[64];
+            fill_random(plaintext, length);
+            if (tail == 1 && length) plaintext[length - 1] = 0x80;
+            if (tail == 2) memset(plaintext + length / 2, 0, length - length / 2);
+            write_file(in_dir, plaintext, length);
+            cipher_file(4, 4, key, in_dir, out_dir, 1, &options);
+
+            // the expected ciphertext, padded by hand
+            const size_t padded = (length / 16 + 1) * 16;
+            memcpy(expected, plaintext, length);
+            expected[length] = 0x80;
+            memset(expected + length + 1, 0, padded - length - 1);
+            CipherBlocks(4, 10, padded / 16, (word *)expected, (word *)expected, &schedule);
+
+            size_t out_length;
+            byte *out = read_file(out_dir, &out_length);
+            check(out_length == padded && memcmp(out, expected, padded) == 0, "padding of %zu bytes (tail %d)", length, tail);
+            free(out);
+
+            cipher_file(4, 4, key, out_dir, back_dir, 0, &options);
+            out = read_file(back_dir, &out_length);
+            check(out_length == length && (!length || memcmp(out, plaintext, length) == 0), "unpadding of %zu bytes (tail %d)", length, tail);
+            free(out);
+
+            // regular files are split across threads, and other inputs streamed
+            cipher_file_stream(4, key, in_dir, out_dir, 1, &options);
+            out = read_file(out_dir, &out_length);
+            check(out_length == padded && memcmp(out, expected, padded) == 0, "streamed padding of %zu bytes (tail %d)", length, tail);
+            free(out);
+            cipher_file_stream(4, key, out_dir, back_dir, 0, &options);
+            out = read_file(back_dir, &out_length);
+            check(out_length == length && (!length || memcmp(out, plaintext, length) == 0), "streamed unpadding of %zu bytes (tail %d)", length, tail);
+            free(out);
+        }
+    }
+
+    // a last block without any 0x80 byte, or with a nonzero byte after it
+    byte block[32] = {0};
+    block[16 + 5] = 0x80;
+    block[16 + 9] = 0x01;
+    for (unsigned k = 0; k < 2; ++k) {
+        byte ciphertext[32];
+        memcpy(ciphertext, block + 16 * k, 16);
+        CipherBlocks(4, 10, 1, (word *)ciphertext, (word *)ciphertext, &schedule);
+        write_file(in_dir, ciphertext, 16);
+        remove(back_dir);
+        check(file_fails(key, in_dir, back_dir, 0, &options), "invalid padding %u was accepted", k);
+        check(access(back_dir, F_OK) != 0, "output of invalid padding %u was left behind", k);
+    }
+
+    // empty and truncated ciphertexts
+    byte ciphertext[33] = {0};
+    const size_t lengths[] = {0, 15, 17, 33};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        write_file(in_dir, ciphertext, lengths[i]);
+        check(file_fails(key, in_dir, back_dir, 0, &options), "ciphertext of %zu bytes was accepted", lengths[i]);
+    }
+
+    remove(in_dir);
+    remove(out_dir);
+    remove(back_dir);
+}
+
+// Encrypts random files in every mode with one thread, the default buffer and
+// the table engine, then checks that every engine, buffer size, thread count
+// and memory mapping gives the same output and decrypts it back.
+// SP 800-38A F.2.1 and F.2.5 through cipher_hex() on every engine
+// Files written in ECB mode by versions before CTR mode, which read the key
+// words after the fourth with their bytes reversed.
+static void test_legacy_key_order(void) {
+    static const char plaintext[] = "legacy archive, 40 bytes of text!!!!!!!";
+    static const struct {
+        const char *key;
+        const char *ciphertext;
+    } files[] = {
+        {"000102030405060708090a0b0c0d0e0f1011121314151617",
+         "19d911754f259e36909707ab7c26b9b04769d65aa86193d02d67bbe970c7400bba8192a5b066585e632b2bf77694be66"},
+        {"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+         "26b06b262e65d6a721f1890624bd2ad6ea6b4e05e241be1b0f5649bf267c55500a5596220c78b37eded3e87cacd699b1"},
+    };
+    char *in_dir = temp_path("legacy.in"), *out_dir = temp_path("legacy.out");
+    const size_t length = strlen(plaintext);
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        const unsigned Nk = (unsigned)strlen(files[i].key) / 8;
+        byte ciphertext[48];
+        hex_to_bytes(files[i].ciphertext, ciphertext);
+        write_file(in_dir, ciphertext, sizeof(ciphertext));
+
+        CipherOptions options = {MODE_ECB};
+        options.legacy_key_order = 1;
+        cipher_file(4, Nk, files[i].key, in_dir, out_dir, 0, &options);
+        size_t out_length;
+        byte *out = read_file(out_dir, &out_length);
+        check(out_length == length && memcmp(out, plaintext, length) == 0, "legacy key order: %u-bit file did not decrypt", 32 * Nk);
+        free(out);
+
+        // and back, to the same file
+        write_file(in_dir, (const byte *)plaintext, length);
+        cipher_file(4, Nk, files[i].key, in_dir, out_dir, 1, &options);
+        out = read_file(out_dir, &out_length);
+        check(out_length == sizeof(ciphertext) && memcmp(out, ciphertext, sizeof(ciphertext)) == 0,
+              "legacy key order: %u-bit file encrypted differently", 32 * Nk);
+        free(out);
+
+        options.legacy_key_order = 0;
+        cipher_file(4, Nk, files[i].key, in_dir, out_dir, 1, &options);
+        out = read_file(out_dir, &out_length);
+        check(out_length == sizeof(ciphertext) && memcmp(out, ciphertext, sizeof(ciphertext)) != 0,
+              "legacy key order: %u-bit key read in the legacy order by default", 32 * Nk);
+        free(out);
+    }
+
+    remove(in_dir);
+    remove(out_dir);
+}
+
+static void test_cbc(void) {
+    static const KatVector vectors[] = {
+        {"2b7e151628aed2a6abf7158809cf4f3c",
+         "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+         "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7"},
+        {"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+         "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+         "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b"},
+    };
+    const CipherOptions options = {MODE_CBC, cbc_iv};
+    for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+        if (!select_engine(engine_names[e])) continue;
+        for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+            const KatVector *v = &vectors[i];
+            const unsigned Nk = (unsigned)strlen(v->key) / 8;
+            char *out = cipher_hex(4, Nk, v->key, v->plaintext, 1, &options);
+            check(strcmp(out, v->ciphertext) == 0, "%s: CBC encryption with key %s gave %s", engine_names[e], v->key, out);
+            free(out);
+            out = cipher_hex(4, Nk, v->key, v->ciphertext, 0, &options);
+            check(strcmp(out, v->plaintext) == 0, "%s: CBC decryption with key %s gave %s", engine_names[e], v->key, out);
+            free(out);
+        }
+    }
+    select_engine(NULL);
+}
+
+static void test_file_modes(void) {
+    const size_t lengths[] = {0, 1, 15, 16, 17, 4095, 4096, 4097, 12288, 12300, 65536 + 16, 200003};
+    const size_t max_length = 200003;
+    byte *plaintext = (byte *)malloc(max_length);
+    char *in_dir = temp_path("file.in"), *out_dir = temp_path("file.out"), *back_dir = temp_path("file.back"), *expected_dir = temp_path("file.expected");
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        const size_t length = lengths[l];
+        fill_random(plaintext, length);
+        write_file(in_dir, plaintext, length);
+
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+            const unsigned Nk = 4 + 2 * (unsigned)(next_random() % 3);
+            byte key_bytes[32];
+            char key[65];
+            fill_random(key_bytes, 4 * Nk);
+            bytes_to_hex(key_bytes, 4 * Nk, key);
+
+            CipherOptions options = {modes[m], modes[m] == MODE_CTR ? ctr_iv : modes[m] == MODE_GCM ? gcm_iv : modes[m] == MODE_CBC ? cbc_iv : NULL, 1};
+            select_engine("table");
+            cipher_file(4, Nk, key, in_dir, expected_dir, 1, &options);
+            size_t expected_length;
+            byte *expected = read_file(expected_dir, &expected_length);
+
+            for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+                if (!select_engine(engine_names[e])) continue;
+                for (size_t b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); ++b) {
+                    for (unsigned variant = 0; variant < 3; ++variant) {
+                        // one thread, four threads, and four threads with memory mapping
+                        options.buffer_size = buffer_sizes[b];
+                        options.threads = variant ? 4 : 1;
+                        options.memory_map = variant == 2;
+                        if (options.memory_map && modes[m] == MODE_GCM) continue;
+
+                        cipher_file(4, Nk, key, in_dir, out_dir, 1, &options);
+                        size_t out_length;
+                        byte *out = read_file(out_dir, &out_length);
+                        check(out_length == expected_length && memcmp(out, expected, out_length) == 0,
+                              "%s, %s: encrypting %zu bytes with a %zu-byte buffer (variant %u) differs",
+                              engine_names[e], mode_names[m], length, buffer_sizes[b], variant);
+                        free(out);
+
+                        cipher_file(4, Nk, key, out_dir, back_dir, 0, &options);
+                        out = read_file(back_dir, &out_length);
+                        check(out_length == length && (!length || memcmp(out, plaintext, length) == 0),
+                              "%s, %s: round trip of %zu bytes with a %zu-byte buffer (variant %u) failed",
+                              engine_names[e], mode_names[m], length, buffer_sizes[b], variant);
+                        free(out);
+                    }
+                }
+            }
+            free(expected);
+
+            // GCM must reject a modified ciphertext
+            if (modes[m] == MODE_GCM) {
+                size_t out_length;
+                byte *out = read_file(expected_dir, &out_length);
+                out[next_random() % out_length] ^= (byte)(1 + next_random() % 255);
+                write_file(out_dir, out, out_length);
+                free(out);
+                options.buffer_size = 0;
+                options.memory_map = 0;
+                check(file_fails(key, out_dir, back_dir, 0, &options), "gcm: a modified ciphertext of %zu bytes was accepted", length);
+            }
+        }
+    }
+    select_engine(NULL);
+
+    free(plaintext);
+    remove(in_dir);
+    remove(out_dir);
+    remove(back_dir);
+    remove(expected_dir);
+}
+
+typedef struct XtsVector {
+    const char *key;
+    uint64_t unit;
+    const char *plaintext;
+    const char *ciphertext;
+} XtsVector;
+
+// IEEE 1619 Annex B vectors 1, 2 and 15, and vector 15 with 256-bit keys as
+// computed by OpenSSL
+static const XtsVector xts_vectors[] = {
+    {"0000000000000000000000000000000000000000000000000000000000000000", 0,
+     "0000000000000000000000000000000000000000000000000000000000000000",
+     "917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e"},
+    {"1111111111111111111111111111111122222222222222222222222222222222", 0x3333333333u,
+     "4444444444444444444444444444444444444444444444444444444444444444",
+     "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0"},
+    {"fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x123456789au,
+     "000102030405060708090a0b0c0d0e0f10", "6c1625db4671522d3d7599601de7ca09ed"},
+    {"fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0efeeedecebeae9e8e7e6e5e4e3e2e1e0"
+     "bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0afaeadacabaaa9a8a7a6a5a4a3a2a1a0", 0x123456789au,
+     "000102030405060708090a0b0c0d0e0f10", "7f117752cc598a8b0d81d88af9f9bec8c3"},
+};
+
+// XTS against the IEEE 1619 vectors, then files of several unit sizes through
+// the parallel and streaming paths, ranges, and lengths that must be rejected.
+static void test_xts(void) {
+    byte key_bytes[64], in[64], out[64];
+    char hex[129];
+    for (size_t i = 0; i < sizeof(xts_vectors) / sizeof(xts_vectors[0]); ++i) {
+        const XtsVector *v = &xts_vectors[i];
+        const unsigned Nk = (unsigned)strlen(v->key) / 16;
+        const size_t length = strlen(v->plaintext) / 2;
+        XtsKey key;
+        hex_to_bytes(v->key, key_bytes);
+        KeyExpansion(4, Nk + 6, (const word *)key_bytes, Nk, &key.data);
+        KeyExpansion(4, Nk + 6, (const word *)(key_bytes + 4 * Nk), Nk, &key.tweak);
+        hex_to_bytes(v->plaintext, in);
+
+        for (size_t e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); ++e) {
+            if (!select_engine(engine_names[e])) continue;
+            xts_units(Nk + 6, &key, v->unit, 512, length, in, out, 1);
+            bytes_to_hex(out, length, hex);
+            check(strcmp(hex, v->ciphertext) == 0, "%s: XTS vector %zu gave %s", engine_names[e], i, hex);
+            xts_units(Nk + 6, &key, v->unit, 512, length, out, out, 0);
+            check(memcmp(out, in, length) == 0, "%s: XTS vector %zu did not decrypt", engine_names[e], i);
+        }
+    }
+    select_engine(NULL);
+
+    CipherOptions options = {MODE_XTS};
+    char *out_hex = cipher_hex(4, 4, xts_vectors[0].key, xts_vectors[0].plaintext, 1, &options);
+    check(strcmp(out_hex, xts_vectors[0].ciphertext) == 0, "xts: cipher_hex() gave %s", out_hex);
+    free(out_hex);
+
+    const size_t lengths[] = {16, 17, 4096, 4111, 12288, 70000, 200003};
+    const size_t unit_sizes[] = {512, 4096, 65536};
+    const size_t max_length = 200003;
+    byte *plaintext = (byte *)malloc(max_length), *expected = (byte *)malloc(max_length);
+    char *in_dir = temp_path("xts.in"), *out_dir = temp_path("xts.out"), *back_dir = temp_path("xts.back");
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        const size_t length = lengths[l];
+        fill_random(plaintext, length);
+        write_file(in_dir, plaintext, length);
+
+        for (size_t u = 0; u < sizeof(unit_sizes) / sizeof(unit_sizes[0]); ++u) {
+            const size_t unit_size = unit_sizes[u];
+            if (length % unit_size && length % unit_size < 16) continue;
+            const unsigned Nk = next_random() % 2 ? 8 : 4;
+            char key[129];
+            fill_random(key_bytes, 8 * Nk);
+            bytes_to_hex(key_bytes, 8 * Nk, key);
+            XtsKey xts_key;
+            KeyExpansion(4, Nk + 6, (const word *)key_bytes, Nk, &xts_key.data);
+            KeyExpansion(4, Nk + 6, (const word *)(key_bytes + 4 * Nk), Nk, &xts_key.tweak);
+            xts_units(Nk + 6, &xts_key, 0, unit_size, length, plaintext, expected, 1);
+
+            for (unsigned variant = 0; variant < 3; ++variant) {
+                // one thread, four threads, and streamed from the standard input
+                options = (CipherOptions){MODE_XTS, NULL, variant ? 4 : 1, 4096 << variant, .unit_size = unit_size};
+                if (variant == 2) {
+                    cipher_file_stream(Nk, key, in_dir, out_dir, 1, &options);
+                } else {
+                    cipher_file(4, Nk, key, in_dir, out_dir, 1, &options);
+                }
+                size_t out_length;
+                byte *out_file = read_file(out_dir, &out_length);
+                check(out_length == length && memcmp(out_file, expected, length) == 0,
+                      "xts: encrypting %zu bytes in %zu-byte units (variant %u) differs", length, unit_size, variant);
+                free(out_file);
+
+                if (variant == 2) {
+                    cipher_file_stream(Nk, key, out_dir, back_dir, 0, &options);
+                } else {
+                    cipher_file(4, Nk, key, out_dir, back_dir, 0, &options);
+                }
+                out_file = read_file(back_dir, &out_length);
+                check(out_length == length && memcmp(out_file, plaintext, length) == 0,
+                      "xts: round trip of %zu bytes in %zu-byte units (variant %u) failed", length, unit_size, variant);
+                free(out_file);
+            }
+
+            // a few random ranges, and one from the start to the end
+            for (unsigned r = 0; r < 4; ++r) {
+                ByteRange range = {0, length};
+                if (r) {
+                    range.offset = next_random() % length;
+                    range.length = 1 + next_random() % (length - range.offset);
+                }
+                options.range = &range;
+                options.threads = 1 + r;
+                cipher_file(4, Nk, key, out_dir, back_dir, 0, &options);
+                size_t out_length;
+                byte *out_file = read_file(back_dir, &out_length);
+                check(out_length == range.length && memcmp(out_file, plaintext + range.offset, out_length) == 0,
+                      "xts: decrypting %llu bytes at %llu of %zu failed", (unsigned long long)range.length,
+                      (unsigned long long)range.offset, length);
+                free(out_file);
+            }
+            ByteRange outside = {length - 1, 2};
+            options.range = &outside;
+            check(file_fails(key, out_dir, back_dir, 0, &options), "xts: a range past the end of %zu bytes was accepted", length);
+        }
+    }
+
+    // too short for a block, and a last data unit shorter than a block
+    static const char key[] = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+    options = (CipherOptions){MODE_XTS, .unit_size = 512};
+    write_file(in_dir, plaintext, 15);
+    check(file_fails(key, in_dir, out_dir, 1, &options), "xts: 15 bytes were accepted");
+    write_file(in_dir, plaintext, 1024 + 8);
+    check(file_fails(key, in_dir, out_dir, 1, &options), "xts: a last unit of 8 bytes was accepted");
+
+    free(plaintext);
+    free(expected);
+    remove(in_dir);
+    remove(out_dir);
+    remove(back_dir);
+}
+
+// gcm_aad() against test case 4 of the GCM specification and a longer message
+// with a 20-byte IV, through both GHASH implementations, then containers of
+// several chunk sizes through the parallel and streaming paths, ranges, and
+// modified containers, which must be rejected.
+static void test_container(void) {
+    byte key_bytes[32], iv[12], aad[20], in[64], out[64], tag[16];
+    char hex[129];
+    hex_to_bytes("feffe9928665731c6d6a8f9467308308", key_bytes);
+    hex_to_bytes("cafebabefacedbaddecaf888", iv);
+    hex_to_bytes("feedfacedeadbeeffeedfacedeadbeefabaddad2", aad);
+    hex_to_bytes("d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                 "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39", in);
+    KeySchedule schedule;
+    KeyExpansion(4, 10, (const word *)key_bytes, 4, &schedule);
+    // the table implementation first, as the other is checked against it
+    static const char *const ghashes[] = {"table", "clmul"};
+    byte long_iv[20], long_in[1000], long_out[2][1000], long_tags[2][16];
+    fill_random(long_iv, sizeof(long_iv));
+    fill_random(long_in, sizeof(long_in));
+    for (size_t g = 0; g < sizeof(ghashes) / sizeof(ghashes[0]); ++g) {
+        if (!ghash_select(ghashes[g])) continue;
+        GcmState gcm;
+        gcm_init(&gcm, 10, &schedule, iv, 12);
+        gcm_aad(&gcm, 20, aad);
+        gcm_encrypt(&gcm, 60, in, out);
+        gcm_finish(&gcm, tag);
+        bytes_to_hex(out, 60, hex);
+        check(strcmp(hex, "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+                          "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091") == 0,
+              "gcm %s: with AAD, encryption gave %s", ghashes[g], hex);
+        bytes_to_hex(tag, 16, hex);
+        check(strcmp(hex, "5bc94fbc3221a5db94fae95ae7121a47") == 0, "gcm %s: with AAD, the tag was %s", ghashes[g], hex);
+
+        gcm_init(&gcm, 10, &schedule, long_iv, sizeof(long_iv));
+        gcm_aad(&gcm, 20, aad);
+        gcm_encrypt(&gcm, sizeof(long_in), long_in, long_out[g]);
+        gcm_finish(&gcm, long_tags[g]);
+        if (g == 0) continue;
+        check(memcmp(long_out[g], long_out[0], sizeof(long_in)) == 0 && memcmp(long_tags[g], long_tags[0], 16) == 0,
+              "gcm %s: a 20-byte IV and 1000 bytes differ from the table GHASH", ghashes[g]);
+    }
+    ghash_select(NULL);
+
+    const size_t lengths[] = {0, 1, 4095, 65536, 65537, 200003};
+    const size_t chunk_sizes[] = {1024, 0};
+    const size_t max_length = 200003;
+    byte *plaintext = (byte *)malloc(max_length);
+    char *in_dir = temp_path("container.in"), *out_dir = temp_path("container.out"), *back_dir = temp_path("container.back");
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        const size_t length = lengths[l];
+        fill_random(plaintext, length);
+        write_file(in_dir, plaintext, length);
+
+        for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++c) {
+            const unsigned Nk = 4 + 2 * (unsigned)(next_random() % 3);
+            char key[65];
+            fill_random(key_bytes, 4 * Nk);
+            bytes_to_hex(key_bytes, 4 * Nk, key);
+
+            for (unsigned variant = 0; variant < 3; ++variant) {
+                // one thread, four threads, and streamed from the standard input
+                CipherOptions options = {MODE_CONTAINER, NULL, variant ? 4 : 1, .unit_size = chunk_sizes[c]};
+                if (variant == 2) {
+                    cipher_file_stream(Nk, key, in_dir, out_dir, 1, &options);
+                    cipher_file_stream(Nk, key, out_dir, back_dir, 0, &options);
+                } else {
+                    cipher_file(4, Nk, key, in_dir, out_dir, 1, &options);
+                    cipher_file(4, Nk, key, out_dir, back_dir, 0, &options);
+                }
+                size_t back_length;
+                byte *back = read_file(back_dir, &back_length);
+                check(back && back_length == length && memcmp(back, plaintext, length) == 0,
+                      "container: round trip of %zu bytes in %zu-byte chunks (variant %u) failed", length, chunk_sizes[c], variant);
+                free(back);
+                remove(back_dir);
+            }
+            if (!length) continue;
+
+            CipherOptions options = {MODE_CONTAINER, NULL, 3, .unit_size = chunk_sizes[c]};
+            for (unsigned r = 0; r < 4; ++r) {
+                ByteRange range = {next_random() % length, 0};
+                range.length = 1 + next_random() % (length - range.offset);
+                options.range = &range;
+                cipher_file(4, Nk, key, out_dir, back_dir, 0, &options);
+                size_t back_length;
+                byte *back = read_file(back_dir, &back_length);
+                check(back && back_length == range.length && memcmp(back, plaintext + range.offset, back_length) == 0,
+                      "container: decrypting %llu bytes at %llu of %zu failed", (unsigned long long)range.length,
+                      (unsigned long long)range.offset, length);
+                free(back);
+            }
+            ByteRange outside = {length, 1};
+            options.range = &outside;
+            check(file_fails(key, out_dir, back_dir, 0, &options), "container: a range past the end of %zu bytes was accepted", length);
+            options.range = NULL;
+
+            // a change anywhere, or a missing last chunk, must be detected
+            size_t out_length;
+            byte *container = read_file(out_dir, &out_length);
+            const size_t position = next_random() % out_length;
+            container[position] ^= (byte)(1 + next_random() % 255);
+            write_file(out_dir, container, out_length);
+            check(file_fails(key, out_dir, back_dir, 0, &options), "container: a change at %zu of %zu was accepted", position, out_length);
+            write_file(out_dir, container, CONTAINER_HEADER_SIZE + (out_length - CONTAINER_HEADER_SIZE) / 2);
+            check(file_fails(key, out_dir, back_dir, 0, &options), "container: a truncated container of %zu was accepted", out_length);
+            free(container);
+        }
+    }
+
+    free(plaintext);
+    remove(in_dir);
+    remove(out_dir);
+    remove(back_dir);
+}
+
+static atomic_uint pool_runs[64];
+
+// Task i pushes tasks 2i and 2i + 1, so every index from 1 runs exactly once
+// however the tasks are stolen.
+static void pool_task(WorkPool *pool, unsigned worker, void *context) {
+    const size_t i = (size_t)(uintptr_t)context;
+    atomic_fetch_add(&pool_runs[i], 1);
+    for (size_t child = 2 * i; child <= 2 * i + 1 && child < 64; ++child) {
+        work_pool_push(pool, worker, pool_task, (void *)(uintptr_t)child);
+    }
+}
+
+static void test_work_pool(void) {
+    for (unsigned threads = 1; threads <= 8; threads *= 2) {
+        for (size_t i = 0; i < 64; ++i) atomic_init(&pool_runs[i], 0);
+        WorkPool *pool = work_pool_new(threads);
+        work_pool_push(pool, 0, pool_task, (void *)(uintptr_t)1);
+        work_pool_run(pool);
+        work_pool_free(pool);
+        unsigned wrong = 0;
+        for (size_t i = 1; i < 64; ++i) wrong += atomic_load(&pool_runs[i]) != 1;
+        check(wrong == 0, "work pool: %u of 63 tasks did not run once on %u threads", wrong, threads);
+    }
+}
+
+// The directory mode against the file mode, with files that are split into
+// several chunks and files that are not.
+static void test_tree(void) {
+    static const char *const names[] = {"empty", "a", "sub/b", "sub/c", "sub/deeper/d", "e"};
+    static const size_t lengths[] = {0, 17, 4096, 20000, 70001, 4095};
+    enum { FILES = sizeof(names) / sizeof(names[0]) };
+    char in_root[4096], out_root[4096], back_root[4096], path[3][4096];
+    snprintf(in_root, sizeof(in_root), "%s", temp_path("tree.in"));
+    snprintf(out_root, sizeof(out_root), "%s", temp_path("tree.out"));
+    snprintf(back_root, sizeof(back_root), "%s", temp_path("tree.back"));
+    char *expected_dir = temp_path("tree.expected");
+
+    mkdir(in_root, 0777);
+    snprintf(path[0], sizeof(path[0]), "%s/sub", in_root);
+    mkdir(path[0], 0777);
+    snprintf(path[0], sizeof(path[0]), "%s/sub/deeper", in_root);
+    mkdir(path[0], 0777);
+    byte *plaintext[FILES];
+    for (size_t f = 0; f < FILES; ++f) {
+        plaintext[f] = (byte *)malloc(lengths[f] + 1);
+        fill_random(plaintext[f], lengths[f]);
+        snprintf(path[0], sizeof(path[0]), "%s/%s", in_root, names[f]);
+        write_file(path[0], plaintext[f], lengths[f]);
+    }
+
+    const unsigned Nk = 4 + 2 * (unsigned)(next_random() % 3);
+    byte key_bytes[32];
+    char key[65];
+    fill_random(key_bytes, 4 * Nk);
+    bytes_to_hex(key_bytes, 4 * Nk, key);
+    CipherOptions options = {MODE_ECB, NULL, 4, 4096};
+    cipher_tree(4, Nk, key, in_root, out_root, 1, &options);
+    options.threads = 3;
+    cipher_tree(4, Nk, key, out_root, back_root, 0, &options);
+
+    for (size_t f = 0; f < FILES; ++f) {
+        snprintf(path[0], sizeof(path[0]), "%s/%s", in_root, names[f]);
+        snprintf(path[1], sizeof(path[1]), "%s/%s", out_root, names[f]);
+        snprintf(path[2], sizeof(path[2]), "%s/%s", back_root, names[f]);
+        cipher_file(4, Nk, key, path[0], expected_dir, 1, &options);
+
+        size_t expected_length, out_length, back_length;
+        byte *expected = read_file(expected_dir, &expected_length);
+        byte *out = read_file(path[1], &out_length);
+        byte *back = read_file(path[2], &back_length);
+        check(out && out_length == expected_length && memcmp(out, expected, out_length) == 0,
+              "tree: encrypting %s (%zu bytes) differs from the file mode", names[f], lengths[f]);
+        check(back && back_length == lengths[f] && memcmp(back, plaintext[f], lengths[f]) == 0,
+              "tree: round trip of %s (%zu bytes) failed", names[f], lengths[f]);
+        free(expected);
+        free(out);
+        free(back);
+        free(plaintext[f]);
+        for (unsigned k = 0; k < 3; ++k) remove(path[k]);
+    }
+
+    const char *const directories[] = {"sub/deeper", "sub", ""};
+    for (size_t d = 0; d < 3; ++d) {
+        const char *const roots[] = {in_root, out_root, back_root};
+        for (unsigned k = 0; k < 3; ++k) {
+            snprintf(path[0], sizeof(path[0]), "%s/%s", roots[k], directories[d]);
+            rmdir(path[0]);
+        }
+    }
+    remove(expected_dir);
+}
+
+// The library API against the same vectors, SP 800-38A F.5.1 for CTR and
+// test case 3 of the GCM specification.
+static void test_library(void) {
+    byte key[32], in[64], out[64], back[64], iv[16], tag[16], expected[64];
+    char hex[129];
+    AesContext *context;
+
+    for (size_t i = 0; i < sizeof(kat_vectors) / sizeof(kat_vectors[0]); ++i) {
+        const KatVector *v = &kat_vectors[i];
+        hex_to_bytes(v->key, key);
+        hex_to_bytes(v->plaintext, in);
+        check(aes_context_new(&context, key, strlen(v->key) / 2) == AES_SUCCESS, "library: creating a context");
+        check(aes_encrypt(context, AES_ECB, NULL, 0, in, out, 16, NULL) == AES_SUCCESS, "library: ECB encryption");
+        bytes_to_hex(out, 16, hex);
+        check(strcmp(hex, v->ciphertext) == 0, "library: encrypting %s with key %s gave %s", v->plaintext, v->key, hex);
+        check(aes_decrypt(context, AES_ECB, NULL, 0, out, out, 16, NULL) == AES_SUCCESS && memcmp(out, in, 16) == 0,
+              "library: decrypting %s with key %s", v->ciphertext, v->key);
+        aes_context_free(context);
+    }
+
+    hex_to_bytes("2b7e151628aed2a6abf7158809cf4f3c", key);
+    hex_to_bytes("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv);
+    hex_to_bytes("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51", in);
+    hex_to_bytes("874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff", expected);
+    check(aes_context_new(&context, key, 16) == AES_SUCCESS, "library: creating a context");
+    check(aes_encrypt(context, AES_CTR, iv, 16, in, out, 32, NULL) == AES_SUCCESS && memcmp(out, expected, 32) == 0, "library: CTR encryption");
+    check(aes_decrypt(context, AES_CTR, iv, 16, out, back, 29, NULL) == AES_SUCCESS && memcmp(back, in, 29) == 0, "library: CTR decryption of a partial block");
+    check(aes_encrypt(context, AES_CTR, iv, 12, in, out, 32, NULL) == AES_INVALID_IV, "library: CTR with a short IV was accepted");
+    check(aes_encrypt(context, AES_ECB, NULL, 0, in, out, 20, NULL) == AES_INVALID_LENGTH, "library: ECB with a partial block was accepted");
+    check(aes_encrypt(context, (AesMode)7, NULL, 0, in, out, 16, NULL) == AES_INVALID_MODE, "library: an unknown mode was accepted");
+    check(aes_context_set_key(context, key, 20) == AES_INVALID_KEY, "library: a 20-byte key was accepted");
+
+    hex_to_bytes("feffe9928665731c6d6a8f9467308308", key);
+    hex_to_bytes("cafebabefacedbaddecaf888", iv);
+    hex_to_bytes("d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                 "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", in);
+    hex_to_bytes("42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+                 "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985", expected);
+    check(aes_context_set_key(context, key, 16) == AES_SUCCESS, "library: changing the key");
+    check(aes_encrypt(context, AES_GCM, iv, 12, in, out, 64, tag) == AES_SUCCESS && memcmp(out, expected, 64) == 0, "library: GCM encryption");
+    bytes_to_hex(tag, 16, hex);
+    check(strcmp(hex, "4d5c2af327cd64a62cf35abd2ba6fab4") == 0, "library: GCM tag %s", hex);
+    check(aes_decrypt(context, AES_GCM, iv, 12, out, back, 64, tag) == AES_SUCCESS && memcmp(back, in, 64) == 0, "library: GCM decryption");
+    out[17] ^= 1;
+    byte zeros[64] = {0};
+    check(aes_decrypt(context, AES_GCM, iv, 12, out, back, 64, tag) == AES_AUTHENTICATION_FAILED && memcmp(back, zeros, 64) == 0,
+          "library: a modified GCM ciphertext was accepted or released");
+    aes_context_free(context);
+
+    // keys set together encrypt as the same keys set one at a time
+    enum { CONTEXTS = 10 };
+    static byte keys[CONTEXTS * 32];
+    AesContext *contexts[CONTEXTS];
+    fill_random(keys, sizeof(keys));
+    fill_random(in, 16);
+    for (unsigned i = 0; i < CONTEXTS; ++i) aes_context_new(&contexts[i], keys, 16);
+    for (size_t key_length = 16; key_length <= 32; key_length += 8) {
+        check(aes_context_set_keys(contexts, CONTEXTS, keys, key_length) == AES_SUCCESS, "library: setting %zu-byte keys", key_length);
+        for (unsigned i = 0; i < CONTEXTS; ++i) {
+            check(aes_context_new(&context, keys + i * key_length, key_length) == AES_SUCCESS, "library: creating a context");
+            aes_encrypt(context, AES_ECB, NULL, 0, in, expected, 16, NULL);
+            aes_encrypt(contexts[i], AES_ECB, NULL, 0, in, out, 16, NULL);
+            check(memcmp(out, expected, 16) == 0, "library: context %u of %u set together encrypts differently", i, CONTEXTS);
+            aes_decrypt(contexts[i], AES_ECB, NULL, 0, out, back, 16, NULL);
+            check(memcmp(back, in, 16) == 0, "library: context %u of %u set together decrypts differently", i, CONTEXTS);
+            aes_context_free(context);
+        }
+    }
+    check(aes_context_set_keys(contexts, CONTEXTS, keys, 20) == AES_INVALID_KEY, "library: setting 20-byte keys was accepted");
+
+    // byte buffers need no alignment, here over more than one batch of blocks
+    enum { ECB_LENGTH = 16 * 100 };
+    static byte ecb_in[ECB_LENGTH + 1], ecb_out[ECB_LENGTH + 1], ecb_back[ECB_LENGTH + 1];
+    static alignas(16) byte ecb_expected[ECB_LENGTH];
+    fill_random(ecb_in, sizeof(ecb_in));
+    memcpy(ecb_expected, ecb_in + 1, ECB_LENGTH);
+    // the contexts were last given 32-byte keys
+    word key_words[8];
+    memcpy(key_words, keys, 32);
+    KeySchedule schedule;
+    KeyExpansion(4, 14, key_words, 8, &schedule);
+    CipherBlocks(4, 14, ECB_LENGTH / 16, (const word *)ecb_expected, (word *)ecb_expected, &schedule);
+    check(aes_encrypt(contexts[0], AES_ECB, NULL, 0, ecb_in + 1, ecb_out + 1, ECB_LENGTH, NULL) == AES_SUCCESS &&
+              memcmp(ecb_out + 1, ecb_expected, ECB_LENGTH) == 0,
+          "library: ECB encryption of misaligned buffers");
+    check(aes_decrypt(contexts[0], AES_ECB, NULL, 0, ecb_out + 1, ecb_back + 1, ECB_LENGTH, NULL) == AES_SUCCESS &&
+              memcmp(ecb_back + 1, ecb_in + 1, ECB_LENGTH) == 0,
+          "library: ECB decryption of misaligned buffers");
+    aes_context_free(contexts[CONTEXTS - 1]);
+    contexts[CONTEXTS - 1] = NULL;
+    check(aes_context_set_keys(contexts, CONTEXTS, keys, 16) == AES_INVALID_ARGUMENT, "library: setting keys with a NULL context was accepted");
+    for (unsigned i = 0; i < CONTEXTS - 1; ++i) aes_context_free(contexts[i]);
+}
+
+// Connects to the server at path, waiting for it to start listening.
+static int serve_connect(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    for (unsigned attempt = 0; attempt < 500; ++attempt) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (const struct sockaddr *)&address, sizeof(address)) == 0) return fd;
+        close(fd);
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+    }
+    return -1;
+}
+
+// Sends a request and reads the result into out[]. Returns the status, or -1
+// if the response is not as long as it should be.
+static int serve_request(int fd, int for_encryption, AesMode mode, const byte key[], size_t key_length,
+                         const byte iv[], size_t iv_length, const byte data[], size_t length, byte out[]) {
+    const size_t body_length = 4 + key_length + iv_length + length;
+    byte *request = (byte *)malloc(4 + body_length);
+    for (unsigned i = 0; i < 4; ++i) request[i] = (byte)(body_length >> (8 * i));
+    request[4] = for_encryption ? 0 : 1;
+    request[5] = (byte)mode;
+    request[6] = (byte)key_length;
+    request[7] = (byte)iv_length;
+    memcpy(request + 8, key, key_length);
+    if (iv_length) memcpy(request + 8 + key_length, iv, iv_length);
+    if (length) memcpy(request + 8 + key_length + iv_length, data, length);
+    const int sent = write(fd, request, 4 + body_length) == (ssize_t)(4 + body_length);
+    free(request);
+
+    byte header[5];
+    size_t received = 0;
+    for (ssize_t n; sent && received < sizeof(header) && (n = read(fd, header + received, sizeof(header) - received)) > 0;) {
+        received += (size_t)n;
+    }
+    if (received < sizeof(header)) return -1;
+    const size_t response_length = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+    const size_t expected = header[4] == AES_SUCCESS ? length : 0;
+    if (response_length != 1 + expected) return -1;
+    for (received = 0; received < expected;) {
+        const ssize_t n = read(fd, out + received, expected - received);
+        if (n <= 0) return -1;
+        received += (size_t)n;
+    }
+    return header[4];
+}
+
+typedef struct ServeClient {
+    const char *path;
+    unsigned number;
+    unsigned failures;
+} ServeClient;
+
+// Many small requests in both modes under two keys, each checked against the
+// engine, so that the server has requests from several clients to batch.
+static void *serve_client(void *arg) {
+    ServeClient *client = (ServeClient *)arg;
+    const int fd = serve_connect(client->path);
+    word key_words[8], buffer[64];
+    byte *key = (byte *)key_words, iv[16], in[256], out[256], expected[256];
+    KeySchedule schedule;
+
+    for (unsigned i = 0; i < 64; ++i) {
+        const size_t key_length = (client->number + i) % 2 ? 32 : 16;
+        const size_t length = 16 * (1 + (client->number * 7 + i) % 16);
+        const AesMode mode = i % 3 ? AES_ECB : AES_CTR;
+        for (size_t k = 0; k < 32; ++k) key[k] = (byte)(k * 3 + key_length);
+        for (size_t k = 0; k < sizeof(iv); ++k) iv[k] = (byte)(client->number + i + k);
+        for (size_t k = 0; k < length; ++k) in[k] = (byte)(client->number * 31 + i * 17 + k);
+        // CTR requests need not be whole blocks
+        const size_t data_length = mode == AES_CTR ? length - i % 16 : length;
+
+        KeyExpansion(4, (unsigned)key_length / 4 + 6, key_words, (unsigned)key_length / 4, &schedule);
+        if (mode == AES_CTR) {
+            ctr_blocks(4, schedule.Nr, &schedule, iv, 0, data_length, in, expected);
+        } else {
+            memcpy(buffer, in, length);
+            CipherBlocks(4, schedule.Nr, length / 16, buffer, buffer, &schedule);
+            memcpy(expected, buffer, length);
+        }
+        if (serve_request(fd, 1, mode, key, key_length, iv, mode == AES_CTR ? 16 : 0, in, data_length, out) != AES_SUCCESS ||
+            memcmp(out, expected, data_length) != 0 ||
+            serve_request(fd, 0, mode, key, key_length, iv, mode == AES_CTR ? 16 : 0, out, data_length, out) != AES_SUCCESS ||
+            memcmp(out, in, data_length) != 0) {
+            ++client->failures;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// The server against the FIPS-197 and SP 800-38A vectors, with invalid
+// requests, a request larger than a batch, and concurrent clients.
+static void test_serve(void) {
+    const char *path = temp_path("serve.sock");
+    CipherOptions options = {MODE_ECB, NULL, 4, 0, 0, NULL, 0, NULL};
+
+    // a socket nothing listens on, as a server that was killed leaves, is replaced
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    const int stale_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    check(bind(stale_fd, (const struct sockaddr *)&address, sizeof(address)) == 0, "serve: could not leave a socket at %s", path);
+    close(stale_fd);
+
+    fflush(NULL);
+    const pid_t pid = fork();
+    if (pid == 0) serve(path, &options);
+
+    const int fd = serve_connect(path);
+    check(fd >= 0, "serve: could not connect to %s", path);
+    if (fd < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    struct stat socket_stat;
+    check(stat(path, &socket_stat) == 0 && (socket_stat.st_mode & 077) == 0, "serve: the socket is open to other users");
+
+    byte key[32], iv[16], in[64], out[64], expected[64];
+    char hex[129];
+    for (size_t i = 0; i < sizeof(fips197_vectors) / sizeof(fips197_vectors[0]); ++i) {
+        const KatVector *v = &fips197_vectors[i];
+        const size_t key_length = strlen(v->key) / 2;
+        hex_to_bytes(v->key, key);
+        hex_to_bytes(v->plaintext, in);
+        check(serve_request(fd, 1, AES_ECB, key, key_length, NULL, 0, in, 16, out) == AES_SUCCESS, "serve: ECB encryption failed");
+        bytes_to_hex(out, 16, hex);
+        check(strcmp(hex, v->ciphertext) == 0, "serve: encrypting %s with key %s gave %s", v->plaintext, v->key, hex);
+        check(serve_request(fd, 0, AES_ECB, key, key_length, NULL, 0, out, 16, out) == AES_SUCCESS && memcmp(out, in, 16) == 0,
+              "serve: decrypting %s with key %s", v->ciphertext, v->key);
+    }
+
+    // SP 800-38A F.5.1
+    hex_to_bytes("2b7e151628aed2a6abf7158809cf4f3c", key);
+    hex_to_bytes(ctr_iv, iv);
+    hex_to_bytes("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+                 "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", in);
+    hex_to_bytes("874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+                 "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee", expected);
+    check(serve_request(fd, 1, AES_CTR, key, 16, iv, 16, in, 64, out) == AES_SUCCESS && memcmp(out, expected, 64) == 0,
+          "serve: CTR encryption");
+    check(serve_request(fd, 0, AES_CTR, key, 16, iv, 16, expected, 37, out) == AES_SUCCESS && memcmp(out, in, 37) == 0,
+          "serve: CTR decryption of a partial block");
+    check(serve_request(fd, 1, AES_CTR, key, 16, iv, 16, in, 0, out) == AES_SUCCESS, "serve: an empty request failed");
+
+    check(serve_request(fd, 1, AES_ECB, key, 16, NULL, 0, in, 20, out) == AES_INVALID_LENGTH, "serve: ECB with a partial block was accepted");
+    check(serve_request(fd, 1, AES_GCM, key, 16, iv, 12, in, 16, out) == AES_INVALID_MODE, "serve: GCM was accepted");
+    check(serve_request(fd, 1, AES_ECB, key, 20, NULL, 0, in, 16, out) == AES_INVALID_KEY, "serve: a 20-byte key was accepted");
+    check(serve_request(fd, 1, AES_CTR, key, 16, iv, 12, in, 16, out) == AES_INVALID_IV, "serve: CTR with a short IV was accepted");
+    check(serve_request(fd, 1, AES_ECB, key, 16, iv, 16, in, 16, out) == AES_INVALID_IV, "serve: ECB with an IV was accepted");
+
+    // more than a batch, which is ciphered on its own
+    const size_t length = 100000;
+    byte *large = (byte *)malloc(length), *large_out = (byte *)malloc(length), *large_expected = (byte *)malloc(length);
+    fill_random(large, length);
+    KeySchedule schedule;
+    expand_key("2b7e151628aed2a6abf7158809cf4f3c", &schedule);
+    ctr_blocks(4, schedule.Nr, &schedule, iv, 0, length, large, large_expected);
+    check(serve_request(fd, 1, AES_CTR, key, 16, iv, 16, large, length, large_out) == AES_SUCCESS &&
+          memcmp(large_out, large_expected, length) == 0, "serve: CTR encryption of %zu bytes", length);
+    free(large);
+    free(large_out);
+    free(large_expected);
+    close(fd);
+
+    enum { CLIENTS = 8 };
+    ServeClient clients[CLIENTS];
+    pthread_t threads[CLIENTS];
+    for (unsigned i = 0; i < CLIENTS; ++i) {
+        clients[i] = (ServeClient){path, i, 0};
+        pthread_create(&threads[i], NULL, serve_client, &clients[i]);
+    }
+    for (unsigned i = 0; i < CLIENTS; ++i) {
+        pthread_join(threads[i], NULL);
+        check(clients[i].failures == 0, "serve: %u requests of client %u failed", clients[i].failures, i);
+    }
+
+    // a second server must not take the socket of a running one
+    int status;
+    const pid_t second_pid = fork();
+    if (second_pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        serve(path, &options);
+    }
+    pid_t waited = 0;
+    for (unsigned attempt = 0; attempt < 500 && waited == 0; ++attempt) {
+        waited = waitpid(second_pid, &status, WNOHANG);
+        if (waited == 0) nanosleep(&(struct timespec){0, 10000000}, NULL);
+    }
+    if (waited == 0) {
+        kill(second_pid, SIGKILL);
+        waitpid(second_pid, &status, 0);
+    }
+    check(waited == second_pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE, "serve: a second server started on the same socket");
+    const int again_fd = serve_connect(path);
+    check(again_fd >= 0 && serve_request(again_fd, 1, AES_CTR, key, 16, iv, 16, in, 16, out) == AES_SUCCESS,
+          "serve: the first server could not be reached after a second one started");
+    if (again_fd >= 0) close(again_fd);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "serve: the server did not stop cleanly");
+    check(access(path, F_OK) != 0, "serve: the socket was left behind");
+}
+
+#if AES_STATS
+// Reads a counter of a stage from the totals of a JSON report.
+static unsigned long long stats_counter(const char *report, const char *stage, const char *counter) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": {", stage);
+    const char *p = strstr(report, key);
+    if (!p) return 0;
+    snprintf(key, sizeof(key), "\"%s\": ", counter);
+    p = strstr(p, key);
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+#endif
+
+// Counts of a file encrypted in ECB mode, which is padded with one block.
+// Enabling the counters cannot be undone, so this runs last.
+static void test_stats(void) {
+#if AES_STATS
+    const size_t length = 100000;
+    byte *plaintext = (byte *)malloc(length);
+    fill_random(plaintext, length);
+    const char *in_dir = temp_path("stats.in"), *out_dir = temp_path("stats.out"), *report_dir = temp_path("stats.json");
+    write_file(in_dir, plaintext, length);
+    free(plaintext);
+
+    stats_enable();
+    CipherOptions options = {MODE_ECB, NULL, 1, 0, 0, NULL, 0, NULL};
+    cipher_file(4, 4, "000102030405060708090a0b0c0d0e0f", in_dir, out_dir, 1, &options);
+    FILE *report_file = fopen(report_dir, "w");
+    stats_report(report_file, 1);
+    fclose(report_file);
+
+    size_t report_length;
+    char *report = (char *)read_file(report_dir, &report_length);
+    report[report_length] = '\0';
+    check(stats_counter(report, "key", "calls") == 1, "stats: %llu key setups", stats_counter(report, "key", "calls"));
+    check(stats_counter(report, "read", "bytes") == length, "stats: %llu bytes read", stats_counter(report, "read", "bytes"));
+    check(stats_counter(report, "cipher", "bytes") == length, "stats: %llu bytes ciphered", stats_counter(report, "cipher", "bytes"));
+    check(stats_counter(report, "write", "bytes") == (length / 16 + 1) * 16, "stats: %llu bytes written", stats_counter(report, "write", "bytes"));
+    check(strstr(report, "\"blocks\": 6250,") != NULL, "stats: blocks in %s", report);
+    check(strstr(report, "\"threads\": [{") != NULL, "stats: no threads in %s", report);
+    KeyCacheStats cache;
+    key_cache_get_stats(&cache);
+    char expected[128];
+    snprintf(expected, sizeof(expected), "\"key_cache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}",
+             (unsigned long long)cache.hits, (unsigned long long)cache.misses, (unsigned long long)cache.evictions);
+    check(strstr(report, expected) != NULL, "stats: no %s in %s", expected, report);
+    free(report);
+
+    report_file = fopen(report_dir, "w");
+    stats_report(report_file, 0);
+    fclose(report_file);
+    report = (char *)read_file(report_dir, &report_length);
+    report[report_length] = '\0';
+    snprintf(expected, sizeof(expected), "Key cache: %llu hits, %llu misses, %llu evictions.\n", (unsigned long long)cache.hits,
+             (unsigned long long)cache.misses, (unsigned long long)cache.evictions);
+    check(strstr(report, expected) != NULL, "stats: no key cache counters in %s", report);
+    free(report);
+    remove(in_dir);
+    remove(out_dir);
+    remove(report_dir);
+#endif
+}